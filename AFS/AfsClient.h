@@ -1,13 +1,28 @@
+#pragma once
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <grpc++/generic/generic_stub.h>
 #include <grpc++/grpc++.h>
+#include <grpcpp/support/client_interceptor.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <chrono>
+#include <functional>
 #include <vector>
 
 #include "afsfuse.grpc.pb.h"
 #include "file_reader_into_stream.h"
+#include "messages.h"
+#include "sequential_file_reader.h"
 #include "sequential_file_writer.h"
 #include "utils.h"
 
@@ -20,12 +35,46 @@ using grpc::ClientContext;
 using grpc::ClientReader;
 using grpc::ClientReaderWriter;
 using grpc::ClientWriter;
+using grpc::CompletionQueue;
+using grpc::GenericClientAsyncReaderWriter;
+using grpc::GenericStub;
 using grpc::Status;
 
 using namespace afsfuse;
 
 using namespace std;
 
+// Adds the id of this client to the metadata of every call, so the server can tell which
+// client holds a write delegation (see afsfuse_recalls)
+class ClientIdInterceptor : public grpc::experimental::Interceptor {
+   public:
+    explicit ClientIdInterceptor(const std::string& id) : id_(id) {}
+
+    void Intercept(grpc::experimental::InterceptorBatchMethods* methods) override {
+        if (methods->QueryInterceptionHookPoint(
+                grpc::experimental::InterceptionHookPoints::PRE_SEND_INITIAL_METADATA)) {
+            methods->GetSendInitialMetadata()->insert(std::make_pair(kClientIdKey, id_));
+        }
+        methods->Proceed();
+    }
+
+   private:
+    std::string id_;
+};
+
+class ClientIdInterceptorFactory : public grpc::experimental::ClientInterceptorFactoryInterface {
+   public:
+    explicit ClientIdInterceptorFactory(const std::string& id) : id_(id) {}
+
+    grpc::experimental::Interceptor* CreateClientInterceptor(
+        grpc::experimental::ClientRpcInfo* info) override {
+        return new ClientIdInterceptor(id_);
+    }
+
+   private:
+    std::string id_;
+};
+
 struct sdata {
     int a;
     char b[10];
@@ -34,7 +83,7 @@ struct sdata {
 class AfsClient {
    public:
     AfsClient(std::shared_ptr<Channel> channel)
-        : stub_(AFS::NewStub(channel)) {}
+        : stub_(AFS::NewStub(channel)), genericStub_(new GenericStub(channel)) {}
 
     int rpc_getattr(string path, struct stat* output) {
         Stat result;
@@ -77,6 +126,119 @@ class AfsClient {
             return -result.err();
         }
 
+        toStat(result, output);
+        return 0;
+    }
+
+    // The attributes of many paths in one call. 'reply' receives one Stat per path, in order,
+    // each with its own err. Returns 0, or a negated errno if the call itself failed.
+    int rpc_getattrBatch(const std::vector<std::string>& paths, Stats* reply) {
+        Status status;
+
+        bool isDone = false;
+        unsigned int numRetriesLeft = MAX_NUM_RETRIES;
+        unsigned int currentBackoff = INITIAL_BACKOFF_MS;
+        while (!isDone) {
+            ClientContext context;
+            Paths input;
+            for (const std::string& path : paths) {
+                input.add_paths(path);
+            }
+            reply->Clear();
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::milliseconds(currentBackoff);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            status = stub_->afsfuse_getattrBatch(&context, input, reply);
+            currentBackoff *= MULTIPLIER;
+            if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED || numRetriesLeft-- == 0) {
+                isDone = true;
+            }
+            else {
+                printf("%s \t : Timed out to contact server. Retrying...\n", __func__);
+            }
+        }
+
+        if (!status.ok() || reply->stats_size() != (int)paths.size()) {
+            return -EIO;
+        }
+        return 0;
+    }
+
+    // Not retried: the caller polls and simply asks again on its next round
+    int rpc_changesSince(const ChangesRequest& request, ChangesReply* reply, int timeout_ms) {
+        ClientContext context;
+        context.set_wait_for_ready(true);
+        context.set_deadline(std::chrono::system_clock::now() +
+                             std::chrono::milliseconds(timeout_ms));
+
+        Status status = stub_->afsfuse_changesSince(&context, request, reply);
+        if (!status.ok()) {
+            return -EIO;
+        }
+        return 0;
+    }
+
+    // Ask for the write delegation of 'path', or renew it. Not retried: delegations are only an
+    // optimisation, the caller carries on without one.
+    int rpc_delegate(const std::string& path, bool* granted, unsigned* lease_ms) {
+        ClientContext context;
+        DelegateRequest request;
+        DelegateReply reply;
+        request.set_path(path);
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+
+        Status status = stub_->afsfuse_delegate(&context, request, &reply);
+        if (!status.ok()) {
+            return -EIO;
+        }
+        *granted = reply.granted();
+        *lease_ms = reply.lease_ms();
+        return 0;
+    }
+
+    int rpc_returnDelegation(const std::string& path) {
+        ClientContext context;
+        DelegateRequest request;
+        OutputInfo reply;
+        request.set_path(path);
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+
+        Status status = stub_->afsfuse_returnDelegation(&context, request, &reply);
+        if (!status.ok()) {
+            return -EIO;
+        }
+        return -reply.err();
+    }
+
+    // Listen for recalls of the delegations held by this client until the stream ends or
+    // 'context' is cancelled. The first message, with an empty path, tells that the server
+    // registered the stream. Returns 0 if the server ended the stream, -EIO otherwise.
+    int rpc_recalls(ClientContext* context, const std::function<void(const Recall&)>& consumer) {
+        String request;
+        context->set_wait_for_ready(true);
+
+        std::unique_ptr<ClientReader<Recall>> reader(stub_->afsfuse_recalls(context, request));
+        Recall recall;
+        while (reader->Read(&recall)) {
+            consumer(recall);
+        }
+
+        Status status = reader->Finish();
+        if (!status.ok()) {
+            return -EIO;
+        }
+        return 0;
+    }
+
+    // Copy the attributes returned by the server into 'output'
+    static void toStat(const Stat& result, struct stat* output) {
+        memset(output, 0, sizeof(struct stat));
         output->st_ino = result.ino();
         output->st_mode = result.mode();
         output->st_nlink = result.nlink();
@@ -92,7 +254,6 @@ class AfsClient {
         output->st_atim.tv_nsec = result.atimtvnsec();
         output->st_mtim.tv_sec = result.mtimtvsec();
         output->st_mtim.tv_nsec = result.mtimtvnsec();
-        return 0;
     }
 
     int rpc_readdir(string p, void* buf, fuse_fill_dir_t filler) {
@@ -221,6 +382,10 @@ class AfsClient {
             currentBackoff *= MULTIPLIER;
             if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED || numRetriesLeft-- == 0) {
                 isDone = true;
+                // A failed call must not look like a short read at the end of the file
+                if (!status.ok()) {
+                    return -EIO;
+                }
             }
             else {
                 printf("%s \t : Timed out to contact server. Retrying...\n", __func__);
@@ -232,13 +397,22 @@ class AfsClient {
         }
         
         if (rres.err() == 0) {
-            strcpy(buf, rres.buffer().c_str());
-            return rres.bytesread();
+            // Binary data, which may hold NULs
+            memcpy(buf, rres.buffer().data(), rres.buffer().size());
+            return rres.buffer().size();
         } else {
             return -rres.err();
         }
     }
 
+    // Start reading a range of a file without waiting for it. 'done' gets the status of the call,
+    // on a gRPC thread. 'reply' may be reused from call to call: its buffer stays allocated.
+    void rpc_readAsync(ClientContext* context, const ReadRequest* request, ReadResult* reply,
+                       std::function<void(Status)> done) {
+        context->set_wait_for_ready(true);
+        stub_->async()->afsfuse_read(context, request, reply, std::move(done));
+    }
+
     int rpc_write(const char* path, const char* buf, size_t size, off_t offset,
                   struct fuse_file_info* fi) {
         WriteResult wres;
@@ -252,7 +426,7 @@ class AfsClient {
             wreq.set_path(path);
             wreq.set_size(size);
             wreq.set_offset(offset);
-            wreq.set_buffer(buf);
+            wreq.set_buffer(buf, size);
 
             // Set timeout for API
             std::chrono::system_clock::time_point deadline =
@@ -284,6 +458,14 @@ class AfsClient {
         }
     }
 
+    // Start writing a range of a file without waiting for it. 'done' gets the status of the call,
+    // on a gRPC thread.
+    void rpc_writeAsync(ClientContext* context, const WriteRequest* request, WriteResult* reply,
+                        std::function<void(Status)> done) {
+        context->set_wait_for_ready(true);
+        stub_->async()->afsfuse_write(context, request, reply, std::move(done));
+    }
+
     int rpc_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
         CreateResult cres;
 
@@ -579,6 +761,203 @@ class AfsClient {
         return -result.err();
     }
 
+    // Run the operations of 'request' on the server in a single round trip. Returns 0 if all of
+    // them succeeded, otherwise the negated error of the one that failed, which is the last
+    // entry of reply->results().
+    int rpc_compound(const CompoundRequest& request, CompoundReply* reply) {
+        bool isDone = false;
+        unsigned int numRetriesLeft = MAX_NUM_RETRIES;
+        unsigned int currentBackoff = INITIAL_BACKOFF_MS;
+        while (!isDone) {
+            ClientContext context;
+            reply->Clear();
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::milliseconds(currentBackoff);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            Status status = stub_->afsfuse_compound(&context, request, reply);
+            // printf("%s \t : Backoff - %dms\n", __func__, currentBackoff);
+            currentBackoff *= MULTIPLIER;
+            if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED || numRetriesLeft-- == 0) {
+                isDone = true;
+            }
+            else {
+                printf("%s \t : Timed out to contact server. Retrying...\n", __func__);
+            }
+        }
+
+        if (reply->results_size() == 0) {
+            return request.ops_size() == 0 ? 0 : -EIO;
+        }
+        return -reply->results(reply->results_size() - 1).err();
+    }
+
+    // Attributes of 'path', plus its whole content in 'content' if it is a regular file of at
+    // most 'maxInline' bytes. 'inlined' tells whether the content was returned.
+    int rpc_lookup(const char* path, unsigned long maxInline, struct stat* output,
+                   string* content, bool* inlined) {
+        LookupReply result;
+
+        bool isDone = false;
+        unsigned int numRetriesLeft = MAX_NUM_RETRIES;
+        unsigned int currentBackoff = INITIAL_BACKOFF_MS;
+        while (!isDone) {
+            ClientContext context;
+            LookupRequest input;
+            input.set_path(path);
+            input.set_max_inline(maxInline);
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::milliseconds(currentBackoff);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            Status status = stub_->afsfuse_lookup(&context, input, &result);
+            // printf("%s \t : Backoff - %dms\n", __func__, currentBackoff);
+            currentBackoff *= MULTIPLIER;
+            if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED || numRetriesLeft-- == 0) {
+                isDone = true;
+            }
+            else {
+                printf("%s \t : Timed out to contact server. Retrying...\n", __func__);
+            }
+        }
+
+        *inlined = false;
+        if (result.err() != 0) {
+            return -result.err();
+        }
+
+        toStat(result.stat(), output);
+        if (result.inlined()) {
+            content->swap(*result.mutable_content());
+            *inlined = true;
+        }
+        return 0;
+    }
+
+    // Store a whole small file in one unary call. 'output' receives the attributes the file
+    // has on the server afterwards.
+    int rpc_putSmall(const char* path, const string& content, mode_t mode, struct stat* output) {
+        Stat result;
+
+        bool isDone = false;
+        unsigned int numRetriesLeft = MAX_NUM_RETRIES;
+        unsigned int currentBackoff = INITIAL_BACKOFF_MS;
+        while (!isDone) {
+            ClientContext context;
+            SmallFile input;
+            input.set_path(path);
+            input.set_content(content);
+            input.set_mode(mode);
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::milliseconds(currentBackoff);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            Status status = stub_->afsfuse_putSmall(&context, input, &result);
+            // printf("%s \t : Backoff - %dms\n", __func__, currentBackoff);
+            currentBackoff *= MULTIPLIER;
+            if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED || numRetriesLeft-- == 0) {
+                isDone = true;
+            }
+            else {
+                printf("%s \t : Timed out to contact server. Retrying...\n", __func__);
+            }
+        }
+
+        if (result.err() != 0) {
+            return -result.err();
+        }
+        toStat(result, output);
+        return 0;
+    }
+
+    // Upload many small files over one stream, one message of 'messages' after the other.
+    // 'reply' receives one Stat per file, in order. Retried as a whole if the stream fails,
+    // which is safe as every file is stored atomically with the same content.
+    int rpc_putBatch(const std::vector<BatchPutRequest>& messages, BatchPutReply* reply) {
+        unsigned int numRetriesLeft = 3;
+        while (numRetriesLeft > 0) {
+            ClientContext context;
+            reply->Clear();
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::seconds(300);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            std::unique_ptr<ClientWriter<BatchPutRequest>> writer(
+                stub_->afsfuse_putBatch(&context, reply));
+            for (const BatchPutRequest& message : messages) {
+                if (!writer->Write(message)) {
+                    break;
+                }
+            }
+            writer->WritesDone();
+            Status status = writer->Finish();
+
+            numRetriesLeft--;
+            if (status.ok()) {
+                return 0;
+            }
+            if (numRetriesLeft == 0) {
+                std::cerr << "Batch upload rpc failed: " << status.error_message()
+                          << std::endl;
+                return -EIO;
+            }
+            printf("%s \t : Failed to send batch to server. Retrying...\n", __func__);
+        }
+        return -EIO;
+    }
+
+    // Fetch many files over one stream (see BulkFetchRequest). Each message is handed to
+    // 'consumer' as soon as it arrives, so the caller can store files while the rest are still
+    // on the way. Not retried: a bulk fetch is only ever a prefetch.
+    int rpc_bulkFetch(const BulkFetchRequest& request,
+                      const std::function<void(std::unique_ptr<BulkFetchReply>)>& consumer) {
+        ClientContext context;
+
+        // Set timeout for API
+        std::chrono::system_clock::time_point deadline =
+            std::chrono::system_clock::now() +
+            std::chrono::seconds(300);
+
+        context.set_wait_for_ready(true);
+        context.set_deadline(deadline);
+
+        std::unique_ptr<ClientReader<BulkFetchReply>> reader(
+            stub_->afsfuse_bulkFetch(&context, request));
+        std::unique_ptr<BulkFetchReply> reply(new BulkFetchReply());
+        while (reader->Read(reply.get())) {
+            consumer(std::move(reply));
+            reply.reset(new BulkFetchReply());
+        }
+
+        Status status = reader->Finish();
+        if (!status.ok()) {
+            std::cerr << "Bulk fetch of " << request.dir() << " failed: "
+                      << status.error_message() << std::endl;
+            return -EIO;
+        }
+        return 0;
+    }
+
     int rpc_putFile(const char* root, const char* path) {
         // printf("%s : %s\n", __func__, path);
         unsigned int numRetriesLeft = 3;
@@ -606,7 +985,7 @@ class AfsClient {
                 const size_t chunk_size =
                     1UL << 20;  // Hardcoded to 1MB, which seems to be recommended
                                 // from experience.
-                reader.Read(chunk_size);
+                reader.Read(chunk_size, true);
             } catch (const std::exception& ex) {
                 std::cerr << "Failed to send the file " << path << ": " << ex.what()
                         << std::endl;
@@ -650,7 +1029,7 @@ class AfsClient {
             ClientContext context;
             SequentialFileWriter writer;
             std::string filename = std::string(rootDir) + string(path);
-            std::string tempFileName = filename + "_" + to_string(rand() % 1000) + ".txt";
+            std::string tempFileName = filename + "_" + unique_suffix() + ".txt";
             
             // Set timeout for API
             std::chrono::system_clock::time_point deadline =
@@ -661,15 +1040,25 @@ class AfsClient {
             context.set_deadline(deadline);
 
             requestedFile.set_path(path);
+            requestedFile.set_sparse(true);
             std::unique_ptr<ClientReader<FileContent>> reader(
                 stub_->afsfuse_getFile(&context, requestedFile));
             try {
+                int64_t sparseSize = -1;  // Size of the file, if it arrives sparse
                 while (reader->Read(&contentPart)) {
                     
                     writer.OpenIfNecessary(tempFileName);
                     auto* const data = contentPart.mutable_content();
-                    writer.Write(*data);
+                    if (contentPart.sparse()) {
+                        writer.WriteAt(*data, contentPart.offset());
+                        sparseSize = contentPart.file_size();
+                    } else {
+                        writer.Write(*data);
+                    }
                 };
+                if (sparseSize >= 0) {
+                    writer.SetSize(sparseSize);
+                }
                 const auto status = reader->Finish();
                 numRetriesLeft--;
                 currentBackoff *= MULTIPLIER;
@@ -702,7 +1091,200 @@ class AfsClient {
         return false;
     }
 
+    // Zero-copy variant of rpc_putFile. The file is mmap()ed and sent as raw ByteBuffer
+    // chunks pointing into the mapping, so no FileContent message is built or serialized.
+    int rpc_putFileRaw(const char* root, const char* path) {
+        // printf("%s : %s\n", __func__, path);
+        std::string filename = std::string(root) + string(path);
+        size_t size = 0;
+        std::shared_ptr<const std::uint8_t> mapping;
+        std::vector<FileExtent> extents;
+        try {
+            mapping = MapFileForReading(filename, size, &extents);
+        } catch (const std::exception& ex) {
+            std::cerr << "Failed to send the file " << path << ": " << ex.what()
+                    << std::endl;
+            return false;
+        }
+
+        unsigned int numRetriesLeft = MAX_NUM_RETRIES;
+        while (numRetriesLeft > 0) {
+            ClientContext context;
+            CompletionQueue cq;
+            grpc::ByteBuffer request = MakeRawMessage(MakeFile(path, true));
+            grpc::ByteBuffer response;
+            RawFileSender sender(mapping, size, extents, true, rawChunkSize);
+            grpc::ByteBuffer chunk;
+            Status status;
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::seconds(300);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            std::unique_ptr<GenericClientAsyncReaderWriter> call(
+                genericStub_->PrepareCall(&context, kRawPutFileMethod, &cq));
+            call->StartCall(tag(1));
+            bool ok = waitForTag(cq, tag(1));
+            if (ok) {
+                call->Write(request, tag(2));
+                ok = waitForTag(cq, tag(2));
+            }
+            while (ok && sender.Next(&chunk)) {
+                call->Write(chunk, tag(3));
+                ok = waitForTag(cq, tag(3));
+            }
+            if (ok) {
+                call->WritesDone(tag(4));
+                ok = waitForTag(cq, tag(4));
+            }
+            if (ok) {
+                call->Read(&response, tag(5));
+                waitForTag(cq, tag(5));
+            }
+            call->Finish(&status, tag(6));
+            waitForTag(cq, tag(6));
+            drainQueue(cq);
+
+            numRetriesLeft--;
+            if (status.ok()) {
+                OutputInfo result;
+                if (!ParseRawMessage(response, &result)) {
+                    std::cerr << "Server sent no valid reply for " << path << std::endl;
+                    return false;
+                }
+                if (result.err() != 0) {
+                    std::cerr << "Server failed to store " << path << ": "
+                            << strerror(result.err()) << std::endl;
+                    return false;
+                }
+                return true;
+            }
+
+            if (numRetriesLeft == 0) {
+                std::cerr << "File Exchange rpc failed: " << status.error_message()
+                        << std::endl;
+                return false;
+            }
+
+            printf("%s \t : Failed to send file to server. Retrying...\n", __func__);
+        }
+        return false;
+    }
+
+    // Zero-copy variant of rpc_getFile. Chunks arrive as raw ByteBuffers and their slices
+    // are written straight into the temp file, without being parsed into FileContent.
+    int rpc_getFileRaw(const char* rootDir, const char* path) {
+        // std::cout << __func__ << " : " << path << endl;
+        unsigned int numRetriesLeft = MAX_NUM_RETRIES;
+        while (numRetriesLeft > 0) {
+            ClientContext context;
+            CompletionQueue cq;
+            grpc::ByteBuffer request = MakeRawMessage(MakeFile(path, true));
+            grpc::ByteBuffer chunk;
+            Status status;
+            std::string filename = std::string(rootDir) + string(path);
+            std::string tempFileName = filename + "_" + unique_suffix() + ".txt";
+
+            int fd = open(tempFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1) {
+                std::cerr << "Failed to receive " << filename << ": " << strerror(errno)
+                        << std::endl;
+                return false;
+            }
+            RawFileReceiver receiver(fd, true);
+
+            // Set timeout for API
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() +
+                std::chrono::seconds(300);
+
+            context.set_wait_for_ready(true);
+            context.set_deadline(deadline);
+
+            std::unique_ptr<GenericClientAsyncReaderWriter> call(
+                genericStub_->PrepareCall(&context, kRawGetFileMethod, &cq));
+            call->StartCall(tag(1));
+            bool ok = waitForTag(cq, tag(1));
+            if (ok) {
+                call->Write(request, tag(2));
+                ok = waitForTag(cq, tag(2));
+            }
+            if (ok) {
+                call->WritesDone(tag(3));
+                ok = waitForTag(cq, tag(3));
+            }
+            bool writeFailed = false;
+            while (ok) {
+                call->Read(&chunk, tag(4));
+                ok = waitForTag(cq, tag(4));
+                if (ok && !receiver.Receive(chunk)) {
+                    std::cerr << "Failed to receive " << filename << ": "
+                            << strerror(errno) << std::endl;
+                    writeFailed = true;
+                    context.TryCancel();
+                    break;
+                }
+            }
+            call->Finish(&status, tag(5));
+            waitForTag(cq, tag(5));
+            drainQueue(cq);
+            if (status.ok() && !writeFailed && !receiver.Finish()) {
+                std::cerr << "Failed to receive " << filename << ": " << strerror(errno)
+                        << std::endl;
+                writeFailed = true;
+            }
+            close(fd);
+
+            numRetriesLeft--;
+            if (status.ok() && !writeFailed) {
+                int temp_Res = rename(tempFileName.c_str(), filename.c_str());
+                if (temp_Res != 0) {
+                    printf("%s \t : Failed to rename from %s to %s.\n",
+                    __func__, tempFileName.c_str(), filename.c_str());
+                }
+                return true;
+            }
+
+            unlink(tempFileName.c_str());
+            if (writeFailed ||
+                status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED || numRetriesLeft == 0) {
+                std::cerr << "Failed to get the file ";
+                if (!filename.empty()) {
+                    std::cerr << filename << ' ';
+                }
+                std::cerr << "with filename " << path << ": "
+                        << status.error_message() << std::endl;
+                return false;
+            }
+        }
+        return false;
+    }
+
    private:
+    // The raw calls are driven through a completion queue one operation at a time.
+    static void* tag(intptr_t i) { return reinterpret_cast<void*>(i); }
+
+    static bool waitForTag(CompletionQueue& cq, void* expected) {
+        void* got = nullptr;
+        bool ok = false;
+        return cq.Next(&got, &ok) && ok && got == expected;
+    }
+
+    static void drainQueue(CompletionQueue& cq) {
+        void* got = nullptr;
+        bool ok = false;
+        cq.Shutdown();
+        while (cq.Next(&got, &ok)) {
+        }
+    }
+
+    const size_t rawChunkSize = 1UL << 20;
+
     std::unique_ptr<AFS::Stub> stub_;
+    std::unique_ptr<GenericStub> genericStub_;
 };
 
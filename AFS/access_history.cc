@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "access_history.h"
+
+namespace {
+
+    const char* const kHeader = "afs-access-history 1";
+
+    const size_t kMaxSuccessors = 8;             // Successors kept per file
+    const unsigned long kMinCount = 2;           // Seen at least this often to be predicted
+    const double kMinProbability = 0.2;          // ... and at least this often out of all
+    const unsigned long kMaxCount = 1UL << 16;   // Counts of a file are halved beyond this
+    const unsigned long kPredictionWindow = 32;  // Opens a prediction has to come true in
+    const unsigned long kAdjustEvery = 32;       // Scored predictions between depth adjustments
+    const unsigned long kProbeEvery = 16;        // Opens between probes when fully backed off
+
+    // Paths are stored one per field, tab separated
+    bool storable(const std::string& path)
+    {
+        return path.find_first_of("\t\n") == std::string::npos;
+    }
+
+};  // Anonymous namespace
+
+AccessHistory::AccessHistory(const std::string& file, size_t depth, size_t max_files)
+    : m_file(file)
+    , m_max_depth(depth)
+    , m_max_files(max_files)
+    , m_opens(0)
+    , m_hits(0)
+    , m_misses(0)
+    , m_window_hits(0)
+    , m_window_misses(0)
+    , m_depth(depth)
+{
+}
+
+bool AccessHistory::Load()
+{
+    std::ifstream in(m_file);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != kHeader) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    while (std::getline(in, line)) {
+        size_t first = line.find('\t');
+        size_t second = (first == std::string::npos) ? first : line.find('\t', first + 1);
+        if (second == std::string::npos) {
+            return false;
+        }
+        unsigned long count = strtoul(line.c_str(), NULL, 10);
+        AddSuccessor(line.substr(first + 1, second - first - 1), line.substr(second + 1), count);
+    }
+    return true;
+}
+
+bool AccessHistory::Save()
+{
+    // Format under the lock, write without it
+    std::ostringstream out;
+    out << kHeader << '\n';
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        for (const auto& entry : m_successors) {
+            for (const Successor& successor : entry.second) {
+                out << successor.count << '\t' << entry.first << '\t' << successor.path << '\n';
+            }
+        }
+    }
+
+    const std::string temp_file = m_file + ".tmp";
+    {
+        std::ofstream file(temp_file, std::ios::trunc);
+        file << out.str();
+        file.close();
+        if (!file) {
+            remove(temp_file.c_str());
+            return false;
+        }
+    }
+    return rename(temp_file.c_str(), m_file.c_str()) == 0;
+}
+
+std::vector<std::string> AccessHistory::Record(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_opens++;
+    ScorePredictions(path);
+
+    if (path == m_previous || !storable(path)) {
+        return std::vector<std::string>();
+    }
+    AddSuccessor(m_previous, path, 1);
+    m_previous = path;
+
+    size_t depth = m_depth;
+    if (depth == 0 && m_opens % kProbeEvery == 0) {
+        depth = 1;
+    }
+    return Predict(path, depth);
+}
+
+std::vector<std::string> AccessHistory::PredictStartup()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return Predict("", m_depth);
+}
+
+unsigned long AccessHistory::Hits()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_hits;
+}
+
+unsigned long AccessHistory::Misses()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_misses;
+}
+
+void AccessHistory::AddSuccessor(const std::string& from, const std::string& to, unsigned long count)
+{
+    auto it = m_successors.find(from);
+    if (it == m_successors.end()) {
+        if (m_successors.size() >= m_max_files) {
+            // Forget the file with the fewest recorded transitions
+            auto coldest = m_successors.end();
+            unsigned long coldest_total = 0;
+            for (auto candidate = m_successors.begin(); candidate != m_successors.end(); ++candidate) {
+                unsigned long total = 0;
+                for (const Successor& successor : candidate->second) {
+                    total += successor.count;
+                }
+                if (coldest == m_successors.end() || total < coldest_total) {
+                    coldest = candidate;
+                    coldest_total = total;
+                }
+            }
+            m_successors.erase(coldest);
+        }
+        it = m_successors.emplace(from, std::vector<Successor>()).first;
+    }
+
+    std::vector<Successor>& successors = it->second;
+    auto found = std::find_if(successors.begin(), successors.end(),
+                              [&](const Successor& successor) { return successor.path == to; });
+    if (found != successors.end()) {
+        found->count += count;
+    } else if (successors.size() < kMaxSuccessors) {
+        successors.push_back(Successor{to, count});
+    } else {
+        // Replace the least frequent successor
+        auto rarest = std::min_element(successors.begin(), successors.end(),
+                                       [](const Successor& a, const Successor& b) {
+                                           return a.count < b.count;
+                                       });
+        *rarest = Successor{to, count};
+    }
+
+    // Age the counts, so a changed access pattern takes over eventually
+    for (const Successor& successor : successors) {
+        if (successor.count > kMaxCount) {
+            for (Successor& aged : successors) {
+                aged.count = (aged.count + 1) / 2;
+            }
+            break;
+        }
+    }
+}
+
+// Follow the most likely chain of successors from 'from', collecting up to 'depth' paths that
+// pass the count and probability thresholds. Returns those not predicted already.
+std::vector<std::string> AccessHistory::Predict(const std::string& from, size_t depth)
+{
+    std::vector<std::string> paths;
+    std::vector<std::string> fresh;
+    std::string current = from;
+    for (size_t step = 0; step < depth && paths.size() < depth; step++) {
+        auto it = m_successors.find(current);
+        if (it == m_successors.end()) {
+            break;
+        }
+        std::vector<Successor> successors = it->second;
+        std::sort(successors.begin(), successors.end(), [](const Successor& a, const Successor& b) {
+            return a.count > b.count;
+        });
+        unsigned long total = 0;
+        for (const Successor& successor : successors) {
+            total += successor.count;
+        }
+
+        bool extended = false;
+        for (const Successor& successor : successors) {
+            if (paths.size() >= depth || successor.count < kMinCount ||
+                successor.count < kMinProbability * total) {
+                break;
+            }
+            if (successor.path == from ||
+                std::find(paths.begin(), paths.end(), successor.path) != paths.end()) {
+                continue;
+            }
+            paths.push_back(successor.path);
+            if (m_outstanding.emplace(successor.path, m_opens).second) {
+                fresh.push_back(successor.path);
+            }
+            extended = true;
+        }
+        if (!extended) {
+            break;
+        }
+        current = successors.front().path;
+    }
+    return fresh;
+}
+
+void AccessHistory::ScorePredictions(const std::string& path)
+{
+    auto it = m_outstanding.find(path);
+    if (it != m_outstanding.end()) {
+        m_hits++;
+        m_window_hits++;
+        m_outstanding.erase(it);
+    }
+    for (it = m_outstanding.begin(); it != m_outstanding.end();) {
+        if (m_opens - it->second > kPredictionWindow) {
+            m_misses++;
+            m_window_misses++;
+            it = m_outstanding.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (m_window_hits + m_window_misses >= kAdjustEvery) {
+        AdjustDepth();
+    }
+}
+
+// Halve the depth when fewer than a quarter of the predictions come true, grow it again when
+// more than half do.
+void AccessHistory::AdjustDepth()
+{
+    double hit_rate = (double)m_window_hits / (m_window_hits + m_window_misses);
+    if (hit_rate < 0.25) {
+        m_depth /= 2;
+    } else if (hit_rate > 0.5 && m_depth < m_max_depth) {
+        m_depth++;
+    }
+    m_window_hits = 0;
+    m_window_misses = 0;
+}
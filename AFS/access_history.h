@@ -0,0 +1,66 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// AccessHistory: A model of which file tends to be opened after which, used to fetch files
+// speculatively. For every file it counts the files opened right after it (its successors); the
+// first open after a mount is counted as a successor of the empty path, so the files a job opens
+// on startup can be predicted at mount time. The model is persisted in a text file, so repeated
+// runs of the same job warm up the cache on their own.
+//
+// Predictions are scored: a predicted file opened within the next kPredictionWindow opens is a
+// hit, otherwise a miss. When the hit rate drops, fewer files are predicted per open, down to an
+// occasional probe, and more again once predictions become accurate.
+class AccessHistory {
+public:
+    AccessHistory(const std::string& file, size_t depth = 4, size_t max_files = 4096);
+
+    AccessHistory(const AccessHistory&) = delete;
+    AccessHistory& operator=(const AccessHistory&) = delete;
+
+    // Load the model saved by an earlier mount. Returns false if there is none or it is invalid.
+    bool Load();
+
+    // Write the model to its file, atomically. Returns false on failure.
+    bool Save();
+
+    // Record an open of the client path 'path'. Returns the paths worth fetching now.
+    std::vector<std::string> Record(const std::string& path);
+
+    // The paths likely to be opened first after a mount.
+    std::vector<std::string> PredictStartup();
+
+    unsigned long Hits();
+    unsigned long Misses();
+
+private:
+    struct Successor {
+        std::string path;
+        unsigned long count;
+    };
+
+    void AddSuccessor(const std::string& from, const std::string& to, unsigned long count);
+    std::vector<std::string> Predict(const std::string& from, size_t depth);
+    void ScorePredictions(const std::string& path);
+    void AdjustDepth();
+
+    const std::string m_file;
+    const size_t m_max_depth;
+    const size_t m_max_files;
+
+    std::mutex m_lock;
+    std::unordered_map<std::string, std::vector<Successor>> m_successors;
+    std::string m_previous;  // Path of the last open, empty before the first one
+    unsigned long m_opens;
+
+    // Accuracy of the predictions
+    std::unordered_map<std::string, unsigned long> m_outstanding;  // Path -> open it was predicted at
+    unsigned long m_hits;
+    unsigned long m_misses;
+    unsigned long m_window_hits;    // Since the depth was last adjusted
+    unsigned long m_window_misses;
+    size_t m_depth;
+};
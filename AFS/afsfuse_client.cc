@@ -4,7 +4,9 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,20 +14,42 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <experimental/filesystem>
+#include <fstream>
+#include <functional>
 #include <signal.h>
 namespace fs = std::experimental::filesystem;
 #include <iostream>
+#include <list>
+#include <map>
 #include <mutex>
+#include <random>
+#include <sstream>
 #include <thread>
+#include <unordered_set>
 
 #include "AfsClient.h"
-
-enum DebugLevel { LevelInfo = 0, LevelError = 1, LevelNone = 2 };
-
-const DebugLevel debugMode = LevelNone;
+#include "access_history.h"
+#include "block_cache.h"
+#include "change_sync.h"
+#include "client_common.h"
+#include "delegations.h"
+#include "direct_stream.h"
+#include "getattr_batcher.h"
+#include "inode_table.h"
+#include "periodic_sync.h"
+#include "recovery_files.h"
+#include "revalidator.h"
+#include "sequence_predictor.h"
+#include "single_flight.h"
+#include "upload_batcher.h"
+#include "warmup.h"
+#include "write_through.h"
 
 const unsigned long parallel_close_file_size_thresh = 
     167772160;  // should be set in bytes, currently 16 Megabytes
@@ -33,13 +57,117 @@ const bool enableTempFileWrites =
     true;  // whether to enable creation of temporary files while writing
 const bool shouldClearCacheOnExit = 
     false;
+const bool enableRawFileTransfer =
+    true;  // whether to move file data as raw ByteBuffers (zero-copy) instead of FileContent messages
+const bool enableDirectoryPrefetch =
+    true;  // whether a cold open fetches the rest of its directory in the background
+const unsigned long prefetch_file_size_thresh =
+    1048576;  // only files up to this size (bytes) are prefetched, 1 Megabyte
+const int num_prefetch_workers =
+    4;  // threads writing prefetched files into the cache
+const bool enableSequentialPrefetch =
+    true;  // whether opens that follow a numeric or lexical sequence fetch the next files ahead
+const int sequential_prefetch_depth =
+    4;  // files fetched ahead of the last open of a sequence
+const int num_sequential_prefetch_threads =
+    2;  // concurrent fetches of predicted files, bounds the bandwidth used speculatively
+const bool enableHistoryPrefetch =
+    true;  // whether files usually opened next (learnt across mounts) are fetched ahead
+const unsigned long history_save_interval =
+    256;  // opens between saves of the access history, which is also saved on unmount
+const int num_warmup_threads =
+    8;  // concurrent fetches of a cache warmup
+const int getattr_batch_window_us =
+    50;  // how long a getattr waits for concurrent ones to join its batch
+const size_t getattr_batch_max =
+    128;  // paths per getattrBatch call
+const bool enableBatchedUploads =
+    true;  // whether small dirty files are uploaded in batches after close instead of one by one
+const int upload_batch_window_ms =
+    5;  // how long a closed small file waits for others to join its batch
+const unsigned long upload_batch_max_bytes =
+    16777216;  // a batch is sent as soon as it holds this many bytes, 16 Megabytes
+const unsigned upload_batch_max_attempts =
+    5;  // a file is left for the next start after this many failed batches
+const int upload_batch_retry_ms =
+    200;  // wait after a failed batch, multiplied by the number of attempts
+const bool enableChangeLogSync =
+    true;  // whether opens trust cached copies the server's change log reports as unchanged
+const int changelog_poll_ms =
+    1000;  // interval between polls of the change log
+const int changelog_max_staleness_ms =
+    3000;  // cached copies are trusted only while the last successful poll started less than this ago
+const unsigned int changelog_batch_max =
+    1024;  // changes per changesSince call
+const size_t changelog_max_stale =
+    65536;  // stale marks kept before those of paths no longer cached are dropped
+const int num_revalidate_threads =
+    2;  // background revalidations of stale-while-revalidate opens
+const bool enableWriteDelegations =
+    true;  // whether files this client writes are delegated to it, deferring uploads until others need them
+const int delegation_writeback_ms =
+    5000;  // a dirty file under a delegation is uploaded at the latest this long after its close
+const int delegation_check_ms =
+    250;  // interval between rounds of the delegation manager (grants, renewals, write-back)
+const int num_open_file_shards =
+    16;  // independently locked parts of the open-file table, so FUSE threads rarely contend
+const unsigned writeback_max_write =
+    1 << 20;  // largest write the kernel sends at once in the writeback-cache mode
+const int durability_sync_interval_ms =
+    1000;  // interval between syncs of the files written through open handles (--durability=periodic)
+const size_t direct_chunk_size =
+    1 << 20;  // bytes per read request of a file in direct mode
+const int direct_max_window =
+    8;  // chunks in flight ahead of sequential reads in direct mode
+const int direct_chunk_timeout_ms =
+    10000;  // a chunk not read by then is read again with the retrying call
+const size_t write_through_max_range =
+    1 << 20;  // adjacent writes merged into one range write in write-through mode
+const int write_through_max_inflight =
+    4;  // range writes of a handle in flight at once in write-through mode
+const int write_through_delay_ms =
+    100;  // a range not full is sent this long after its first write at the latest
+const size_t block_cache_block_size =
+    1 << 20;  // bytes per block of a file in the block cache
+const int block_cache_readahead =
+    2;  // blocks after those a read misses fetched along with them in the block cache
+const int block_cache_fetch_timeout_ms =
+    10000;  // a block fetch not answered by then fails the read
+const bool enablePassthrough =
+    true;  // in the low-level mode, let the kernel read and write cached copies directly (FUSE passthrough)
 
 static struct options {
     AfsClient *afsclient;
     int show_help;
+    unsigned long inline_size;  // files up to this size (bytes) travel inline in unary calls
+    char *warmup;               // manifest of files to warm the cache with at mount
+    unsigned long swr_max_staleness;  // stale-while-revalidate bound (ms), 0 disables the mode
+    char *swr_dirs;                   // ':' separated directories in that mode, all if unset
+    int lowlevel;                     // serve the low-level FUSE API, with inodes
+    double entry_timeout;             // seconds the kernel keeps the names it looked up
+    double attr_timeout;              // seconds the kernel keeps attributes
+    double negative_timeout;          // seconds the kernel remembers names that do not exist
+    int keep_cache;  // let the kernel keep the pages of files reopened at the same version
+    int writeback_cache;  // let the kernel cache writes and send them in large batches
+    char *durability;     // when written data is synced to the local disk: none, periodic, close
+    unsigned long direct_min_size;  // files this large (bytes) are read in direct mode, 0: none
+    char *direct_dirs;              // ':' separated directories whose files are read in direct mode
+    char *write_through_dirs;       // ':' separated directories whose files are written through
+    unsigned long block_cache_min_size;  // files this large (bytes) are cached block by block, 0: none
+    unsigned long block_cache_size;      // bytes of blocks kept before the least recently read go
 } options;
 
 void closeOnServer(const char *path);
+bool uploadCachedFile(const char *path);
+void batchedUploadStored(const PendingUpload &upload, struct stat *remote);
+void prefetchOnServer(const char *path);
+void prefetchFileOnServer(const char *path);
+void revalidateOnServer(const char *path);
+bool queueRevalidation(const char *path);
+vector<string> listRegularFiles(const string &dir);
+vector<string> expandManifest(const string &manifest);
+int warmCachedFile(const char *path, unsigned long *bytes);
+void syncWrittenFiles();
 void consumer();
 
 struct BoundedBuffer {
@@ -57,12 +185,16 @@ struct BoundedBuffer {
 
     bool notDone;
 
-    BoundedBuffer(int capacity);
+    void (*handler)(const char *path);  // called by the consumer for each request
+
+    BoundedBuffer(int capacity, void (*handler)(const char *path) = closeOnServer);
 
     ~BoundedBuffer();
 
     void deposit(string path);
 
+    bool tryDeposit(string path);
+
     string fetch();
 
     void submitRequest(string path);
@@ -71,22 +203,87 @@ struct BoundedBuffer {
 
     void cleanupBuffer() {
         notDone = false;
-        not_empty.notify_one();
+        not_empty.notify_all();  // there may be several consumers
     }
 };
 
 thread *close_thread;
 BoundedBuffer *closeBuffer;
+Warmup *warmup;
+GetattrBatcher *getattrBatcher;
+thread *upload_thread;
+UploadBatcher *uploadBatcher;
+thread *prefetch_thread;
+BoundedBuffer *prefetchBuffer;
+vector<thread *> sequential_threads;
+BoundedBuffer *sequentialBuffer;
+SequencePredictor *sequencePredictor;
+AccessHistory *accessHistory;
+ChangeSync *changeSync;
+Revalidator *revalidator;
+Delegations *delegations;
+PeriodicSync *periodicSync;
+DirectHandles directHandles;
+RecoveryFiles recoveryFiles;
+BlockCache *blockCache;
+vector<string> directDirs;
+WriteThroughs *writeThroughs;
+vector<string> writeThroughDirs;
+vector<thread *> revalidate_threads;
+BoundedBuffer *revalidateBuffer;
+std::atomic<unsigned long> numOpens(0);
 
-inline void get_time(struct timespec *ts);
-inline double get_time_diff(struct timespec *before, struct timespec *after);
 void printFileTimeFields(const char *func, int fd);
 void printFileTimeFields(const char *func, const char *path);
 int cp(const char *to, const char *from);
 
+// A file opened through the mount, in the open-file table of the Cache
+struct OpenFile {
+    string tempPath;        // copy the handle writes to, empty if it writes to the cached copy
+    int flags;              // of the open
+    struct timespec base;   // modification time of the cached copy when opened: the server's version
+    bool dirty = false;     // written or truncated through the handle
+    bool unsynced = false;  // written since the last periodic sync
+    int backingId = 0;      // FUSE passthrough backing file of the handle, 0 if it has none
+    struct timespec backingBase;  // modification time of the handle's file when passed through
+    WriteThrough *writeThrough = NULL;  // in write-through mode
+    string sharedPath;      // key of the copy in Cache::sharedCopies, empty if not shared
+};
+
 class Cache {
+    // A part of the open-file table, keyed by the handle given to FUSE (fi->fh)
+    struct OpenFileShard {
+        std::mutex lock;
+        unordered_map<uint64_t, OpenFile> files;
+    };
+
     string cachedRoot;
-    unordered_map<int, std::string> tempFdToPathMap;
+    OpenFileShard openFiles[num_open_file_shards];
+    SingleFlight refreshes;
+    std::mutex prefetchLock;
+    std::unordered_set<std::string> prefetchedDirs;
+    std::mutex versionsLock;
+    unordered_map<string, struct timespec> openedVersions;  // path -> cached version last opened
+
+    // With the writeback cache the kernel writes the pages of a file back through any of its
+    // writable handles, even one other than the handle they were written through. The writable
+    // handles of a path share one copy then, so none of them loses data sent through another.
+    // The copy is uploaded at the release of the last of them.
+    struct SharedCopy {
+        string tempPath;       // empty if the handles write to the cached copy
+        struct timespec base;
+        int handles = 0;
+        bool dirty = false;    // written through a handle released already
+    };
+    std::mutex sharedLock;
+    unordered_map<string, SharedCopy> sharedCopies;
+    std::mutex copyLocks[num_open_file_shards];  // writable opens of a path, by hash of the path
+
+    void storePrefetchedFile(const BulkFile &file, uint64_t ticket);
+
+    OpenFileShard &shardOf(uint64_t fh) { return openFiles[fh % num_open_file_shards]; }
+
+    int doRefreshFile(const char *path, struct stat *buffer);
 
    public:
     Cache(string currentWorkDir, string cachedFolderName);
@@ -95,47 +292,359 @@ class Cache {
 
     string getCachedPath(const char *path, bool tempPath = false, int fd = -1);
 
-    void correctStaleness(const char *path, struct stat *buffer);
+    int refreshFile(const char *path, struct stat *buffer);
+
+    bool storeFile(const char *path, const string &data, struct stat *remote);
+
+    void applyRemoteTimes(const char *path, struct stat *remote);
 
     bool isCached(const char *path);
 
     void mirrorDirectoryStructure(const char *path);
 
-    void fetchFile(const char *path);
+    bool fetchFile(const char *path);
 
     void cacheFile(const char *path);
 
-    string createRecoveryPath(int fd);
+    void requestPrefetch(const char *path);
+
+    void prefetch(const BulkFetchRequest &request);
+
+    void prefetchDirectory(const char *path, bool recursive);
 
-    string getRecoveryCachedPath(int fd);
+    void prefetchFile(const char *path);
+
+    int warmFile(const char *path);
+
+    string createRecoveryPath(const string &tempPath);
+
+    string getRecoveryCachedPath(uint64_t fh);
 
     void recurseDirectoryTraversal(string path);
 
-    void setTimeFileNameWithFd(int fd, string &path) {
-        tempFdToPathMap[fd] = path;
+    // Held while a writable handle of 'path' is opened in the writeback-cache mode, so the
+    // opens of a path agree on the copy they share
+    std::mutex &copyLockOf(const char *path) {
+        return copyLocks[std::hash<string>()(path) % num_open_file_shards];
+    }
+
+    // Let 'file' write to the copy the open writable handles of 'path' share. Returns false if
+    // there are none.
+    bool joinSharedCopy(const char *path, OpenFile *file) {
+        std::lock_guard<std::mutex> guard(sharedLock);
+        auto it = sharedCopies.find(path);
+        if (it == sharedCopies.end()) {
+            return false;
+        }
+        it->second.handles++;
+        file->tempPath = it->second.tempPath;
+        file->base = it->second.base;
+        file->sharedPath = path;
+        return true;
+    }
+
+    // The copy of 'file', the first writable handle of 'path', is shared by the next ones
+    void addSharedCopy(const char *path, OpenFile *file) {
+        std::lock_guard<std::mutex> guard(sharedLock);
+        SharedCopy &copy = sharedCopies[path];
+        if (copy.handles > 0) {
+            return;  // Created while another handle was open, this one keeps its copy
+        }
+        copy.tempPath = file->tempPath;
+        copy.base = file->base;
+        copy.handles = 1;
+        file->sharedPath = path;
+    }
+
+    // Release the share of 'file' in its copy. Returns false if other handles still use it,
+    // otherwise 'file' carries whether any of them wrote to the copy.
+    bool leaveSharedCopy(OpenFile *file) {
+        std::lock_guard<std::mutex> guard(sharedLock);
+        auto it = sharedCopies.find(file->sharedPath);
+        if (it == sharedCopies.end()) {
+            return true;
+        }
+        SharedCopy &copy = it->second;
+        if (--copy.handles > 0) {
+            copy.dirty = copy.dirty || file->dirty;
+            return false;
+        }
+        file->dirty = file->dirty || copy.dirty;
+        sharedCopies.erase(it);
+        return true;
+    }
+
+    void addOpenFile(uint64_t fh, const OpenFile &file) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.files[fh] = file;
+    }
+
+    // Writes to a passthrough handle go to its file without passing through here, so such a
+    // handle counts as written once the file was modified after the open
+    static bool writtenPast(uint64_t fh, const OpenFile &file) {
+        struct stat st;
+        return file.backingId != 0 && fstat(fh, &st) == 0 &&
+               (st.st_mtim.tv_sec != file.backingBase.tv_sec ||
+                st.st_mtim.tv_nsec != file.backingBase.tv_nsec);
+    }
+
+    void setBackingId(uint64_t fh, int backingId) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.files.find(fh);
+        struct stat st;
+        if (it != shard.files.end() && fstat(fh, &st) == 0) {
+            it->second.backingId = backingId;
+            it->second.backingBase = st.st_mtim;
+        }
+    }
+
+    // Record that 'path' is opened with its cached copy at 'version' (its modification time), and
+    // tell whether the previous open saw the same version: the pages the kernel kept are current
+    bool reopenedUnchanged(const char *path, const struct timespec &version) {
+        std::lock_guard<std::mutex> guard(versionsLock);
+        auto inserted = openedVersions.emplace(path, version);
+        if (inserted.second) {
+            return false;
+        }
+        struct timespec &previous = inserted.first->second;
+        bool unchanged = previous.tv_sec == version.tv_sec && previous.tv_nsec == version.tv_nsec;
+        previous = version;
+        return unchanged;
+    }
+
+    WriteThrough *writeThroughOf(uint64_t fh) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.files.find(fh);
+        return it != shard.files.end() ? it->second.writeThrough : NULL;
+    }
+
+    int backingIdOf(uint64_t fh) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.files.find(fh);
+        return it != shard.files.end() ? it->second.backingId : 0;
+    }
+
+    void markDirty(uint64_t fh) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.files.find(fh);
+        if (it != shard.files.end()) {
+            it->second.dirty = true;
+            it->second.unsynced = true;
+        }
+    }
+
+    // Sync the files written through open handles since the last call
+    void syncWrittenFiles() {
+        for (OpenFileShard &shard : openFiles) {
+            vector<int> written;
+            {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                for (auto &entry : shard.files) {
+                    OpenFile &file = entry.second;
+                    if (file.unsynced || writtenPast(entry.first, file)) {
+                        // A duplicate, as the handle may be closed and its number reused meanwhile
+                        int fd = dup(entry.first);
+                        if (fd != -1) {
+                            written.push_back(fd);
+                            file.unsynced = false;
+                        }
+                    }
+                }
+            }
+            for (int fd : written) {
+                fdatasync(fd);
+                close(fd);
+            }
+        }
     }
 
-    bool isTempFile(int fd) {
-        return tempFdToPathMap.find(fd) != tempFdToPathMap.end();
+    bool isDirty(uint64_t fh) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.files.find(fh);
+        return it != shard.files.end() && (it->second.dirty || writtenPast(fh, it->second));
     }
 
-    void clearTempFile(int fd) { tempFdToPathMap.erase(fd); }
+    // Remove the entry of 'fh' from the table, before the handle is closed and its number reused
+    bool takeOpenFile(uint64_t fh, OpenFile *file) {
+        OpenFileShard &shard = shardOf(fh);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.files.find(fh);
+        if (it == shard.files.end()) {
+            return false;
+        }
+        *file = it->second;
+        file->dirty = file->dirty || writtenPast(fh, *file);
+        shard.files.erase(it);
+        return true;
+    }
 };
 
 Cache *cache;
 int crashSite = 0;
+struct fuse *kernelFs = NULL;  // the mount of the path-based mode
+bool writebackActive = false;  // the kernel agreed to cache writes
+
+// When data written through a handle is synced to the local disk, before the close uploads it
+enum class Durability { None, Periodic, OnClose };
+Durability durability = Durability::OnClose;
 
 #define OPTION(t, p) \
     { t, offsetof(struct options, p), 1 }
 
 static const struct fuse_opt option_spec[] = {
-    OPTION("-h", show_help), OPTION("--help", show_help), FUSE_OPT_END};
+    OPTION("-h", show_help), OPTION("--help", show_help),
+    OPTION("--inline_size=%lu", inline_size), OPTION("--warmup=%s", warmup),
+    OPTION("--swr_max_staleness=%lu", swr_max_staleness), OPTION("--swr_dirs=%s", swr_dirs),
+    OPTION("--lowlevel", lowlevel), OPTION("--entry_timeout=%lf", entry_timeout),
+    OPTION("--attr_timeout=%lf", attr_timeout), OPTION("--negative_timeout=%lf", negative_timeout),
+    OPTION("--keep_cache=%d", keep_cache), OPTION("--writeback_cache", writeback_cache),
+    OPTION("--durability=%s", durability), OPTION("--direct_min_size=%lu", direct_min_size),
+    OPTION("--direct_dirs=%s", direct_dirs), OPTION("--write_through_dirs=%s", write_through_dirs),
+    OPTION("--block_cache_min_size=%lu", block_cache_min_size),
+    OPTION("--block_cache_size=%lu", block_cache_size),
+    FUSE_OPT_END};
+
+const char *warmupControlPath = "/.afs_warmup";
 
 static void show_help(const char *progname) {
     printf("%s \n", __func__);
     std::cout
         << "usage: " << progname
-        << " [-s -d] <mountpoint> [--server=ip:port, Default = localhost]\n\n";
+        << " [-s -d] <mountpoint> [--inline_size=bytes, Default = 65536]"
+           " [--warmup=manifest]"
+           " [--swr_max_staleness=ms, Default = 0 (off)] [--swr_dirs=dir1:dir2:...]"
+           " [--lowlevel] [--entry_timeout=s, Default = 1] [--attr_timeout=s, Default = 1]"
+           " [--negative_timeout=s, Default = 0] [--keep_cache=0|1, Default = 1]"
+           " [--writeback_cache] [--durability=none|periodic|close, Default = close]"
+           " [--direct_min_size=bytes, Default = 0 (off)] [--direct_dirs=dir1:dir2:...]"
+           " [--write_through_dirs=dir1:dir2:...]"
+           " [--block_cache_min_size=bytes, Default = 0 (off)]"
+           " [--block_cache_size=bytes, Default = 1073741824]"
+           " [--server=ip:port, Default = localhost]\n\n"
+        << "Writing a manifest to " << warmupControlPath << " in the mount warms the cache"
+           " with it, and reading that file reports the progress.\n\n"
+        << "FUSE requests are served by several threads unless -s is given. libfuse's -o clone_fd"
+           " gives each thread its own /dev/fuse descriptor, -o max_idle_threads=N bounds the idle"
+           " ones and, from libfuse 3.12, -o max_threads=N bounds them all.\n\n"
+        << "--lowlevel serves the FUSE low-level API: the kernel works with inodes and reads"
+           " are spliced from the cached copies. With Linux 6.9+ and libfuse 3.16+, and run as"
+           " root, the kernel also reads and writes open cached files directly (passthrough).\n\n"
+        << "The kernel keeps the pages of a file across opens while its cached copy is at the"
+           " same version, and forgets them, with the attributes, when the change log reports"
+           " a change.\n\n"
+        << "--writeback_cache lets the kernel cache writes and send them in writes of up to 1 MB."
+           " Written data reaches the local disk at close with --durability=close, every second"
+           " with periodic, and only when uploaded with none. The upload at close does not"
+           " depend on it.\n\n"
+        << "Files below --direct_dirs, or of at least --direct_min_size bytes, are read in direct"
+           " mode when opened read-only and not cached: straight from the server, in chunks"
+           " fetched ahead of the reads, without copying them to the cache.\n\n"
+        << "Writes to files below --write_through_dirs reach the server within 100 ms, merged"
+           " into range writes, instead of with the whole file at close.\n\n"
+        << "Files of at least --block_cache_min_size bytes opened read-only and not cached are"
+           " cached block by block: reads fetch the 1 MB blocks they miss, and the least"
+           " recently read blocks are dropped beyond --block_cache_size bytes.\n\n";
+}
+
+// The control file of the cache warmup. It is not listed, and opens of it get warmupControlFh
+// as their handle instead of a descriptor of a cached file.
+const uint64_t warmupControlFh = (uint64_t)-2;
+
+static bool isWarmupControl(const char *path) {
+    return strcmp(path, warmupControlPath) == 0;
+}
+
+static bool isWarmupControl(struct fuse_file_info *fi) {
+    return fi != NULL && fi->fh == warmupControlFh;
+}
+
+static bool isDirect(struct fuse_file_info *fi) {
+    return fi != NULL && fi->fh >= directHandleBase && fi->fh != warmupControlFh;
+}
+
+// Open 'path' in direct mode if it is to be read that way: read-only, not cached, and below
+// options.direct_dirs or at least options.direct_min_size bytes
+static bool openDirect(const char *path, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (options.direct_min_size == 0 && directDirs.empty())) {
+        return false;
+    }
+    struct stat local;
+    if (lstat(cache->getCachedPath(path).c_str(), &local) == 0) {
+        return false;
+    }
+    bool listed = is_in_dirs(directDirs, path);
+    if (!listed && options.direct_min_size == 0) {
+        return false;
+    }
+    struct stat remote;
+    if (getattrBatcher->getattr(path, &remote) != 0 || !S_ISREG(remote.st_mode)) {
+        return false;
+    }
+    if (!listed && (unsigned long)remote.st_size < options.direct_min_size) {
+        return false;
+    }
+    fi->fh = directHandles.add(new DirectStream(options.afsclient, path, remote, direct_chunk_size,
+                                                direct_max_window, direct_chunk_timeout_ms));
+    fi->direct_io = 1;  // read once: the kernel keeps no pages of it
+    return true;
+}
+
+static bool isBlockCached(struct fuse_file_info *fi) {
+    return fi != NULL && fi->fh >= blockHandleBase && fi->fh < directHandleBase;
+}
+
+// Open 'path' in the block cache if it is to be cached that way: read-only, not cached whole,
+// and at least options.block_cache_min_size bytes
+static bool openBlocks(const char *path, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || options.block_cache_min_size == 0) {
+        return false;
+    }
+    struct stat local;
+    if (lstat(cache->getCachedPath(path).c_str(), &local) == 0) {
+        return false;
+    }
+    struct stat remote;
+    if (getattrBatcher->getattr(path, &remote) != 0 || !S_ISREG(remote.st_mode) ||
+        (unsigned long)remote.st_size < options.block_cache_min_size) {
+        return false;
+    }
+    uint64_t fh = blockCache->open(path, remote);
+    if (fh == 0) {
+        return false;
+    }
+    fi->fh = fh;
+    return true;
+}
+
+// The write-through state of a handle opened with 'flags', NULL unless 'path' is below
+// options.write_through_dirs. A truncating open keeps the whole-file upload at close.
+static WriteThrough *startWriteThrough(const char *path, int flags) {
+    if ((flags & O_ACCMODE) == O_RDONLY || (flags & O_TRUNC) || !is_in_dirs(writeThroughDirs, path)) {
+        return NULL;
+    }
+    WriteThrough *handle =
+        new WriteThrough(options.afsclient, path, write_through_max_range,
+                         write_through_max_inflight, write_through_delay_ms);
+    writeThroughs->add(handle);
+    return handle;
+}
+
+// The flags to open the file of a handle with. With the writeback cache the kernel reads
+// pages of files opened write-only, and appends itself at the offsets it sends.
+static int writebackFlags(int flags) {
+    if (!writebackActive) {
+        return flags;
+    }
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    return flags & ~O_APPEND;
 }
 
 static void *client_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
@@ -144,7 +653,70 @@ static void *client_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
     }
     closeBuffer = new BoundedBuffer(100);
     close_thread = new thread(&BoundedBuffer::consumer, closeBuffer);
-    (void)conn;
+    prefetchBuffer = new BoundedBuffer(100, prefetchOnServer);
+    prefetch_thread = new thread(&BoundedBuffer::consumer, prefetchBuffer);
+    sequencePredictor = new SequencePredictor(listRegularFiles, sequential_prefetch_depth);
+    // Holds a few windows of predictions; more are dropped rather than queued
+    sequentialBuffer = new BoundedBuffer(2 * sequential_prefetch_depth, prefetchFileOnServer);
+    for (int i = 0; i < num_sequential_prefetch_threads; i++) {
+        sequential_threads.push_back(new thread(&BoundedBuffer::consumer, sequentialBuffer));
+    }
+    // Warm up with the files the previous runs opened first
+    if (enableHistoryPrefetch) {
+        for (const string &next : accessHistory->PredictStartup()) {
+            sequentialBuffer->tryDeposit(next);
+        }
+    }
+    uploadBatcher = new UploadBatcher(options.afsclient, &recoveryFiles, batchedUploadStored,
+                                      upload_batch_window_ms, upload_batch_max_bytes,
+                                      upload_batch_max_attempts, upload_batch_retry_ms);
+    upload_thread = new thread(&UploadBatcher::consumer, uploadBatcher);
+    if (enableChangeLogSync) {
+        changeSync->start();
+    }
+    delegations = new Delegations(options.afsclient, uploadCachedFile, delegation_writeback_ms,
+                                  delegation_check_ms);
+    if (enableWriteDelegations) {
+        delegations->start();
+    }
+    revalidator = new Revalidator(options.swr_dirs, options.swr_max_staleness, queueRevalidation);
+    directDirs = parse_dir_list(options.direct_dirs);
+    writeThroughDirs = parse_dir_list(options.write_through_dirs);
+    writeThroughs = new WriteThroughs(write_through_delay_ms);
+    writeThroughs->start();
+    revalidateBuffer = new BoundedBuffer(100, revalidateOnServer);
+    for (int i = 0; i < num_revalidate_threads; i++) {
+        revalidate_threads.push_back(new thread(&BoundedBuffer::consumer, revalidateBuffer));
+    }
+    warmup = new Warmup(expandManifest, warmCachedFile, num_warmup_threads);
+    getattrBatcher =
+        new GetattrBatcher(options.afsclient, getattr_batch_window_us, getattr_batch_max);
+    if (options.warmup != NULL) {
+        std::ifstream manifest(options.warmup);
+        std::stringstream content;
+        content << manifest.rdbuf();
+        if (manifest) {
+            warmup->start(content.str());
+        } else {
+            printf("%s \t: Failed to read the warmup manifest %s\n", __func__, options.warmup);
+        }
+    }
+    periodicSync = new PeriodicSync(syncWrittenFiles, durability_sync_interval_ms);
+    if (durability == Durability::Periodic) {
+        periodicSync->start();
+    }
+    if (options.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        conn->max_write = writeback_max_write;
+        writebackActive = true;
+    }
+    cfg->entry_timeout = options.entry_timeout;
+    cfg->attr_timeout = options.attr_timeout;
+    cfg->negative_timeout = options.negative_timeout;
+    // Kept to invalidate what the kernel caches of files changed on the server. NULL in the
+    // low-level mode, which has its session for that.
+    struct fuse_context *context = fuse_get_context();
+    kernelFs = context != NULL ? context->fuse : NULL;
     cache->recurseDirectoryTraversal(cache->getCachedPath(""));
     return NULL;
 }
@@ -153,8 +725,32 @@ static void client_destroy(void *privateData) {
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \n", __func__);
     }
+    warmup->stop();
     closeBuffer->cleanupBuffer();
     close_thread->join();
+    prefetchBuffer->cleanupBuffer();
+    prefetch_thread->join();
+    sequentialBuffer->cleanupBuffer();
+    for (thread *t : sequential_threads) {
+        t->join();
+    }
+    if (enableHistoryPrefetch) {
+        accessHistory->Save();
+        if (debugMode <= DebugLevel::LevelInfo) {
+            printf("%s \t: History predictions: %lu hits, %lu misses\n", __func__,
+                   accessHistory->Hits(), accessHistory->Misses());
+        }
+    }
+    periodicSync->stop();
+    writeThroughs->stop();
+    revalidateBuffer->cleanupBuffer();
+    for (thread *t : revalidate_threads) {
+        t->join();
+    }
+    delegations->stop();
+    uploadBatcher->cleanupBuffer();
+    upload_thread->join();
+    changeSync->stop();
     if (shouldClearCacheOnExit) {
         string command = "rm -rf " + cache->getCachedPath("");
         int res = system(command.c_str());
@@ -183,6 +779,28 @@ static int client_getattr(const char *path, struct stat *stbuf,
 
     int res = 0;
 
+    if (isWarmupControl(path)) {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = warmup->report().size();
+        return 0;
+    }
+
+    if (isDirect(fi)) {
+        DirectStream *stream = directHandles.find(fi->fh);
+        if (stream != NULL) {
+            *stbuf = stream->attributes;
+            return 0;
+        }
+    }
+    if (isBlockCached(fi)) {
+        BlockFile *file = blockCache->find(fi->fh);
+        if (file != NULL) {
+            *stbuf = file->attributes;
+            return 0;
+        }
+    }
+
     if (fi != NULL) {
         if (debugMode <= DebugLevel::LevelInfo) {
             printf("%s \t: Local with fd = %lu, file = %s\n", __func__, fi->fh,
@@ -199,7 +817,7 @@ static int client_getattr(const char *path, struct stat *stbuf,
             if (debugMode <= DebugLevel::LevelInfo) {
                 printf("%s \t: Server with path = %s\n", __func__, path);
             }
-            return options.afsclient->rpc_getattr(path, stbuf);
+            return getattrBatcher->getattr(path, stbuf);
         }
     }
 
@@ -232,13 +850,50 @@ static int client_open(const char *path, struct fuse_file_info *fi) {
     }
     std::string s_path(cache->getCachedPath(path));
 
+    if (isWarmupControl(path)) {
+        fi->fh = warmupControlFh;
+        fi->direct_io = 1;  // reads return the report of the moment, whatever size it has
+        return 0;
+    }
+
+    if (openDirect(path, fi) || openBlocks(path, fi)) {
+        return 0;
+    }
+
+    // Predict before fetching this file, so the next ones are on their way meanwhile
+    if (enableSequentialPrefetch) {
+        for (const string &next : sequencePredictor->Record(path)) {
+            sequentialBuffer->tryDeposit(next);
+        }
+    }
+    if (enableHistoryPrefetch) {
+        for (const string &next : accessHistory->Record(path)) {
+            sequentialBuffer->tryDeposit(next);
+        }
+        if (++numOpens % history_save_interval == 0) {
+            accessHistory->Save();
+        }
+    }
+
     if (cache->isCached(path) == false) {
         cache->cacheFile(path);
     }
 
+    fi->flags = writebackFlags(fi->flags);
     unsigned long fd = -1;
+    OpenFile file;
+    file.flags = fi->flags;
+
+    // The writable handles of a file share its copy in the writeback-cache mode
+    bool shared = writebackActive && (fi->flags & O_ACCMODE) != O_RDONLY;
+    std::unique_lock<std::mutex> copyGuard;
+    if (shared) {
+        copyGuard = std::unique_lock<std::mutex>(cache->copyLockOf(path));
+    }
 
-    if (enableTempFileWrites) {
+    if (shared && cache->joinSharedCopy(path, &file)) {
+        fd = open(file.tempPath.empty() ? s_path.c_str() : file.tempPath.c_str(), fi->flags);
+    } else if (enableTempFileWrites) {
         string tempFileName = cache->getCachedPath(path, true, -1);
         int res = cp(tempFileName.c_str(),
                      s_path.c_str());
@@ -273,9 +928,13 @@ static int client_open(const char *path, struct fuse_file_info *fi) {
             utimensat(AT_FDCWD, tempFileName.c_str(), ts, AT_SYMLINK_NOFOLLOW);
 
         fd = open(tempFileName.c_str(), fi->flags);
-
-        cache->setTimeFileNameWithFd(fd, tempFileName);
+        file.tempPath = tempFileName;
+        file.base = st_buf.st_mtim;
     } else {
+        struct stat st_buf;
+        if (lstat(s_path.c_str(), &st_buf) == 0) {
+            file.base = st_buf.st_mtim;
+        }
         fd = open(s_path.c_str(), fi->flags);
     }
 
@@ -290,6 +949,15 @@ static int client_open(const char *path, struct fuse_file_info *fi) {
             printf("%s \t: File openend successfully. Fd = %lu\n", __func__,
                    fd);
         }
+        // A truncating open changes the file without any write
+        file.dirty = (fi->flags & O_TRUNC) != 0;
+        file.writeThrough = startWriteThrough(path, fi->flags);
+        if (shared && file.sharedPath.empty()) {
+            cache->addSharedCopy(path, &file);
+        }
+        cache->addOpenFile(fd, file);
+        // Without keep_cache the kernel drops the pages of the file at every open
+        fi->keep_cache = options.keep_cache && cache->reopenedUnchanged(path, file.base);
     }
 
     fi->fh = fd;
@@ -299,6 +967,24 @@ static int client_open(const char *path, struct fuse_file_info *fi) {
 
 static int client_read(const char *path, char *buf, size_t size, off_t offset,
                        struct fuse_file_info *fi) {
+    if (isWarmupControl(fi)) {
+        string report = warmup->report();
+        if ((size_t)offset >= report.size()) {
+            return 0;
+        }
+        size = std::min(size, report.size() - offset);
+        memcpy(buf, report.data() + offset, size);
+        return size;
+    }
+    if (isDirect(fi)) {
+        DirectStream *stream = directHandles.find(fi->fh);
+        return stream != NULL ? stream->read(buf, size, offset) : -EBADF;
+    }
+    if (isBlockCached(fi)) {
+        BlockFile *file = blockCache->find(fi->fh);
+        return file != NULL ? file->read(buf, size, offset) : -EBADF;
+    }
+
     int fd = -1;
     if (fi) {
         fd = fi->fh;
@@ -331,6 +1017,15 @@ static int client_read(const char *path, char *buf, size_t size, off_t offset,
 
 static int client_write(const char *path, const char *buf, size_t size,
                         off_t offset, struct fuse_file_info *fi) {
+    if (isWarmupControl(fi)) {
+        std::lock_guard<std::mutex> guard(warmup->lock);
+        warmup->written.append(buf, size);
+        return size;
+    }
+    if (isDirect(fi) || isBlockCached(fi)) {
+        return -EBADF;
+    }
+
     int fd = -1;
     if (debugMode <= DebugLevel::LevelInfo) {
         printFileTimeFields(__func__, fi->fh);
@@ -358,17 +1053,19 @@ static int client_write(const char *path, const char *buf, size_t size,
     }
     
     int res = pwrite(fd, buf, size, offset);
+    if (res > 0 && fi) {
+        cache->markDirty(fi->fh);
+        WriteThrough *writeThrough = cache->writeThroughOf(fi->fh);
+        if (writeThrough != NULL) {
+            writeThrough->write(buf, res, offset);
+        }
+    }
 
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t: Finished pwrite, wrote %d bytes, fd = %d \n", __func__, res, fd);
         printFileTimeFields(__func__, fd);
     }
 
-    bool shouldFlush = (rand() % 100) >= 90;
-    if (shouldFlush) {
-        fdatasync(fd);
-    }
-    
     if (res == -1) {
         if (debugMode <= DebugLevel::LevelError) {
             printf("%s \t : Failed to write to %s : \n", __func__, path);
@@ -404,6 +1101,8 @@ static int client_rmdir(const char *path) {
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t : Path = %s\n", __func__, path);
     }
+    // Files waiting in a batch would bring the directory back on the server
+    uploadBatcher->drain();
     int res = options.afsclient->rpc_rmdir(path);
 
     if (res == 0) {
@@ -426,8 +1125,18 @@ static int client_create(const char *path, mode_t mode,
         printf("%s \t: Path = %s\n", __func__, path);
     }
     int res = 0;
+    fi->flags = writebackFlags(fi->flags);
+
+    // CREATE and GETATTR in one round trip
+    CompoundRequest request;
+    CompoundReply reply;
+    CreateRequest *create = request.add_ops()->mutable_create();
+    create->set_path(path);
+    create->set_mode(mode);
+    create->set_flags(fi->flags);
+    request.add_ops()->mutable_getattr()->set_str(path);
 
-    res = options.afsclient->rpc_create(path, mode, fi);
+    res = options.afsclient->rpc_compound(request, &reply);
 
     int fd = -1;
 
@@ -436,19 +1145,8 @@ static int client_create(const char *path, mode_t mode,
         fd = open(cache->getCachedPath(path).c_str(), fi->flags, mode);
         {  // Sync access and modified time of server with local create
             struct stat remoteFileStatBuffer;
-            int res =
-                options.afsclient->rpc_getattr(path, &remoteFileStatBuffer);
-            if (res != -1) {
-                struct timespec ts[2];
-                ts[0].tv_sec = remoteFileStatBuffer.st_atim.tv_sec;
-                ts[0].tv_nsec = remoteFileStatBuffer.st_atim.tv_nsec;
-
-                ts[1].tv_sec = remoteFileStatBuffer.st_mtim.tv_sec;
-                ts[1].tv_nsec = remoteFileStatBuffer.st_mtim.tv_nsec;
-
-                res = utimensat(AT_FDCWD, (cache->getCachedPath(path)).c_str(),
-                                ts, AT_SYMLINK_NOFOLLOW);
-            }
+            AfsClient::toStat(reply.results(1).stat(), &remoteFileStatBuffer);
+            cache->applyRemoteTimes(path, &remoteFileStatBuffer);
         }
         if (fd == -1) {
             if (debugMode <= DebugLevel::LevelInfo) {
@@ -473,6 +1171,20 @@ static int client_create(const char *path, mode_t mode,
         } else {
             fi->fh = fd;
         }
+        if (fd != -1) {
+            // Written to the cached copy directly. The server has the new, empty file already.
+            OpenFile file;
+            struct stat remote;
+            AfsClient::toStat(reply.results(1).stat(), &remote);
+            file.flags = fi->flags;
+            file.base = remote.st_mtim;
+            file.writeThrough = startWriteThrough(path, fi->flags & ~O_TRUNC);
+            if (writebackActive) {
+                std::lock_guard<std::mutex> guard(cache->copyLockOf(path));
+                cache->addSharedCopy(path, &file);
+            }
+            cache->addOpenFile(fd, file);
+        }
     }
 
     if (res == -1) {
@@ -499,9 +1211,12 @@ static int client_unlink(const char *path) {
                cache->getCachedPath(path).c_str());
     }
 
+    delegations->giveUp(path, false);
+    uploadBatcher->drain();
     int res = options.afsclient->rpc_unlink(path);
 
     if (res == 0) {
+        recoveryFiles.forget(path);
         res = unlink(cache->getCachedPath(path).c_str());
     }
 
@@ -520,9 +1235,19 @@ static int client_rename(const char *from, const char *to, unsigned int flags) {
         printf("%s \t: From = %s, To = %s \n", __func__, from, to);
     }
 
+    // The server renames its copy, so it needs the deferred writes of 'from'
+    delegations->giveUp(from, true);
+    delegations->giveUp(to, false);
+    uploadBatcher->drain();
+    // A close whose upload failed is retried first, for the same reason
+    if (!recoveryFiles.current(from).empty()) {
+        uploadCachedFile(from);
+    }
     int res = options.afsclient->rpc_rename(from, to, flags);
 
     if (res == 0) {
+        recoveryFiles.forget(from);
+        recoveryFiles.forget(to);
         res = rename(cache->getCachedPath(from).c_str(),
                      cache->getCachedPath(to).c_str());
     }
@@ -550,6 +1275,17 @@ static int client_utimens(const char *path, const struct timespec ts[2],
     };
 
     int res = 0;
+    if (fi != NULL && !isWarmupControl(fi) && !isDirect(fi) && !isBlockCached(fi)) {
+        // The file of the handle, which the writeback cache stamps with the time of its writes.
+        // The upload at close gives the server its own time anyway.
+        res = futimens(fi->fh, ts);
+        if (res == -1 && debugMode <= DebugLevel::LevelError) {
+            printf("%s \t : %s\n", __func__, path);
+            perror(strerror(errno));
+        }
+        return res;
+    }
+
     // For regular file, utimensat should not be called as
     // anyways on close it is changed
     if (!is_regular_file(cache->getCachedPath(path).c_str())) {
@@ -593,57 +1329,13 @@ static int client_mknod(const char *path, mode_t mode, dev_t rdev) {
     return res;
 }
 
-bool isFileModified(const char *path, struct fuse_file_info *fi) {
-    bool isModified = true;
-    struct stat server_buf;
-
-    int res = options.afsclient->rpc_getattr(path, &server_buf);
-
-    if (res == 0) {
-        struct stat local_buf;
-
-        res = fstat(fi->fh, &local_buf);
-
-        if (res == 0) {
-            if (local_buf.st_mtim.tv_nsec == server_buf.st_mtim.tv_nsec) {
-                if (debugMode <= DebugLevel::LevelInfo) {
-                    printf(
-                        "%s \t : No writes done, so no need to send this "
-                        "file!\n",
-                        __func__);
-                }
-                isModified = false;
-            } else {
-                if (debugMode <= DebugLevel::LevelInfo) {
-                    printf(
-                        "%s \t : Need to send this file as modified time is "
-                        "different!\n",
-                        __func__);
-                }
-            }
-        } else {
-            if (debugMode <= DebugLevel::LevelError) {
-                printf("%s \t : GetAttr failed locally\n", __func__);
-                printf("%s \t : %s\n", __func__, path);
-                perror(strerror(errno));
-            }
-        }
-
-    } else {
-        if (debugMode <= DebugLevel::LevelError) {
-            printf("%s \t : GetAttr failed on server\n", __func__);
-            printf("%s \t : %s\n", __func__, path);
-            perror(strerror(errno));
-        }
-    }
-
-    return isModified;
-}
-
 static int client_flush(const char *path, struct fuse_file_info *fi) {
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t: Path = %s\n", __func__, path);
     }
+    if (isWarmupControl(fi) || isDirect(fi) || isBlockCached(fi)) {
+        return 0;
+    }
 
     struct timespec ts_close_start, ts_close_end;
     if (debugMode <= DebugLevel::LevelInfo) {
@@ -663,9 +1355,16 @@ static int client_flush(const char *path, struct fuse_file_info *fi) {
                fi->fh);
     }
 
-    if (isFileModified(path, fi)) {
+    // Only handles written through have something to flush. Whether the server needs the file
+    // is decided by release, so flush does not cost a round trip.
+    if (durability == Durability::OnClose && cache->isDirty(fi->fh)) {
         fdatasync(fi->fh);
     }
+    // Written through: the server has all of it when close returns
+    WriteThrough *writeThrough = cache->writeThroughOf(fi->fh);
+    if (writeThrough != NULL) {
+        writeThrough->sync(false);
+    }
 
     int res = close(dup(fi->fh));
 
@@ -702,22 +1401,31 @@ unsigned long getFileSize(const char *path) {
     return size;
 }
 
-void closeOnServer(const char *path) {
+// Send the cached copy of 'path' with putFile, and retire its recovery file once the server
+// has it. Returns whether the upload succeeded.
+bool putCachedFile(const char *path) {
     struct timespec ts_send_start, ts_send_end;
     if (debugMode <= DebugLevel::LevelInfo) {
         get_time(&ts_send_start);
     }
 
-    int res =
-        options.afsclient->rpc_putFile(cache->getCachedPath("").c_str(), path);
+    // Taken before reading the file: a close meanwhile installs a newer one
+    string recoveryFile = recoveryFiles.current(path);
+    int res = enableRawFileTransfer
+        ? options.afsclient->rpc_putFileRaw(cache->getCachedPath("").c_str(), path)
+        : options.afsclient->rpc_putFile(cache->getCachedPath("").c_str(), path);
 
     if (debugMode <= DebugLevel::LevelInfo) {
         get_time(&ts_send_end);
     }
 
-    if ((res < 0) && (debugMode <= DebugLevel::LevelError)) {
-        printf("%s \t: File failed to send to server.\n", __func__);
+    if (!res) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: File failed to send to server.\n", __func__);
+        }
+        return false;
     }
+    recoveryFiles.uploaded(path, recoveryFile);
 
     if (debugMode <= DebugLevel::LevelInfo) {
         printf(
@@ -726,26 +1434,104 @@ void closeOnServer(const char *path) {
             __func__, get_time_diff(&ts_send_start, &ts_send_end),
             getFileSize(path), path);
     }
+    return true;
+}
 
-    if (debugMode <= DebugLevel::LevelInfo) {
-        printf("%s \t: Hopefully file is sent to server.\n", __func__);
+void closeOnServer(const char *path) {
+    putCachedFile(path);
+}
+
+// Read the whole content of the small file 'localFile', of the size given in 'local'
+bool readSmallFile(const char *localFile, struct stat *local, string *data) {
+    data->resize(local->st_size);
+    int fd = open(localFile, O_RDONLY);
+    if (fd == -1 || pread(fd, &(*data)[0], data->size(), 0) != (ssize_t)data->size()) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: Failed to read %s.\n", __func__, localFile);
+            perror(strerror(errno));
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
     }
+    close(fd);
+    return true;
 }
 
-void renameRecoveryFileDuringRelease(string tempFileName, string originalFile) {
-    int tempRes = rename(tempFileName.c_str(), originalFile.c_str());        
-    if (tempRes != -1) {
+// Send a small file in one COMPOUND round trip. NVERIFY stops it if the server already has
+// a file with the same modification time. Otherwise PUT stores the data and mode atomically
+// and returns the new times, which are applied to 'localFile' so that the next NVERIFY
+// against it matches. Returns whether the server has the file, the recovery file of 'path' is
+// retired then.
+bool putFileInline(const char *path, const char *localFile, struct stat *local) {
+    string recoveryFile = recoveryFiles.current(path);
+    string data;
+    if (!readSmallFile(localFile, local, &data)) {
+        return false;
+    }
+
+    CompoundRequest request;
+    CompoundReply reply;
+    NverifyRequest *nverify = request.add_ops()->mutable_nverify();
+    nverify->set_path(path);
+    nverify->set_mtimtvsec(local->st_mtim.tv_sec);
+    nverify->set_mtimtvnsec(local->st_mtim.tv_nsec);
+    SmallFile *put = request.add_ops()->mutable_put();
+    put->set_path(path);
+    put->set_mode(local->st_mode & 07777);
+    put->mutable_content()->swap(data);
+
+    int res = options.afsclient->rpc_compound(request, &reply);
+    if (res == -EEXIST && reply.results_size() == 1) {
         if (debugMode <= DebugLevel::LevelInfo) {
-            printf("%s \t: Renamed from %s to %s.\n", __func__,
-                tempFileName.c_str(), originalFile.c_str());
+            printf("%s \t : No writes done, so no need to send this file!\n", __func__);
         }
+        recoveryFiles.uploaded(path, recoveryFile);
+        return true;
     }
-    else {
+    if (res != 0) {
         if (debugMode <= DebugLevel::LevelError) {
-            printf("%s \t: Failed to rename from %s to %s.\n", __func__,
-                tempFileName.c_str(), originalFile.c_str());
-            perror(strerror(errno));
+            printf("%s \t: File failed to send to server.\n", __func__);
         }
+        return false;
+    }
+    recoveryFiles.uploaded(path, recoveryFile);
+
+    struct stat remote;
+    AfsClient::toStat(reply.results(1).stat(), &remote);
+    struct timespec ts[2];
+    ts[0] = remote.st_atim;
+    ts[1] = remote.st_mtim;
+    utimensat(AT_FDCWD, localFile, ts, AT_SYMLINK_NOFOLLOW);
+    return true;
+}
+
+// Send the cached copy of 'path' to the server, the way client_release sends a dirty file.
+// Returns whether the upload succeeded.
+bool uploadCachedFile(const char *path) {
+    // An older version of the file may still be waiting in the batcher
+    uploadBatcher->drain();
+    string s_path = cache->getCachedPath(path);
+    struct stat local;
+    if (lstat(s_path.c_str(), &local) != 0) {
+        return false;
+    }
+    if ((unsigned long)local.st_size <= options.inline_size) {
+        return putFileInline(path, s_path.c_str(), &local);
+    }
+    return putCachedFile(path);
+}
+
+// The UploadBatcher stored 'upload': the times the server gave it are applied to the cached copy,
+// unless that was modified again meanwhile
+void batchedUploadStored(const PendingUpload &upload, struct stat *remote) {
+    const char *path = upload.path.c_str();
+    struct stat cached;
+    if (lstat(cache->getCachedPath(path).c_str(), &cached) == 0 &&
+        cached.st_mtim.tv_sec == upload.local.st_mtim.tv_sec &&
+        cached.st_mtim.tv_nsec == upload.local.st_mtim.tv_nsec) {
+        cache->applyRemoteTimes(path, remote);
     }
 }
 
@@ -772,34 +1558,75 @@ static int client_release(const char *path, struct fuse_file_info *fi) {
         return 0;
     }
 
+    if (isWarmupControl(fi)) {
+        string manifest;
+        {
+            std::lock_guard<std::mutex> guard(warmup->lock);
+            manifest.swap(warmup->written);
+        }
+        if (!manifest.empty()) {
+            warmup->start(manifest);
+        }
+        return 0;
+    }
+    if (isDirect(fi)) {
+        delete directHandles.take(fi->fh);
+        return 0;
+    }
+    if (isBlockCached(fi)) {
+        blockCache->release(fi->fh);
+        return 0;
+    }
+
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t: File to release = %s, fd = %lu\n", __func__,
                s_path.c_str(), fi->fh);
     }
 
     int res = 0;
-    bool needToSend = isFileModified(path, fi);
-    struct stat server_buf;
+    // Whether the file needs uploading is decided locally: the handle's dirty bit is set by the
+    // writes and truncations done through it
+    OpenFile file;
+    bool known = cache->takeOpenFile(fi->fh, &file);
+    // A handle in write-through mode has nothing to upload, unless a range write failed
+    bool writtenThrough = false;
+    if (known && file.writeThrough != NULL) {
+        writeThroughs->remove(file.writeThrough);
+        writtenThrough = file.writeThrough->sync(false);
+        delete file.writeThrough;
+    }
+    // A copy shared with other writable handles is uploaded at the release of the last of them
+    if (known && !file.sharedPath.empty() && !cache->leaveSharedCopy(&file)) {
+        return close(fi->fh);
+    }
+    bool needToSend = known && file.dirty && !writtenThrough;
+    struct stat local_buf;
+    bool sendInline = needToSend && fstat(fi->fh, &local_buf) == 0 &&
+                      (unsigned long)local_buf.st_size <= options.inline_size;
+    // Under a delegation the upload is deferred
+    bool delegated = needToSend && delegations->holds(path);
+    bool isTempFile = known && !file.tempPath.empty();
+
+    if (needToSend && debugMode <= DebugLevel::LevelInfo) {
+        struct stat cached_buf;
+        if (lstat(s_path.c_str(), &cached_buf) == 0 &&
+            (cached_buf.st_mtim.tv_sec != file.base.tv_sec ||
+             cached_buf.st_mtim.tv_nsec != file.base.tv_nsec)) {
+            printf("%s \t: %s was refreshed while open, the last close wins\n", __func__, path);
+        }
+    }
 
     string recovery_path; 
     if (needToSend) {        
         fdatasync(fi->fh);
-        if (enableTempFileWrites && cache->isTempFile(fi -> fh)) {
+        if (enableTempFileWrites && isTempFile) {
             if (crashSite == 5) {
                 raise(SIGSEGV);
             }
-            recovery_path = cache->createRecoveryPath(fi -> fh);
+            recovery_path = cache->createRecoveryPath(file.tempPath);
         }        
     }
 
-    int tempFd = -1;
-    string tempFileName;
-    bool isTempFile = cache->isTempFile(fi->fh);
-
-    if (enableTempFileWrites && isTempFile) {
-        tempFd = fi->fh;
-        tempFileName = cache->getCachedPath(path, true, tempFd);
-    }
     res = close(fi->fh);
 
     if (res == -1) {
@@ -817,29 +1644,54 @@ static int client_release(const char *path, struct fuse_file_info *fi) {
         }
     }
 
-    if (needToSend) {
-        if (getFileSize(path) > parallel_close_file_size_thresh) {
-            if (enableTempFileWrites && isTempFile) {
-                renameRecoveryFileDuringRelease(recovery_path, cache->getCachedPath(path));
-                cache->clearTempFile(tempFd);
+    if (!needToSend && enableTempFileWrites && isTempFile) {
+        if (file.dirty) {
+            // Written through, the copy now matches the server
+            rename(file.tempPath.c_str(), s_path.c_str());
+        } else {
+            // Unchanged, the cached copy is still current
+            unlink(file.tempPath.c_str());
+        }
+    }
+
+    if (needToSend && delegated) {
+        // Kept until the delegation uploads the copy
+        if (enableTempFileWrites && isTempFile) {
+            recoveryFiles.install(path, s_path, recovery_path);
+        }
+        if (!delegations->defer(path)) {
+            // Recalled meanwhile
+            delegations->upload(path);
+        }
+    } else if (needToSend) {
+        if (crashSite == 2) {
+            raise(SIGSEGV);
+        }
+        // The copy becomes the cached one now, its recovery file stays until the upload succeeds
+        if (enableTempFileWrites && isTempFile) {
+            recoveryFiles.install(path, s_path, recovery_path);
+        }
+        if (sendInline && enableBatchedUploads) {
+            PendingUpload upload;
+            upload.path = path;
+            upload.local = local_buf;
+            upload.recoveryFile = recoveryFiles.current(path);
+            if (readSmallFile(s_path.c_str(), &local_buf, &upload.data)) {
+                uploadBatcher->submit(std::move(upload));
             }
+        } else if (sendInline) {
+            putFileInline(path, s_path.c_str(), &local_buf);
+        } else if (getFileSize(path) > parallel_close_file_size_thresh) {
             closeBuffer->submitRequest(path);
         } else {
-            if (enableTempFileWrites && isTempFile) {
-                std::size_t lastPos = recovery_path.find_last_of("/");
-                string originalFile = recovery_path.substr(lastPos, recovery_path.length());
-                if (crashSite == 2) {
-                    raise(SIGSEGV);
-                }
-                closeOnServer(originalFile.c_str());
-                if (crashSite == 1) {
-                    raise(SIGSEGV);
-                }
-                renameRecoveryFileDuringRelease(recovery_path, cache->getCachedPath(path));
-                cache->clearTempFile(tempFd);
-            } else {
-                closeOnServer(path);
-            }         
+            closeOnServer(path);
+        }
+        if (crashSite == 1) {
+            raise(SIGSEGV);
+        }
+        // Uploaded in the background, the file is too big to be worth a delegation
+        if (enableWriteDelegations && getFileSize(path) <= parallel_close_file_size_thresh) {
+            delegations->request(path);
         }
     }
 
@@ -857,15 +1709,57 @@ static int client_fsync(const char *path, int isdatasync, struct fuse_file_info
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t : Path = %s , isDataSync = %d\n", __func__, path, isdatasync);
     }
+    if (isWarmupControl(fi) || isDirect(fi) || isBlockCached(fi)) {
+        return 0;
+    }
     int res = 0;
     if (isdatasync != 0) {
         res = fdatasync(fi->fh);
     } else {
         res = fsync(fi->fh);
     }
+    WriteThrough *writeThrough = cache->writeThroughOf(fi->fh);
+    if (res == 0 && writeThrough != NULL && !writeThrough->sync(true)) {
+        return -EIO;
+    }
     return res;
 }
 
+// A truncation through an open handle changes the copy the handle writes to, and is uploaded on
+// release like a write. One by path changes the cached copy and is uploaded at once, as if the
+// file had been opened, truncated and closed. The warmup control file ignores truncations, which
+// shells do when a manifest is written to it with '>'.
+static int client_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    if (debugMode <= DebugLevel::LevelInfo) {
+        printf("%s \t: Path = %s, size = %ld\n", __func__, path, size);
+    }
+    if (isWarmupControl(path)) {
+        return 0;
+    }
+    if (fi != NULL) {
+        if (ftruncate(fi->fh, size) == -1) {
+            return -errno;
+        }
+        cache->markDirty(fi->fh);
+        WriteThrough *writeThrough = cache->writeThroughOf(fi->fh);
+        if (writeThrough != NULL) {
+            writeThrough->fail();
+        }
+        return 0;
+    }
+
+    if (cache->isCached(path) == false) {
+        cache->cacheFile(path);
+    }
+    if (truncate(cache->getCachedPath(path).c_str(), size) == -1) {
+        return -errno;
+    }
+    if (!delegations->defer(path)) {
+        uploadCachedFile(path);
+    }
+    return 0;
+}
+
 static struct client_operations : fuse_operations {
     client_operations() {
         init = client_init;
@@ -885,10 +1779,472 @@ static struct client_operations : fuse_operations {
         flush = client_flush;
         release = client_release;
         fsync = client_fsync;
+        truncate = client_truncate;
     }
 
 } client_oper;
 
+InodeTable *inodeTable;
+bool passthroughActive = false;  // the kernel agreed to FUSE passthrough
+struct fuse_session *lowlevelSession = NULL;
+
+// The entries of a directory opened in the low-level mode, listed once at opendir so that
+// readdir can resume from any offset. fi->fh points to it.
+struct DirListing {
+    vector<std::pair<string, mode_t>> entries;
+};
+
+static int collectDirListing(void *buf, const char *name, const struct stat *stbuf, off_t off,
+                             enum fuse_fill_dir_flags flags) {
+    ((DirListing *)buf)->entries.emplace_back(name, stbuf != NULL ? stbuf->st_mode : 0);
+    return 0;
+}
+
+// Answer a lookup of 'path' (or the creation of a node there) with its inode and attributes.
+// 'fi' is the handle of a file just created, whose attributes are those of its cached copy.
+static void replyEntry(fuse_req_t req, const string &path, struct fuse_file_info *fi = NULL) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    int res = client_getattr(path.c_str(), &e.attr, fi);
+    if (res == -ENOENT && fi == NULL && options.negative_timeout > 0) {
+        // Inode 0 lets the kernel remember that the name does not exist
+        e.entry_timeout = options.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    e.ino = inodeTable->remember(path);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = options.attr_timeout;
+    e.entry_timeout = options.entry_timeout;
+    if (fi != NULL) {
+        fuse_reply_create(req, &e, fi);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+// Replies with the result of an operation that has no other answer than its error code
+static void replyResult(fuse_req_t req, int res) {
+    fuse_reply_err(req, res < 0 ? -res : res);
+}
+
+static void client_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    struct fuse_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    client_init(conn, &cfg);
+    // Reads are spliced from the cached copies when the kernel can take them that way
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+#ifdef FUSE_CAP_PASSTHROUGH
+    // Offered by Linux 6.9 and later, through libfuse 3.16 and later
+    // The kernel does not combine it with the writeback cache
+    if (enablePassthrough && !writebackActive && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+        // The cache folder may be on a stacked file system, like the overlayfs of a container
+        conn->max_backing_stack_depth = 1;
+        passthroughActive = true;
+    }
+#endif
+}
+
+static void client_ll_destroy(void *userdata) {
+    client_destroy(userdata);
+}
+
+static void client_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    if (!inodeTable->child(parent, name, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    replyEntry(req, path);
+}
+
+static void client_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    inodeTable->forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void client_ll_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        inodeTable->forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void client_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    if (!inodeTable->path(ino, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat st;
+    int res = client_getattr(path.c_str(), &st, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+static void client_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                              struct fuse_file_info *fi) {
+    string path;
+    if (!inodeTable->path(ino, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = 0;
+    // Like the path-based mode, which has no chmod or chown
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        res = -ENOSYS;
+    }
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        res = client_truncate(path.c_str(), attr->st_size, fi);
+    }
+    if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec ts[2];
+        ts[0].tv_sec = ts[1].tv_sec = 0;
+        ts[0].tv_nsec = ts[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+            ts[0].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_ATIME) {
+            ts[0] = attr->st_atim;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            ts[1].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_MTIME) {
+            ts[1] = attr->st_mtim;
+        }
+        res = client_utimens(path.c_str(), ts, fi);
+    }
+    if (res != 0) {
+        replyResult(req, res);
+        return;
+    }
+    client_ll_getattr(req, ino, fi);
+}
+
+static void client_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    if (!inodeTable->path(ino, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    DirListing *dir = new DirListing();
+    int res = client_readdir(path.c_str(), dir, collectDirListing, 0, fi,
+                             static_cast<fuse_readdir_flags>(0));
+    if (res != 0) {
+        delete dir;
+        replyResult(req, res);
+        return;
+    }
+    fi->fh = (uint64_t)dir;
+    fuse_reply_open(req, fi);
+}
+
+static void client_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                              struct fuse_file_info *fi) {
+    DirListing *dir = (DirListing *)fi->fh;
+    vector<char> buf(size);
+    size_t used = 0;
+    for (size_t i = off; i < dir->entries.size(); i++) {
+        // Entries have no inode until looked up
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = 0xffffffff;
+        st.st_mode = dir->entries[i].second;
+        size_t length = fuse_add_direntry(req, buf.data() + used, size - used,
+                                          dir->entries[i].first.c_str(), &st, i + 1);
+        if (length > size - used) {
+            break;
+        }
+        used += length;
+    }
+    fuse_reply_buf(req, buf.data(), used);
+}
+
+static void client_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    delete (DirListing *)fi->fh;
+    fuse_reply_err(req, 0);
+}
+
+// Hand the file of a new handle to the kernel, which then reads and writes it without calling
+// the client. Opens and closes still come here and keep the AFS semantics. Without passthrough,
+// or if the kernel refuses the file (registering one needs CAP_SYS_ADMIN), the handle is served
+// by read and write as usual.
+static void passThrough(fuse_req_t req, struct fuse_file_info *fi) {
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (!passthroughActive || isWarmupControl(fi) || isDirect(fi) || isBlockCached(fi) ||
+        cache->writeThroughOf(fi->fh) != NULL) {
+        return;
+    }
+    int backingId = fuse_passthrough_open(req, fi->fh);
+    if (backingId > 0) {
+        fi->backing_id = backingId;
+        cache->setBackingId(fi->fh, backingId);
+    }
+#endif
+}
+
+static void client_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    if (!inodeTable->path(ino, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    client_open(path.c_str(), fi);
+    if (fi->fh == (uint64_t)-1) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    passThrough(req, fi);
+    fuse_reply_open(req, fi);
+}
+
+static void client_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi) {
+    if (isWarmupControl(fi) || isDirect(fi) || isBlockCached(fi)) {
+        vector<char> buf(size);
+        int res = client_read(warmupControlPath, buf.data(), size, off, fi);
+        if (res < 0) {
+            fuse_reply_err(req, -res);
+            return;
+        }
+        fuse_reply_buf(req, buf.data(), res);
+        return;
+    }
+    // The kernel gets the data straight from the descriptor of the cached copy, spliced when
+    // it allows that, instead of through a buffer here
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd = fi->fh;
+    buf.buf[0].pos = off;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void client_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+    string path;
+    if (!inodeTable->path(ino, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_write(path.c_str(), buf, size, off, fi);
+    if (res < 0) {
+        replyResult(req, res);
+        return;
+    }
+    fuse_reply_write(req, res);
+}
+
+static void client_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    inodeTable->path(ino, &path);
+    replyResult(req, client_flush(path.c_str(), fi));
+}
+
+static void client_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    string path;
+    inodeTable->path(ino, &path);
+    int backingId = cache->backingIdOf(fi->fh);
+    int res = client_release(path.c_str(), fi);
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (backingId > 0) {
+        fuse_passthrough_close(req, backingId);
+    }
+#endif
+    replyResult(req, res);
+}
+
+static void client_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi) {
+    string path;
+    inodeTable->path(ino, &path);
+    replyResult(req, client_fsync(path.c_str(), datasync, fi));
+}
+
+static void client_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                             struct fuse_file_info *fi) {
+    string path;
+    if (!inodeTable->child(parent, name, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_create(path.c_str(), mode, fi);
+    if (res != 0) {
+        replyResult(req, res);
+        return;
+    }
+    passThrough(req, fi);
+    replyEntry(req, path, fi);
+}
+
+static void client_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                            dev_t rdev) {
+    string path;
+    if (!inodeTable->child(parent, name, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_mknod(path.c_str(), mode, rdev);
+    if (res != 0) {
+        replyResult(req, res);
+        return;
+    }
+    replyEntry(req, path);
+}
+
+static void client_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    string path;
+    if (!inodeTable->child(parent, name, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_mkdir(path.c_str(), mode);
+    if (res != 0) {
+        replyResult(req, res);
+        return;
+    }
+    replyEntry(req, path);
+}
+
+static void client_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    if (!inodeTable->child(parent, name, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_unlink(path.c_str());
+    if (res == 0) {
+        inodeTable->removed(path);
+    }
+    replyResult(req, res);
+}
+
+static void client_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    string path;
+    if (!inodeTable->child(parent, name, &path)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_rmdir(path.c_str());
+    if (res == 0) {
+        inodeTable->removed(path);
+    }
+    replyResult(req, res);
+}
+
+static void client_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname, unsigned int flags) {
+    string from, to;
+    if (!inodeTable->child(parent, name, &from) || !inodeTable->child(newparent, newname, &to)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int res = client_rename(from.c_str(), to.c_str(), flags);
+    if (res == 0) {
+        inodeTable->renamed(from, to);
+    }
+    replyResult(req, res);
+}
+
+static struct client_lowlevel_operations : fuse_lowlevel_ops {
+    client_lowlevel_operations() {
+        init = client_ll_init;
+        destroy = client_ll_destroy;
+        lookup = client_ll_lookup;
+        forget = client_ll_forget;
+        forget_multi = client_ll_forget_multi;
+        getattr = client_ll_getattr;
+        setattr = client_ll_setattr;
+        opendir = client_ll_opendir;
+        readdir = client_ll_readdir;
+        releasedir = client_ll_releasedir;
+        open = client_ll_open;
+        read = client_ll_read;
+        write = client_ll_write;
+        flush = client_ll_flush;
+        release = client_ll_release;
+        fsync = client_ll_fsync;
+        create = client_ll_create;
+        mknod = client_ll_mknod;
+        mkdir = client_ll_mkdir;
+        unlink = client_ll_unlink;
+        rmdir = client_ll_rmdir;
+        rename = client_ll_rename;
+    }
+
+} client_ll_oper;
+
+// Mount with the low-level API and serve requests until unmounted, as fuse_main does for the
+// path-based operations
+static int runLowLevel(struct fuse_args *args) {
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        return 1;
+    }
+    if (opts.show_help) {
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        return 0;
+    }
+    if (opts.mountpoint == NULL) {
+        printf("%s \t: No mountpoint given\n", __func__);
+        return 1;
+    }
+
+    inodeTable = new InodeTable();
+    int res = 1;
+    struct fuse_session *se =
+        fuse_session_new(args, &client_ll_oper, sizeof(client_ll_oper), &options);
+    lowlevelSession = se;
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                if (opts.singlethread) {
+                    res = fuse_session_loop(se);
+                } else {
+                    res = fuse_session_loop_mt(se, opts.clone_fd);
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        lowlevelSession = NULL;
+        fuse_session_destroy(se);
+    }
+    free(opts.mountpoint);
+    fuse_opt_free_args(args);
+    return res ? 1 : 0;
+}
+
+// Make the kernel forget the attributes and pages it keeps of 'path', after a change on the
+// server. Called from the change sync thread, never while serving a request of the kernel.
+static void invalidateKernelCache(const string &path) {
+    if (lowlevelSession != NULL) {
+        fuse_ino_t ino;
+        if (inodeTable->find(path, &ino)) {
+            fuse_lowlevel_notify_inval_inode(lowlevelSession, ino, 0, 0);
+        }
+        return;
+    }
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+    if (kernelFs != NULL) {
+        fuse_invalidate_path(kernelFs, path.c_str());
+    }
+#endif
+}
+
 string getCurrentWorkingDir() {
     char arg1[20];
     char exepath[PATH_MAX + 1] = {0};
@@ -952,10 +2308,36 @@ int main(int argc, char *argv[]) {
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-    options.afsclient = new AfsClient(grpc::CreateChannel(
-        server_address.c_str(), grpc::InsecureChannelCredentials()));
+    // Every call carries the id of this mount, which the server keys write delegations by
+    std::random_device random;
+    char clientId[33];
+    snprintf(clientId, sizeof(clientId), "%08x%08x%08x%08x", random(), random(), random(), random());
+    std::vector<std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>> interceptors;
+    interceptors.emplace_back(new ClientIdInterceptorFactory(clientId));
+    options.afsclient = new AfsClient(grpc::experimental::CreateCustomChannelWithInterceptors(
+        server_address.c_str(), grpc::InsecureChannelCredentials(), grpc::ChannelArguments(),
+        std::move(interceptors)));
+    options.inline_size = 65536;
+    options.entry_timeout = 1.0;
+    options.attr_timeout = 1.0;
+    options.negative_timeout = 0.0;
+    options.keep_cache = 1;
+    options.block_cache_size = 1UL << 30;
 
     if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) return 1;
+    if (options.durability != NULL) {
+        if (strcmp(options.durability, "none") == 0) {
+            durability = Durability::None;
+        } else if (strcmp(options.durability, "periodic") == 0) {
+            durability = Durability::Periodic;
+        } else if (strcmp(options.durability, "close") == 0) {
+            durability = Durability::OnClose;
+        } else {
+            printf("%s \t: Unknown durability %s, expected none, periodic or close\n", __func__,
+                   options.durability);
+            return 1;
+        }
+    }
 
     if (options.show_help) {
         show_help(argv[0]);
@@ -968,6 +2350,26 @@ int main(int argc, char *argv[]) {
         printf("%s \t: CurrentWorkingDir = %s\n", __func__, rootDir.c_str());
     }
     cache = new Cache(rootDir, cachedFolderName);
+    // Kept next to the cache folder, so it survives clearing the cache
+    accessHistory = new AccessHistory(rootDir + "/" + cachedFolderName + ".history");
+    if (enableHistoryPrefetch && !accessHistory->Load() && debugMode <= DebugLevel::LevelInfo) {
+        printf("%s \t: No access history to load\n", __func__);
+    }
+    changeSync = new ChangeSync(options.afsclient, rootDir + "/" + cachedFolderName + ".cursor",
+                                cache->getCachedPath(""), invalidateKernelCache,
+                                changelog_poll_ms, changelog_max_staleness_ms,
+                                changelog_batch_max, changelog_max_stale);
+    // Apart from the cache folder, where a partial copy would pass for a cached file
+    blockCache = new BlockCache(options.afsclient, rootDir + "/" + cachedFolderName + ".blocks",
+                                block_cache_block_size, block_cache_readahead,
+                                block_cache_fetch_timeout_ms, options.block_cache_size);
+    if (options.block_cache_min_size != 0) {
+        blockCache->load();
+    }
+    if (enableChangeLogSync && !changeSync->load() && debugMode <= DebugLevel::LevelInfo) {
+        printf("%s \t: No change log cursor to load, the whole cache will be revalidated\n",
+               __func__);
+    }
 
     if (stat(clientFolderPath.c_str(), &buffer) == 0) {
         if (debugMode <= DebugLevel::LevelInfo) {
@@ -989,30 +2391,26 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    return fuse_main(argc, argv, &client_oper, &options);
+    if (options.lowlevel) {
+        return runLowLevel(&args);
+    }
+    // fuse_opt_parse took the options of this client out of args, which libfuse would reject
+    int res = fuse_main(args.argc, args.argv, &client_oper, &options);
+    fuse_opt_free_args(&args);
+    return res;
 }
 
 void BoundedBuffer::consumer() {
     while (notDone) {
         string path = fetch();
         if (notDone) {
-            closeOnServer(path.c_str());
+            handler(path.c_str());
         }
     }
 }
 
 void BoundedBuffer::submitRequest(string path) { deposit(path); }
 
-inline void get_time(struct timespec *ts) {
-    clock_gettime(CLOCK_MONOTONIC, ts);
-}
-
-inline double get_time_diff(struct timespec *before, struct timespec *after) {
-    double delta_s = after->tv_sec - before->tv_sec;
-    double delta_ns = after->tv_nsec - before->tv_nsec;
-
-    return (delta_s + (delta_ns * 1e-9)) * ((double)1e3);
-}
 void printFileTimeFields(const char *func, int fd) {
     struct stat buff;
     struct timespec ts[3];
@@ -1056,8 +2454,8 @@ void printFileTimeFields(const char *func, const char *path) {
         ts[2].tv_sec, ts[2].tv_nsec, res);
 }
 
-BoundedBuffer::BoundedBuffer(int capacity)
-    : capacity(capacity), front(0), rear(0), count(0), notDone(true) {
+BoundedBuffer::BoundedBuffer(int capacity, void (*handler)(const char *path))
+    : capacity(capacity), front(0), rear(0), count(0), notDone(true), handler(handler) {
     buffer = new string[capacity];
     cout << "Shared queue system created." << endl;
 }
@@ -1080,6 +2478,23 @@ void BoundedBuffer::deposit(string path) {
     not_empty.notify_one();
 }
 
+// Like deposit(), but gives up instead of waiting if the buffer is full
+bool BoundedBuffer::tryDeposit(string path) {
+    std::unique_lock<std::mutex> l(lock);
+
+    if (count == capacity) {
+        return false;
+    }
+
+    buffer[rear] = path;
+    rear = (rear + 1) % capacity;
+    ++count;
+
+    l.unlock();
+    not_empty.notify_one();
+    return true;
+}
+
 string BoundedBuffer::fetch() {
     std::unique_lock<std::mutex> l(lock);
 
@@ -1142,11 +2557,12 @@ string Cache::getCachedPath(const char *path, bool tempPath, int fd) {
         }
         string tempFileName;
         if (fd == -1) {
-            tempFileName = cachedRoot + string(path) + ".temp." +
-                           std::to_string(rand() % 10000);
+            tempFileName = cachedRoot + string(path) + ".temp." + unique_suffix();
         } else {
-            auto it = tempFdToPathMap.find(fd);
-            if (it == tempFdToPathMap.end()) {
+            OpenFileShard &shard = shardOf(fd);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            auto it = shard.files.find(fd);
+            if (it == shard.files.end() || it->second.tempPath.empty()) {
                 if (debugMode <= DebugLevel::LevelError) {
                     printf(
                         "%s \t: Requested temp path for fd = %d"
@@ -1154,7 +2570,7 @@ string Cache::getCachedPath(const char *path, bool tempPath, int fd) {
                         __func__, fd);
                 }
             } else {
-                tempFileName = it->second;
+                tempFileName = it->second.tempPath;
             }
         }
         return tempFileName;
@@ -1162,35 +2578,130 @@ string Cache::getCachedPath(const char *path, bool tempPath, int fd) {
     return cachedRoot + string(path);
 }
 
-void Cache::correctStaleness(const char *path, struct stat *buffer) {
+// Was 'local' modified before 'remote'?
+static bool isOlder(const struct stat *local, const struct stat *remote) {
+    return local->st_mtim.tv_sec < remote->st_mtim.tv_sec ||
+           (local->st_mtim.tv_sec == remote->st_mtim.tv_sec &&
+            local->st_mtim.tv_nsec < remote->st_mtim.tv_nsec);
+}
+
+// Bring the cached copy of 'path' up to date in a single COMPOUND round trip: NVERIFY against
+// the cached modification time (when there is a cached copy in 'buffer'), then a LOOKUP that
+// returns the content of files up to options.inline_size bytes along with the attributes.
+// Larger files are streamed by fetchFile(). Returns 1 if a new copy was fetched, 0 if the cached
+// copy is current, or a negated errno.
+// Concurrent refreshes of a path (parallel opens of an uncached file, say) share one round trip
+// and one fetch. A caller that joins a refresh already on its way gets the version that refresh
+// found, as if it had opened the file a moment earlier.
+int Cache::refreshFile(const char *path, struct stat *buffer) {
+    return refreshes.run(path, [&]() { return doRefreshFile(path, buffer); });
+}
+
+int Cache::doRefreshFile(const char *path, struct stat *buffer) {
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t: Path = %s\n", __func__, path);
     }
+    uint64_t ticket = changeSync->ticket();
+    struct timespec started;
+    clock_gettime(CLOCK_REALTIME, &started);
+
+    CompoundRequest request;
+    CompoundReply reply;
+    if (buffer != NULL) {
+        NverifyRequest *nverify = request.add_ops()->mutable_nverify();
+        nverify->set_path(path);
+        nverify->set_mtimtvsec(buffer->st_mtim.tv_sec);
+        nverify->set_mtimtvnsec(buffer->st_mtim.tv_nsec);
+    }
+    LookupRequest *lookup = request.add_ops()->mutable_lookup();
+    lookup->set_path(path);
+    lookup->set_max_inline(options.inline_size);
+
+    // Stopped by NVERIFY (the cached copy is current) or the file is gone on the server
+    int res = options.afsclient->rpc_compound(request, &reply);
+    if (res == -EEXIST && buffer != NULL && reply.results_size() == 1) {
+        changeSync->validated(path, ticket);
+        revalidator->validated(path, &started);
+        return 0;
+    }
+    if (res != 0) {
+        return res;
+    }
 
+    LookupReply *lookupReply = reply.mutable_results(reply.results_size() - 1)->mutable_lookup();
     struct stat remoteFileStatBuffer;
-    int res = options.afsclient->rpc_getattr(path, &remoteFileStatBuffer);
-    if (res == -1) {
-        return;
+    AfsClient::toStat(lookupReply->stat(), &remoteFileStatBuffer);
+
+    if (buffer != NULL && !isOlder(buffer, &remoteFileStatBuffer)) {
+        changeSync->validated(path, ticket);
+        revalidator->validated(path, &started);
+        return 0;
+    }
+
+    if (debugMode <= DebugLevel::LevelInfo) {
+        printf("%s \t: File is old. Refreshing this file : %s.\n", 
+                __func__, path);
     }
 
-    struct timespec lastModifiedTime;
-    lastModifiedTime.tv_sec = remoteFileStatBuffer.st_mtim.tv_sec;
-    lastModifiedTime.tv_nsec = remoteFileStatBuffer.st_mtim.tv_nsec;
+    bool stored = lookupReply->inlined()
+        ? storeFile(path, lookupReply->content(), &remoteFileStatBuffer)
+        : fetchFile(path);
+    if (stored) {
+        changeSync->validated(path, ticket);
+    }
+    return 1;
+}
 
-    if ((buffer->st_mtim.tv_sec < lastModifiedTime.tv_sec) 
-        || 
-        ((buffer->st_mtim.tv_sec == lastModifiedTime.tv_sec) 
-          && 
-        (buffer->st_mtim.tv_nsec < lastModifiedTime.tv_nsec)
-        )
-       ) 
-    {
-        if (debugMode <= DebugLevel::LevelInfo) {
-            printf("%s \t: File is old. Refreshing this file : %s.\n", 
-                    __func__, path);
+// Replace the cached copy of 'path' with 'data' that arrived inline. Returns false on failure.
+bool Cache::storeFile(const char *path, const string &data, struct stat *remote) {
+    string filename = getCachedPath(path);
+    string tempFileName = filename + "_" + unique_suffix() + ".txt";
+
+    int fd = open(tempFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: Failed to cache file %s\n", __func__, filename.c_str());
+            perror(strerror(errno));
+        }
+        if (fd != -1) {
+            close(fd);
+            unlink(tempFileName.c_str());
+        }
+        return false;
+    }
+    close(fd);
+
+    if (rename(tempFileName.c_str(), filename.c_str()) != 0) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t : Failed to rename from %s to %s.\n",
+                   __func__, tempFileName.c_str(), filename.c_str());
         }
-        
-        fetchFile(path);
+        unlink(tempFileName.c_str());
+        return false;
+    }
+    applyRemoteTimes(path, remote);
+    return true;
+}
+
+// Give the cached copy of 'path' the access and modification times of the server's file
+void Cache::applyRemoteTimes(const char *path, struct stat *remote) {
+    struct timespec ts[2];
+    ts[0].tv_sec = remote->st_atim.tv_sec;
+    ts[0].tv_nsec = remote->st_atim.tv_nsec;
+
+    ts[1].tv_sec = remote->st_mtim.tv_sec;
+    ts[1].tv_nsec = remote->st_mtim.tv_nsec;
+
+    int res = utimensat(AT_FDCWD, (getCachedPath(path)).c_str(), ts,
+                        AT_SYMLINK_NOFOLLOW);
+    if (debugMode <= DebugLevel::LevelInfo) {
+        printFileTimeFields(__func__, (getCachedPath(path)).c_str());
+    }
+    if (res == -1 && debugMode <= DebugLevel::LevelError) {
+        printf("%s \t: Failed to set the atime and mtime of %s file.\n",
+               __func__, (getCachedPath(path)).c_str());
+        printf("%s \t : %s\n", __func__, path);
+        perror(strerror(errno));
     }
 }
 
@@ -1210,7 +2721,18 @@ bool Cache::isCached(const char *path) {
     if (S_ISDIR(buffer.st_mode)) {
         return true;
     }
-    correctStaleness(path, &buffer);
+    // No other client can have changed it without the delegation being recalled first
+    if (delegations->holds(path)) {
+        return true;
+    }
+    // Unchanged on the server as of the last poll of its change log
+    if (enableChangeLogSync && changeSync->trusts(path)) {
+        return true;
+    }
+    if (revalidator->serveStale(path, &buffer)) {
+        return true;
+    }
+    refreshFile(path, &buffer);
     return true;
 }
 
@@ -1256,11 +2778,14 @@ void Cache::mirrorDirectoryStructure(const char *path) {
     }
 }
 
-void Cache::fetchFile(const char *path) {
+// Stream the server's copy of 'path' into the cache. Returns false on failure.
+bool Cache::fetchFile(const char *path) {
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s \t: Fetching file %s from server.\n", __func__, path);
     }
-    options.afsclient->rpc_getFile(cachedRoot.c_str(), path);
+    bool fetched = enableRawFileTransfer
+        ? options.afsclient->rpc_getFileRaw(cachedRoot.c_str(), path)
+        : options.afsclient->rpc_getFile(cachedRoot.c_str(), path);
 
     struct stat buffer;
     if (stat((getCachedPath(path)).c_str(), &buffer) == 0) {
@@ -1280,39 +2805,284 @@ void Cache::fetchFile(const char *path) {
     }
 
     struct stat remoteFileStatBuffer;
-    int res = options.afsclient->rpc_getattr(path, &remoteFileStatBuffer);
-    if (res == -1) {
-        return;
+    int res = getattrBatcher->getattr(path, &remoteFileStatBuffer);
+    if (res != 0) {
+        return false;
     }
+    applyRemoteTimes(path, &remoteFileStatBuffer);
+    return fetched;
+}
 
-    struct timespec ts[2];
-    ts[0].tv_sec = remoteFileStatBuffer.st_atim.tv_sec;
-    ts[0].tv_nsec = remoteFileStatBuffer.st_atim.tv_nsec;
+void Cache::cacheFile(const char *path) {
+    mirrorDirectoryStructure(path);
 
-    ts[1].tv_sec = remoteFileStatBuffer.st_mtim.tv_sec;
-    ts[1].tv_nsec = remoteFileStatBuffer.st_mtim.tv_nsec;
+    refreshFile(path, NULL);
 
-    res = utimensat(AT_FDCWD, (getCachedPath(path)).c_str(), ts,
-                    AT_SYMLINK_NOFOLLOW);
+    if (enableDirectoryPrefetch) {
+        requestPrefetch(path);
+    }
+}
+
+// A cold open is a good hint that its siblings will be opened next. Queue the parent directory
+// of 'path' for a background bulk fetch, once per directory per mount.
+void Cache::requestPrefetch(const char *path) {
+    string dir(path);
+    dir = dir.substr(0, dir.find_last_of('/'));
+    {
+        std::lock_guard<std::mutex> guard(prefetchLock);
+        if (!prefetchedDirs.insert(dir).second) {
+            return;
+        }
+    }
+    prefetchBuffer->submitRequest(dir);
+}
+
+// Fetch many files in one bulk stream. The stream is read on this thread, and the messages are
+// handed to num_prefetch_workers threads that write the files into the cache in parallel.
+// Cached copies at least as new as the server's are left alone, so local changes not yet
+// written back are never overwritten.
+void Cache::prefetch(const BulkFetchRequest &request) {
+    uint64_t ticket = changeSync->ticket();
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<std::unique_ptr<BulkFetchReply>> queue;
+    bool streamDone = false;
+
+    auto worker = [&]() {
+        while (true) {
+            std::unique_ptr<BulkFetchReply> reply;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                not_empty.wait(l, [&]() { return !queue.empty() || streamDone; });
+                if (queue.empty()) {
+                    return;
+                }
+                reply = std::move(queue.front());
+                queue.pop_front();
+            }
+            not_full.notify_one();
+            for (const BulkFile &file : reply->files()) {
+                storePrefetchedFile(file, ticket);
+            }
+        }
+    };
+
+    std::vector<thread> workers;
+    for (int i = 0; i < num_prefetch_workers; i++) {
+        workers.emplace_back(worker);
+    }
+
+    // Bound the messages waiting for a worker, so a slow disk holds back the stream
+    int res = options.afsclient->rpc_bulkFetch(
+        request, [&](std::unique_ptr<BulkFetchReply> reply) {
+            {
+                std::unique_lock<std::mutex> l(lock);
+                not_full.wait(l, [&]() { return queue.size() < (size_t)(2 * num_prefetch_workers); });
+                queue.push_back(std::move(reply));
+            }
+            not_empty.notify_one();
+        });
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        streamDone = true;
+    }
+    not_empty.notify_all();
+    for (thread &t : workers) {
+        t.join();
+    }
+
+    if (res != 0 && debugMode <= DebugLevel::LevelError) {
+        printf("%s \t: Bulk fetch of %s failed\n", __func__, request.dir().c_str());
+    }
+}
+
+void Cache::prefetchDirectory(const char *path, bool recursive) {
     if (debugMode <= DebugLevel::LevelInfo) {
-        printFileTimeFields(__func__, (getCachedPath(path)).c_str());
+        printf("%s \t: Prefetching directory %s\n", __func__, path);
     }
-    if (res == -1 && debugMode <= DebugLevel::LevelError) {
-        printf("%s \t: Failed to set the atime and mtime of %s file.\n",
-               __func__, (getCachedPath(path)).c_str());
-        printf("%s \t : %s\n", __func__, path);
-        perror(strerror(errno));
+    BulkFetchRequest request;
+    request.set_dir(*path == '\0' ? "/" : path);
+    request.set_recursive(recursive);
+    request.set_max_file_size(prefetch_file_size_thresh);
+    prefetch(request);
+}
+
+void Cache::storePrefetchedFile(const BulkFile &file, uint64_t ticket) {
+    if (file.err() != 0) {
+        return;
+    }
+    const char *path = file.path().c_str();
+    struct stat remote, local;
+    AfsClient::toStat(file.stat(), &remote);
+    if (lstat(getCachedPath(path).c_str(), &local) == 0 && !isOlder(&local, &remote)) {
+        changeSync->validated(path, ticket);
+        return;
+    }
+    mirrorDirectoryStructure(path);
+    if (storeFile(path, file.content(), &remote)) {
+        changeSync->validated(path, ticket);
     }
 }
 
-void Cache::cacheFile(const char *path) {
+void prefetchOnServer(const char *path) {
+    cache->prefetchDirectory(path, false);
+}
+
+// Fetch a file predicted to be opened soon, unless it is cached already
+void Cache::prefetchFile(const char *path) {
+    struct stat buffer;
+    if (lstat(getCachedPath(path).c_str(), &buffer) == 0) {
+        return;
+    }
+    if (debugMode <= DebugLevel::LevelInfo) {
+        printf("%s \t: Prefetching file %s\n", __func__, path);
+    }
     mirrorDirectoryStructure(path);
+    refreshFile(path, NULL);
+}
+
+void prefetchFileOnServer(const char *path) {
+    cache->prefetchFile(path);
+}
+
+// Consumer of revalidateBuffer: the stale-while-revalidate refresh of a cached copy
+void revalidateOnServer(const char *path) {
+    struct stat buffer;
+    if (lstat(cache->getCachedPath(path).c_str(), &buffer) == 0 && !S_ISDIR(buffer.st_mode)) {
+        cache->refreshFile(path, &buffer);
+    }
+    revalidator->revalidated(path);
+}
+
+// Revalidator::Queue
+bool queueRevalidation(const char *path) {
+    return revalidateBuffer->tryDeposit(path);
+}
+
+// PeriodicSync::Sync
+void syncWrittenFiles() {
+    cache->syncWrittenFiles();
+}
+
+struct DirectoryListing {
+    vector<string> files;
+    vector<string> dirs;
+};
+
+static int collectEntry(void *buf, const char *name, const struct stat *stbuf, off_t off,
+                        enum fuse_fill_dir_flags flags) {
+    DirectoryListing *listing = static_cast<DirectoryListing *>(buf);
+    if (S_ISREG(stbuf->st_mode)) {
+        listing->files.push_back(name);
+    } else if (S_ISDIR(stbuf->st_mode) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        listing->dirs.push_back(name);
+    }
+    return 0;
+}
+
+// The regular files and the subdirectories of the server directory 'dir'
+DirectoryListing listDirectory(const string &dir) {
+    DirectoryListing listing;
+    options.afsclient->rpc_readdir(dir.empty() ? "/" : dir, &listing, collectEntry);
+    return listing;
+}
+
+// The regular files of the server directory 'dir', for the SequencePredictor
+vector<string> listRegularFiles(const string &dir) {
+    return listDirectory(dir).files;
+}
+
+// Add the paths of the files below the server directory 'dir' to 'paths'
+static void addFilesRecursively(const string &dir, vector<string> &paths) {
+    DirectoryListing listing = listDirectory(dir);
+    for (const string &name : listing.files) {
+        paths.push_back(dir + "/" + name);
+    }
+    for (const string &name : listing.dirs) {
+        addFilesRecursively(dir + "/" + name, paths);
+    }
+}
+
+// Add the paths matching the glob 'components' (from 'index' on) below the server directory
+// 'dir' to 'paths'. Components without wildcards are taken as they are, without a listing.
+static void expandGlob(const string &dir, const vector<string> &components, size_t index,
+                       bool wholeDirectory, vector<string> &paths) {
+    if (index == components.size()) {
+        if (wholeDirectory) {
+            addFilesRecursively(dir, paths);
+        } else {
+            paths.push_back(dir);
+        }
+        return;
+    }
+    const string &pattern = components[index];
+    bool last = index + 1 == components.size();
+    if (pattern.find_first_of("*?[") == string::npos) {
+        expandGlob(dir + "/" + pattern, components, index + 1, wholeDirectory, paths);
+        return;
+    }
+
+    DirectoryListing listing = listDirectory(dir);
+    // Only the last component matches files, unless it names whole directories
+    for (const string &name : (last && !wholeDirectory) ? listing.files : listing.dirs) {
+        if (fnmatch(pattern.c_str(), name.c_str(), FNM_PERIOD) == 0) {
+            expandGlob(dir + "/" + name, components, index + 1, wholeDirectory, paths);
+        }
+    }
+}
+
+// The files named by the lines of a warmup manifest
+vector<string> expandManifest(const string &manifest) {
+    vector<string> paths;
+    std::istringstream lines(manifest);
+    string line;
+    while (std::getline(lines, line)) {
+        line.erase(0, line.find_first_not_of(" \t"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        bool wholeDirectory = line.back() == '/';
+        vector<string> components;
+        std::istringstream parts(line);
+        string part;
+        while (std::getline(parts, part, '/')) {
+            if (!part.empty() && part != ".") {
+                components.push_back(part);
+            }
+        }
+        expandGlob("", components, 0, wholeDirectory, paths);
+    }
+    return paths;
+}
+
+// Bring the cached copy of 'path' up to date for a warmup. Returns 1 if it was fetched, 0 if
+// the cached copy was current, or a negated errno.
+int Cache::warmFile(const char *path) {
+    struct stat buffer;
+    bool cached = lstat(getCachedPath(path).c_str(), &buffer) == 0;
+    if (!cached) {
+        mirrorDirectoryStructure(path);
+    }
+    int res = refreshFile(path, cached ? &buffer : NULL);
+    if (res == 1 && lstat(getCachedPath(path).c_str(), &buffer) != 0) {
+        res = -errno;
+    }
+    return res;
+}
 
-    fetchFile(path);
+// Warmup::Fetch of the cache
+int warmCachedFile(const char *path, unsigned long *bytes) {
+    int res = cache->warmFile(path);
+    if (res == 1) {
+        *bytes = getFileSize(path);
+    }
+    return res;
 }
 
-string Cache::createRecoveryPath(int fd) {
-    string tempPath = getCachedPath("", true, fd);
+string Cache::createRecoveryPath(const string &tempPath) {
     string recoveryPath = tempPath + ".recover";
     if (debugMode <= DebugLevel::LevelInfo) {
         printf("%s\t : Recovery Path: %s\n", __func__, recoveryPath.c_str());
@@ -1345,18 +3115,20 @@ void removePath(string path) {
     }
 }
 
-string Cache::getRecoveryCachedPath(int fd) {
-    auto it = tempFdToPathMap.find(fd);
+string Cache::getRecoveryCachedPath(uint64_t fh) {
+    OpenFileShard &shard = shardOf(fh);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.files.find(fh);
     string recovery_path;
-    if (it != tempFdToPathMap.end()) {
-        recovery_path = it->second + ".recover";
+    if (it != shard.files.end() && !it->second.tempPath.empty()) {
+        recovery_path = it->second.tempPath + ".recover";
         if (debugMode <= DebugLevel::LevelInfo) {
             printf("%s \t: Recovery Path: %s\n", __func__, recovery_path.c_str());
         }
     } else {
         if (debugMode <= DebugLevel::LevelError) {
-            printf("%s \t: Requested temp path for fd = %d"
-                    " but it is not in map.\n", __func__, fd);
+            printf("%s \t: Requested temp path for fd = %lu"
+                    " but it is not in map.\n", __func__, fh);
         }
     }
     return recovery_path;
@@ -1389,82 +3161,133 @@ int renameFile(string tempFileName, string originalFile) {
     }
 }
 
+// Recovery files are the dirty copies whose upload was not known to succeed. Of those of one
+// path, the cached copy links to the latest; if none does, the client died before installing
+// the latest, which is then the newest one.
 void Cache::recurseDirectoryTraversal(string path) {
     string recover(".recover");
     string tmp(".temp");
     int crashTextFlag = 0;
+    std::map<string, vector<string>> recoveryFilesOf;
+    vector<string> tempFiles;
     for (auto entry : fs::recursive_directory_iterator(path)) {                          
         string path = entry.path();
         if (debugMode <= DebugLevel::LevelInfo) {
             printf("%s\t : path: %s\n", __func__, path.c_str());         
         }
 
-        // Handling .recover files  
         if (path.find(".recover") != string::npos) {     
-            if (crashTextFlag == 0) {
-                printf("Crash Detected.... \nRebooting Client\n");
-                crashTextFlag = 1;
+            recoveryFilesOf[translatePath(path)].push_back(path);
+        } else if (path.find(".temp") != string::npos) {
+            tempFiles.push_back(path);
+        }
+    }
+
+    // Handling tmp files with no recover files
+    for (const string &path : tempFiles) {
+        if (crashTextFlag == 0) {
+            printf("Crash Detected.... \nRebooting Client\n");
+            crashTextFlag = 1;
+        }
+        printf("System crashed while writing. Discarding File %s\n", path.c_str());
+        removePath(path);
+    }
+
+    // Handling .recover files
+    string cachedRoot = getCachedPath("");
+    for (auto &recovered : recoveryFilesOf) {
+        if (crashTextFlag == 0) {
+            printf("Crash Detected.... \nRebooting Client\n");
+            crashTextFlag = 1;
+        }
+        const string &originalPath = recovered.first;
+        printf("Recovering File %s\n", originalPath.c_str());
+
+        struct stat cached, buf;
+        bool haveCached = lstat(originalPath.c_str(), &cached) == 0;
+        string latest;
+        bool installed = false;
+        struct timespec newest = {0, 0};
+        for (const string &recoveryPath : recovered.second) {
+            if (lstat(recoveryPath.c_str(), &buf) != 0) {
+                continue;
             }
-            string recoveryPath = path;                           
-            string originalPath = translatePath(recoveryPath);
-            printf("Recovering File %s\n", originalPath.c_str());
-            renameFile(recoveryPath, originalPath);
-
-            // Need to put check to send file to server after checking modification time
-            std::size_t lastPos = originalPath.find_last_of("/");
-            string originalFile = originalPath.substr(lastPos, originalFile.length() - lastPos + 1);
-            int res = options.afsclient->rpc_putFile(cache->getCachedPath("").c_str(), originalFile.c_str());
-            if ((res < 0) && (debugMode <= DebugLevel::LevelError)) {
-                printf("%s \t: File failed to send to server.\n", __func__);
+            if (haveCached && buf.st_dev == cached.st_dev && buf.st_ino == cached.st_ino) {
+                latest = recoveryPath;
+                installed = true;
+                break;
             }
-            
-            printf("Sending file :%s to Server\n", originalFile.c_str());
-            if (debugMode <= DebugLevel::LevelInfo) {
-                printf("%s : \t File sent to server\n", __func__);
+            if (latest.empty() || buf.st_mtim.tv_sec > newest.tv_sec ||
+                (buf.st_mtim.tv_sec == newest.tv_sec && buf.st_mtim.tv_nsec > newest.tv_nsec)) {
+                latest = recoveryPath;
+                newest = buf.st_mtim;
             }
-            printf("File sent successfully\n");
-        } 
-        // Handling tmp files with no recover files
-        else if (path.find(".temp") != string::npos) {
-            if (crashTextFlag == 0) {
-                printf("Crash Detected.... \nRebooting Client\n");
-                crashTextFlag = 1;
+        }
+        for (const string &recoveryPath : recovered.second) {
+            if (recoveryPath != latest) {
+                unlink(recoveryPath.c_str());
             }
-            printf("System crashed while writing. Discarding File %s\n", path.c_str());
-            removePath(path);
-        }                      
+        }
+        if (latest.empty()) {
+            continue;
+        }
+
+        string clientPath = originalPath.substr(cachedRoot.length());
+        if (installed) {
+            recoveryFiles.keep(clientPath.c_str(), latest);
+        } else {
+            recoveryFiles.install(clientPath.c_str(), originalPath, latest);
+        }
+
+        // Need to put check to send file to server after checking modification time
+        printf("Sending file :%s to Server\n", clientPath.c_str());
+        if (putCachedFile(clientPath.c_str())) {
+            printf("File sent successfully\n");
+        } else {
+            printf("File failed to send, it is sent again at the next start\n");
+        }
     }
 }
 
 int cp(const char *to, const char *from) {
     int fd_to, fd_from;
     char buf[131072];
-    ssize_t nread;
+    ssize_t nread = 0;
     int saved_errno;
+    struct stat st;
 
     fd_from = open(from, O_RDONLY);
     if (fd_from < 0) return -1;
 
     fd_to = open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
     if (fd_to < 0) goto out_error;
-
-    while (nread = read(fd_from, buf, sizeof buf), nread > 0) {
-        char *out_ptr = buf;
-        ssize_t nwritten;
-
-        do {
-            nwritten = write(fd_to, out_ptr, nread);
-
-            if (nwritten >= 0) {
-                nread -= nwritten;
-                out_ptr += nwritten;
-            } else if (errno != EINTR) {
-                goto out_error;
-            }
-        } while (nread > 0);
+    if (fstat(fd_from, &st) < 0) goto out_error;
+
+    // Only the data extents are copied: the holes of a sparse file stay holes in the copy
+    for (const FileExtent &extent : ListDataExtents(fd_from, st.st_size)) {
+        off_t offset = extent.offset;
+        const off_t end = extent.offset + extent.length;
+        while (offset < end &&
+               (nread = pread(fd_from, buf, std::min<off_t>(sizeof buf, end - offset), offset)) > 0) {
+            char *out_ptr = buf;
+            ssize_t nwritten;
+
+            do {
+                nwritten = pwrite(fd_to, out_ptr, nread, offset);
+
+                if (nwritten >= 0) {
+                    nread -= nwritten;
+                    out_ptr += nwritten;
+                    offset += nwritten;
+                } else if (errno != EINTR) {
+                    goto out_error;
+                }
+            } while (nread > 0);
+        }
+        if (nread < 0) goto out_error;
     }
 
-    if (nread == 0) {
+    if (ftruncate(fd_to, st.st_size) == 0) {
         if (close(fd_to) < 0) {
             fd_to = -1;
             goto out_error;
@@ -1,6 +1,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <grpc++/grpc++.h>
+#include <grpc++/generic/async_generic_service.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -15,16 +16,25 @@
 #include <signal.h>
 
 #include "afsfuse.grpc.pb.h"
+#include "arena_allocator.h"
+#include "change_log.h"
+#include "delegation_table.h"
 #include "file_reader_into_stream.h"
+#include "messages.h"
+#include "path_resolver.h"
+#include "sequential_file_reader.h"
 #include "sequential_file_writer.h"
+#include "utils.h"
 
-#define READ_MAX 10000000
+#define READ_MAX ((4 << 20) - 4096)  // Largest range one read returns: a reply fits in gRPC's 4 MB message limit
 
+using grpc::CallbackServerContext;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::ServerReader;
 using grpc::ServerReaderWriter;
+using grpc::ServerUnaryReactor;
 using grpc::ServerWriter;
 using grpc::Status;
 using grpc::StatusCode;
@@ -54,6 +64,12 @@ string getCurrentWorkingDir() {
 }
 
 string rootDir;
+// Resolves client paths relative to descriptors of the directories below rootDir
+std::unique_ptr<PathResolver> resolver;
+// Paths changed by clients, for incremental resync (afsfuse_changesSince)
+std::unique_ptr<ChangeLog> changeLog;
+// Write delegations held by clients, recalled before other clients access their files
+std::unique_ptr<DelegationTable> delegations;
 int crashSite;
 
 struct sdata {
@@ -61,58 +77,373 @@ struct sdata {
     char b[10] = {};
 };
 
-void translatePath(const char* client_path, char* server_path) {
-    string path;
-    if (client_path[0] == '/')
-        path = rootDir + client_path;
-    else
-        path = rootDir + "/" + client_path;
-    strcat(server_path, path.c_str());
-    // strcat(server_path, "./server");
-    // strcat(server_path + 8, client_path);
-    // printf("%s : Client path = %s, server path = %s\n", __func__,
-    // client_path,
-    //        server_path);
-    // server_path[strlen(server_path)] = '\0';
+// Incoming files are written to a temp file next to their final location and renamed
+// once complete. Names of client side temp/recovery copies carry a ".temp" suffix which
+// is dropped from the final path. Both names are relative to rootDir; missing parent
+// directories of the final path are created while resolving it.
+int resolvePutFilePaths(string name, string& temp_name, string& final_name,
+                        ResolvedPath& temp_path, ResolvedPath& final_path) {
+    if (name.empty() == false && name.at(0) == '/') {
+        name = name.substr(1);
+    }
+    if (name.find(".temp", 0) != string::npos) {
+        string::size_type loc = name.find(".temp", 0);
+        name = name.substr(0, loc);                        
+    }
+    final_name = name;
+    temp_name = name + ".tmp" + unique_suffix();
+
+    if (resolver->Resolve(final_name, final_path, true) == -1) {
+        printf("%s : %s path Creation Failed\n", __func__, final_name.c_str());
+        return -1;
+    }
+    return resolver->Resolve(temp_name, temp_path);
+}
+
+void fillStat(const struct stat& st, Stat* reply) {
+    reply->set_ino(st.st_ino);
+    reply->set_mode(st.st_mode);
+    reply->set_nlink(st.st_nlink);
+    reply->set_uid(st.st_uid);
+    reply->set_gid(st.st_gid);
+
+    reply->set_size(st.st_size);
+    reply->set_blksize(st.st_blksize);
+    reply->set_blocks(st.st_blocks);
+    reply->set_atime(st.st_atime);
+    reply->set_atimtvsec(st.st_atim.tv_sec);
+    reply->set_atimtvnsec(st.st_atim.tv_nsec);
+    reply->set_mtime(st.st_mtime);
+    reply->set_mtimtvsec(st.st_mtim.tv_sec);
+    reply->set_mtimtvnsec(st.st_mtim.tv_nsec);
+    reply->set_ctime(st.st_ctime);
+
+    reply->set_err(0);
+}
+
+// The id a client sends with its calls, empty for clients that do not
+string clientId(const grpc::ServerContextBase* context) {
+    const auto& metadata = context->client_metadata();
+    auto it = metadata.find(kClientIdKey);
+    return it == metadata.end() ? string() : string(it->second.data(), it->second.size());
+}
+
+// Is 'name' the temp file of an upload in progress (see resolvePutFilePaths())?
+bool isPutTempFile(const string& name) {
+    size_t pos = name.rfind(".tmp");
+    if (pos == string::npos || pos + 4 == name.size()) {
+        return false;
+    }
+    return name.find_first_not_of("0123456789.", pos + 4) == string::npos;
 }
 
-class AfsServiceImpl final : public AFS::Service {
-    Status afsfuse_getattr(ServerContext* context, const String* s,
-                           Stat* reply) override {
+// Packs the files of a bulk fetch into BulkFetchReply messages and streams them. A message is
+// sent once it holds about kBulkMessageSize bytes of content; larger files are skipped, so no
+// message gets near gRPC's default 4 MB receive limit. The reply is reused for every message.
+class BulkFetchWriter {
+   public:
+    static const size_t kBulkMessageSize = 1UL << 20;
+
+    BulkFetchWriter(ServerWriter<BulkFetchReply>* writer, BulkFetchReply* reply,
+                    size_t max_file_size)
+        : writer(writer), reply(reply), bytes(0), max_file_size(kBulkMessageSize) {
+        if (max_file_size != 0 && max_file_size < kBulkMessageSize) {
+            this->max_file_size = max_file_size;
+        }
+    }
+
+    // Add the file 'name' in 'dirfd', known to the client as 'path'. Files that are not regular
+    // or too large are skipped. Returns false once the client has gone away.
+    bool addFile(int dirfd, const char* name, const string& path) {
+        int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            return addError(path, errno);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (size_t)st.st_size > max_file_size) {
+            close(fd);
+            return true;
+        }
+
+        BulkFile* file = reply->add_files();
+        file->set_path(path);
+        string* content = file->mutable_content();
+        content->resize(st.st_size);
+        if (pread(fd, &(*content)[0], st.st_size, 0) == st.st_size) {
+            fillStat(st, file->mutable_stat());
+            file->set_err(0);
+        } else {
+            content->clear();
+            file->set_err(EIO);
+        }
+        close(fd);
+
+        bytes += st.st_size;
+        return bytes < kBulkMessageSize || flush();
+    }
+
+    bool addError(const string& path, int err) {
+        BulkFile* file = reply->add_files();
+        file->set_path(path);
+        file->set_err(err);
+        return true;
+    }
+
+    // Add the regular files of the directory open on 'fd' (taking ownership of it), known to the
+    // client as 'path', and those of its subdirectories if 'recursive' is set.
+    bool addDirectory(int fd, const string& path, bool recursive) {
+        DIR* dp = fdopendir(fd);
+        if (dp == NULL) {
+            close(fd);
+            return addError(path, errno);
+        }
+        bool ok = true;
+        struct dirent* de;
+        while (ok && (de = readdir(dp)) != NULL) {
+            string name = de->d_name;
+            if (name == "." || name == ".." || isPutTempFile(name)) {
+                continue;
+            }
+            string child = path + "/" + name;
+            if (de->d_type == DT_DIR) {
+                if (recursive) {
+                    int sub = openat(dirfd(dp), de->d_name,
+                                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                    if (sub != -1) {
+                        ok = addDirectory(sub, child, true);
+                    }
+                }
+            } else if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
+                ok = addFile(dirfd(dp), de->d_name, child);
+            }
+        }
+        closedir(dp);
+        return ok;
+    }
+
+    // Send what is left. Returns false if the client has gone away.
+    bool flush() {
+        bool ok = reply->files_size() == 0 || writer->Write(*reply);
+        reply->Clear();
+        bytes = 0;
+        return ok;
+    }
+
+   private:
+    ServerWriter<BulkFetchReply>* writer;
+    BulkFetchReply* reply;
+    size_t bytes;
+    size_t max_file_size;
+};
+
+// The unary handlers run on the callback API so that their request and reply can live on
+// per-call arenas handed out by an ArenaMessageAllocator. The streaming handlers stay
+// synchronous and keep the messages they build on a CallArena, reused across iterations.
+typedef AFS::WithCallbackMethod_afsfuse_delegate<
+        AFS::WithCallbackMethod_afsfuse_changesSince<
+        AFS::WithCallbackMethod_afsfuse_getattrBatch<
+        AFS::WithCallbackMethod_afsfuse_lookup<
+        AFS::WithCallbackMethod_afsfuse_putSmall<
+        AFS::WithCallbackMethod_afsfuse_compound<
+        AFS::WithCallbackMethod_afsfuse_getattr<
+        AFS::WithCallbackMethod_afsfuse_open<
+        AFS::WithCallbackMethod_afsfuse_read<
+        AFS::WithCallbackMethod_afsfuse_write<
+        AFS::WithCallbackMethod_afsfuse_create<
+        AFS::WithCallbackMethod_afsfuse_mkdir<
+        AFS::WithCallbackMethod_afsfuse_rmdir<
+        AFS::WithCallbackMethod_afsfuse_unlink<
+        AFS::WithCallbackMethod_afsfuse_rename<
+        AFS::WithCallbackMethod_afsfuse_utimens<
+        AFS::WithCallbackMethod_afsfuse_mknod<
+        AFS::Service> > > > > > > > > > > > > > > > > AfsServiceBase;
+
+class AfsServiceImpl final : public AfsServiceBase {
+   public:
+    AfsServiceImpl() {
+        SetMessageAllocatorFor_afsfuse_getattr(GetArenaMessageAllocator<String, Stat>());
+        SetMessageAllocatorFor_afsfuse_open(GetArenaMessageAllocator<FuseFileInfo, FuseFileInfo>());
+        SetMessageAllocatorFor_afsfuse_read(GetArenaMessageAllocator<ReadRequest, ReadResult>());
+        SetMessageAllocatorFor_afsfuse_write(GetArenaMessageAllocator<WriteRequest, WriteResult>());
+        SetMessageAllocatorFor_afsfuse_create(GetArenaMessageAllocator<CreateRequest, CreateResult>());
+        SetMessageAllocatorFor_afsfuse_mkdir(GetArenaMessageAllocator<MkdirRequest, OutputInfo>());
+        SetMessageAllocatorFor_afsfuse_rmdir(GetArenaMessageAllocator<String, OutputInfo>());
+        SetMessageAllocatorFor_afsfuse_unlink(GetArenaMessageAllocator<String, OutputInfo>());
+        SetMessageAllocatorFor_afsfuse_rename(GetArenaMessageAllocator<RenameRequest, OutputInfo>());
+        SetMessageAllocatorFor_afsfuse_utimens(GetArenaMessageAllocator<UtimensRequest, OutputInfo>());
+        SetMessageAllocatorFor_afsfuse_mknod(GetArenaMessageAllocator<MknodRequest, OutputInfo>());
+        SetMessageAllocatorFor_afsfuse_compound(GetArenaMessageAllocator<CompoundRequest, CompoundReply>());
+        SetMessageAllocatorFor_afsfuse_lookup(GetArenaMessageAllocator<LookupRequest, LookupReply>());
+        SetMessageAllocatorFor_afsfuse_putSmall(GetArenaMessageAllocator<SmallFile, Stat>());
+        SetMessageAllocatorFor_afsfuse_getattrBatch(GetArenaMessageAllocator<Paths, Stats>());
+        SetMessageAllocatorFor_afsfuse_changesSince(GetArenaMessageAllocator<ChangesRequest, ChangesReply>());
+        SetMessageAllocatorFor_afsfuse_delegate(GetArenaMessageAllocator<DelegateRequest, DelegateReply>());
+    }
+
+   private:
+    ServerUnaryReactor* finish(CallbackServerContext* context, const Status& status) {
+        ServerUnaryReactor* reactor = context->DefaultReactor();
+        reactor->Finish(status);
+        return reactor;
+    }
+
+    // Before serving a client, recall the delegations other clients hold on the paths it uses
+    void recallFor(const grpc::ServerContextBase* context, const string& path) {
+        delegations->Recall(clientId(context), path);
+    }
+
+    // Same for the callback handlers, which do not wait for the recall: the holders upload
+    // through the same threads. 'serve' runs once the delegations are returned or revoked.
+    ServerUnaryReactor* serveAfterRecall(CallbackServerContext* context,
+                                         const vector<string>& paths,
+                                         std::function<void()> serve) {
+        ServerUnaryReactor* reactor = context->DefaultReactor();
+        delegations->Recall(clientId(context), paths, [reactor, serve]() {
+            serve();
+            reactor->Finish(Status::OK);
+        });
+        return reactor;
+    }
+
+    void pathsOf(const CompoundOp& op, vector<string>& paths) {
+        switch (op.op_case()) {
+            case CompoundOp::kGetattr: paths.push_back(op.getattr().str()); break;
+            case CompoundOp::kCreate: paths.push_back(op.create().path()); break;
+            case CompoundOp::kOpen: paths.push_back(op.open().path()); break;
+            case CompoundOp::kUnlink: paths.push_back(op.unlink().str()); break;
+            case CompoundOp::kRename:
+                paths.push_back(op.rename().fp());
+                paths.push_back(op.rename().tp());
+                break;
+            case CompoundOp::kUtimens: paths.push_back(op.utimens().path()); break;
+            case CompoundOp::kRead: paths.push_back(op.read().path()); break;
+            case CompoundOp::kWrite: paths.push_back(op.write().path()); break;
+            case CompoundOp::kNverify: paths.push_back(op.nverify().path()); break;
+            case CompoundOp::kLookup: paths.push_back(op.lookup().path()); break;
+            case CompoundOp::kPut: paths.push_back(op.put().path()); break;
+            default: break;
+        }
+    }
+
+    void doGetattr(const String* s, Stat* reply) {
         // cout<<"[DEBUG] : lstat: "<<s->str().c_str()<<endl;
         // printf("%s \n", __func__);
         if (crashSite == 1) {
             raise(SIGSEGV);
         }      	
+        statPath(s->str(), reply);
+    }
+
+    void statPath(const string& path, Stat* reply) {
         struct stat st;
-        char server_path[512] = {0};
-        translatePath(s->str().c_str(), server_path);
-        int res = lstat(server_path, &st);
+        ResolvedPath server_path;
+        int res = resolver->Resolve(path, server_path);
+        if (res == 0) {
+            res = fstatat(server_path.DirFd(), server_path.Name(), &st, AT_SYMLINK_NOFOLLOW);
+        }
         if (res == -1) {
             // printf("%s \n", __func__);perror(strerror(errno));
             // cout<<"errno: "<<errno<<endl;
             reply->set_err(errno);
         } else {
-            reply->set_ino(st.st_ino);
-            reply->set_mode(st.st_mode);
-            reply->set_nlink(st.st_nlink);
-            reply->set_uid(st.st_uid);
-            reply->set_gid(st.st_gid);
-
-            reply->set_size(st.st_size);
-            reply->set_blksize(st.st_blksize);
-            reply->set_blocks(st.st_blocks);
-            reply->set_atime(st.st_atime);
-            reply->set_atimtvsec(st.st_atim.tv_sec);
-            reply->set_atimtvnsec(st.st_atim.tv_nsec);
-            reply->set_mtime(st.st_mtime);
-            reply->set_mtimtvsec(st.st_mtim.tv_sec);
-            reply->set_mtimtvnsec(st.st_mtim.tv_nsec);
-            reply->set_ctime(st.st_ctime);
+            fillStat(st, reply);
+        }
+    }
 
-            reply->set_err(0);
+    ServerUnaryReactor* afsfuse_getattr(CallbackServerContext* context, const String* s,
+                                        Stat* reply) override {
+        return serveAfterRecall(context, {s->str()}, [=]() { doGetattr(s, reply); });
+    }
+
+    ServerUnaryReactor* afsfuse_getattrBatch(CallbackServerContext* context, const Paths* input,
+                                             Stats* reply) override {
+        if (crashSite == 1) {
+            raise(SIGSEGV);
+        }
+        vector<string> paths(input->paths().begin(), input->paths().end());
+        return serveAfterRecall(context, paths, [=]() {
+            for (const string& path : input->paths()) {
+                statPath(path, reply->add_stats());
+            }
+        });
+    }
+
+    ServerUnaryReactor* afsfuse_changesSince(CallbackServerContext* context,
+                                             const ChangesRequest* request,
+                                             ChangesReply* reply) override {
+        const size_t kMaxChanges = 4096;
+        size_t max_changes = request->max_changes();
+        if (max_changes == 0 || max_changes > kMaxChanges) {
+            max_changes = kMaxChanges;
+        }
+
+        vector<string> paths;
+        uint64_t next;
+        bool more;
+        bool complete = changeLog->Since(request->log_id(), request->cursor(), max_changes,
+                                         paths, next, more);
+        reply->set_log_id(changeLog->Id());
+        reply->set_cursor(next);
+        reply->set_reset(!complete);
+        reply->set_more(more);
+        // The attributes of the moment: a path changed several times is reported as it is now
+        for (const string& path : paths) {
+            Change* change = reply->add_changes();
+            change->set_path(path);
+            statPath(path, change->mutable_stat());
+        }
+        return finish(context, Status::OK);
+    }
+
+    ServerUnaryReactor* afsfuse_delegate(CallbackServerContext* context,
+                                         const DelegateRequest* request,
+                                         DelegateReply* reply) override {
+        const string client = clientId(context);
+        bool renewed = false;
+        bool granted = !client.empty() && delegations->Grant(client, request->path(), renewed);
+        if (granted && !renewed) {
+            // Other clients trusting their cached copy (see afsfuse_changesSince) revalidate it
+            // from now on, which recalls the delegation
+            changeLog->Append(request->path());
         }
+        reply->set_granted(granted);
+        reply->set_lease_ms(delegations->LeaseMs());
+        return finish(context, Status::OK);
+    }
 
+    // Synchronous, so returns are served by other threads than the handlers waiting for them in
+    // recallFor(). The callback handlers waiting in serveAfterRecall() are resumed from here.
+    Status afsfuse_returnDelegation(ServerContext* context, const DelegateRequest* request,
+                                    OutputInfo* reply) override {
+        delegations->Return(clientId(context), request->path());
+        reply->set_err(0);
+        return Status::OK;
+    }
+
+    Status afsfuse_recalls(ServerContext* context, const String* request,
+                           ServerWriter<Recall>* writer) override {
+        const string client = clientId(context);
+        if (client.empty()) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Recall streams need a client id");
+        }
+        delegations->Connect(client);
+        CallArena arena;
+        Recall& recall = *arena.Create<Recall>();
+        bool ok = writer->Write(recall);  // Registered
+        vector<string> paths;
+        while (ok && !context->IsCancelled()) {
+            if (!delegations->WaitRecalls(client, paths, 1000)) {
+                continue;
+            }
+            for (const string& path : paths) {
+                recall.set_path(path);
+                if (!(ok = writer->Write(recall))) {
+                    break;
+                }
+            }
+        }
+        // Drops the delegations of the client, unless it has another stream open
+        delegations->Disconnect(client);
         return Status::OK;
     }
 
@@ -122,11 +453,20 @@ class AfsServiceImpl final : public AFS::Service {
         // printf("%s \n", __func__);
         DIR* dp;
         struct dirent* de;
-        Dirent directory;
-        char server_path[512] = {0};
-        translatePath(s->str().c_str(), server_path);
-
-        dp = opendir(server_path);
+        CallArena arena;
+        Dirent& directory = *arena.Create<Dirent>();
+        ResolvedPath server_path;
+        dp = NULL;
+        if (resolver->Resolve(s->str(), server_path) == 0) {
+            int fd = openat(server_path.DirFd(), server_path.Name(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd != -1) {
+                dp = fdopendir(fd);
+                if (dp == NULL) {
+                    close(fd);
+                }
+            }
+        }
         if (dp == NULL) {
             // cout<<"[DEBUG] : readdir: "<<"dp == NULL"<<endl;
             printf("%s \n", __func__);
@@ -148,16 +488,15 @@ class AfsServiceImpl final : public AFS::Service {
         return Status::OK;
     }
 
-    Status afsfuse_open(ServerContext* context, const FuseFileInfo* fi_req,
-                        FuseFileInfo* fi_reply) override {
+    void doOpen(const FuseFileInfo* fi_req, FuseFileInfo* fi_reply) {
         printf("%s : %s\n", __func__, fi_req->path().c_str());
-        char server_path[512] = {0};
-
-        translatePath(fi_req->path().c_str(), server_path);
-        // cout<<"[DEBUG] : afsfuse_open: path "<<server_path<<endl;
+        ResolvedPath server_path;
+        int fh = resolver->Resolve(fi_req->path(), server_path);
         // cout<<"[DEBUG] : afsfuse_open: flag "<<fi_req->flags()<<endl;
 
-        int fh = open(server_path, fi_req->flags());
+        if (fh == 0) {
+            fh = openat(server_path.DirFd(), server_path.Name(), fi_req->flags() | O_NOFOLLOW);
+        }
 
         // cout<<"[DEBUG] : afsfuse_open: fh"<<fh<<endl;
         if (fh == -1) {
@@ -167,196 +506,221 @@ class AfsServiceImpl final : public AFS::Service {
             fi_reply->set_err(0);
             close(fh);
         }
+    }
 
-        return Status::OK;
+    ServerUnaryReactor* afsfuse_open(CallbackServerContext* context, const FuseFileInfo* fi_req,
+                                     FuseFileInfo* fi_reply) override {
+        return serveAfterRecall(context, {fi_req->path()}, [=]() { doOpen(fi_req, fi_reply); });
     }
 
-    Status afsfuse_read(ServerContext* context, const ReadRequest* rr,
-                        ReadResult* reply) override {
+    void doRead(const ReadRequest* rr, ReadResult* reply) {
         // printf("%s \n", __func__);
-        char path[512];
-        char* buf = new char[rr->size()];
-        translatePath(rr->path().c_str(), path);
-        // cout<<"[DEBUG] : afsfuse_read: "<<path<<endl;
+        ResolvedPath path;
 
-        int fd = open(path, O_RDONLY);
+        int fd = resolver->Resolve(rr->path(), path);
+        if (fd == 0) {
+            fd = openat(path.DirFd(), path.Name(), O_RDONLY | O_NOFOLLOW);
+        }
         // cout<<"[DEBUG] : afsfuse_read: fd "<<fd<<endl;
         if (fd == -1) {
             reply->set_err(errno);
             printf("%s \n", __func__);
             perror(strerror(errno));
-            return Status::OK;
+            return;
         }
 
-        int res = pread(fd, buf, rr->size(), rr->offset());
+        // Read straight into the reply, which may hold binary data (COMPOUND reads whole files).
+        // Like pread(), the reply may be shorter than asked: ranges are capped at READ_MAX bytes.
+        string* buf = reply->mutable_buffer();
+        const size_t size = std::min<uint64_t>(rr->size(), READ_MAX);
+        buf->resize(size);
+        ssize_t res = pread(fd, &(*buf)[0], size, rr->offset());
+        close(fd);
         if (res == -1) {
+            buf->clear();
             reply->set_err(errno);
             printf("%s \n", __func__);
             perror(strerror(errno));
-            return Status::OK;
+            return;
         }
 
+        buf->resize(res);
         reply->set_bytesread(res);
-        reply->set_buffer(buf);
         reply->set_err(0);
+    }
 
-        if (fd > 0) close(fd);
-        free(buf);
-
-        return Status::OK;
+    ServerUnaryReactor* afsfuse_read(CallbackServerContext* context, const ReadRequest* rr,
+                                     ReadResult* reply) override {
+        return serveAfterRecall(context, {rr->path()}, [=]() { doRead(rr, reply); });
     }
 
-    Status afsfuse_write(ServerContext* context, const WriteRequest* wr,
-                         WriteResult* reply) override {
+    void doWrite(const WriteRequest* wr, WriteResult* reply) {
         // printf("%s \n", __func__);
-        char path[512] = {0};
-        translatePath(wr->path().c_str(), path);
-        int fd = open(path, O_WRONLY);
-        // cout<<"[DEBUG] : afsfuse_write: path "<<path<<endl;
+        ResolvedPath path;
+        int fd = resolver->Resolve(wr->path(), path);
+        if (fd == 0) {
+            fd = openat(path.DirFd(), path.Name(), O_WRONLY | O_NOFOLLOW);
+        }
         // cout<<"[DEBUG] : afsfuse_write: fd "<<fd<<endl;
         if (fd == -1) {
             reply->set_err(errno);
             printf("%s \n", __func__);
             perror(strerror(errno));
-            return Status::OK;
+            return;
         }
 
-        int res = pwrite(fd, wr->buffer().c_str(), wr->size(), wr->offset());
-        // cout<<"[DEBUG] : afsfuse_write: res"<<res<<endl;
-
-        fsync(fd);
+        // The buffer may hold binary data: all of it is written, NULs included
+        const string& data = wr->buffer();
+        size_t written = 0;
+        ssize_t res = 0;
+        while (written < data.size()) {
+            res = pwrite(fd, data.data() + written, data.size() - written, wr->offset() + written);
+            if (res == -1 && errno == EINTR) {
+                continue;
+            }
+            if (res == -1) {
+                break;
+            }
+            written += res;
+        }
+        // Durable only when the client asks, at its fsync
+        if (res != -1 && wr->sync()) {
+            res = fsync(fd);
+        }
 
         if (res == -1) {
             reply->set_err(errno);
             printf("%s \n", __func__);
             perror(strerror(errno));
-            return Status::OK;
+            close(fd);
+            return;
         }
 
-        reply->set_nbytes(res);
+        reply->set_nbytes(written);
         reply->set_err(0);
+        changeLog->Append(wr->path());
 
         if (fd > 0) close(fd);
-
-        return Status::OK;
     }
 
-    bool doesPathExist(std::string server_path) {
-        std::size_t lastPos = server_path.find_last_of("/");
-        struct stat tempStatBuffer;
-        return stat(server_path.substr(0, lastPos).c_str(), &tempStatBuffer) == 0;
+    ServerUnaryReactor* afsfuse_write(CallbackServerContext* context, const WriteRequest* wr,
+                                      WriteResult* reply) override {
+        return serveAfterRecall(context, {wr->path()}, [=]() { doWrite(wr, reply); });
     }
 
-    bool createPath(std::string server_path) {
-        printf("%s : Path does not exist\n Creating Path", __func__);
-        std::size_t lastPos = server_path.find_last_of("/");
-        std::string toBeCreatedPath = server_path.substr(0, lastPos);
-        string command = "mkdir -p " + toBeCreatedPath;
-        int res = system(command.c_str());		
-        return res == 0;
-    }
-
-    Status afsfuse_create(ServerContext* context, const CreateRequest* req,
-                          CreateResult* reply) override {
-        char server_path[512] = {0};
-        translatePath(req->path().c_str(), server_path);
-
-        if (!doesPathExist(server_path)) {
-            bool pathCreated = createPath(server_path);
-            if (pathCreated) {
-                printf("%s : %s path Creation Success\n", __func__, server_path);
-            } else {
-                printf("%s : %s path Creation Failed\n", __func__, server_path);
-                reply->set_err(errno);
-                return Status::OK;
-            }
-        }	
+    void doCreate(const CreateRequest* req, CreateResult* reply) {
+        // Missing parent directories are created on the way
+        ResolvedPath server_path;
+        if (resolver->Resolve(req->path(), server_path, true) == -1) {
+            printf("%s : %s path Creation Failed\n", __func__, req->path().c_str());
+            reply->set_err(errno);
+            return;
+        }
 
-        // cout<<"[DEBUG] : afsfuse_create: path "<<server_path<<endl;
         // cout<<"[DEBUG] : afsfuse_create: flag "<<req->flags()<<endl;
 
-        int fh = open(server_path, req->flags(), req->mode());
+        int fh = openat(server_path.DirFd(), server_path.Name(), req->flags() | O_NOFOLLOW, req->mode());
 
         // cout<<"[DEBUG] : afsfuse_create: fh"<<fh<<endl;
         if (fh == -1) {
             reply->set_err(errno);
-            return Status::OK;
+            return;
         } else {
             struct timespec ts[2];  // ts[0] - access, ts[1] - mod
             get_time(&ts[0]);
             ts[1].tv_sec = ts[0].tv_sec;
             ts[1].tv_nsec = ts[0].tv_nsec;
-            utimensat(AT_FDCWD, server_path, ts, AT_SYMLINK_NOFOLLOW);
+            futimens(fh, ts);
             reply->set_fh(fh);
             reply->set_err(0);
             close(fh);
-            return Status::OK;
+            changeLog->Append(req->path());
+            return;
         }
     }
 
-    Status afsfuse_mkdir(ServerContext* context, const MkdirRequest* input,
-                         OutputInfo* reply) override {
+    ServerUnaryReactor* afsfuse_create(CallbackServerContext* context, const CreateRequest* req,
+                                       CreateResult* reply) override {
+        return serveAfterRecall(context, {req->path()}, [=]() { doCreate(req, reply); });
+    }
+
+    void doMkdir(const MkdirRequest* input, OutputInfo* reply) {
         // cout<<"[DEBUG] : mkdir: " << endl;
         // printf("%s \n", __func__);
-        char server_path[512] = {0};
-        translatePath(input->s().c_str(), server_path);
-
-        int res = mkdir(server_path, input->mode());
+        ResolvedPath server_path;
+        int res = resolver->Resolve(input->s(), server_path);
+        if (res == 0) {
+            res = mkdirat(server_path.DirFd(), server_path.Name(), input->mode());
+        }
 
         if (res == -1) {
             printf("%s \n", __func__);
             perror(strerror(errno));
             reply->set_err(errno);
-            return Status::OK;
+            return;
         } else {
             reply->set_err(0);
+            changeLog->Append(input->s());
         }
+    }
 
-        return Status::OK;
+    ServerUnaryReactor* afsfuse_mkdir(CallbackServerContext* context, const MkdirRequest* input,
+                                      OutputInfo* reply) override {
+        doMkdir(input, reply);
+        return finish(context, Status::OK);
     }
 
-    Status afsfuse_rmdir(ServerContext* context, const String* input,
-                         OutputInfo* reply) override {
+    void doRmdir(const String* input, OutputInfo* reply) {
         // cout<<"[DEBUG] : rmdir: " << endl;
         // printf("%s \n", __func__);
-        char server_path[512] = {0};
-        translatePath(input->str().c_str(), server_path);
-
-        int res = rmdir(server_path);
+        ResolvedPath server_path;
+        int res = resolver->Resolve(input->str(), server_path);
+        if (res == 0) {
+            res = unlinkat(server_path.DirFd(), server_path.Name(), AT_REMOVEDIR);
+            resolver->Invalidate(input->str());
+        }
 
         if (res == -1) {
             printf("%s \n", __func__);
             perror(strerror(errno));
             reply->set_err(errno);
-            return Status::OK;
+            return;
         } else {
             reply->set_err(0);
+            changeLog->Append(input->str());
         }
+    }
 
-        return Status::OK;
+    ServerUnaryReactor* afsfuse_rmdir(CallbackServerContext* context, const String* input,
+                                      OutputInfo* reply) override {
+        return serveAfterRecall(context, {input->str()}, [=]() { doRmdir(input, reply); });
     }
 
-    Status afsfuse_unlink(ServerContext* context, const String* input,
-                          OutputInfo* reply) override {
+    void doUnlink(const String* input, OutputInfo* reply) {
         // cout<<"[DEBUG] : unlink " << endl;
         // printf("%s \n", __func__);
-        char server_path[512] = {0};
-        translatePath(input->str().c_str(), server_path);
-        // cout << "server path: " << server_path << endl;
-        int res = unlink(server_path);
+        ResolvedPath server_path;
+        int res = resolver->Resolve(input->str(), server_path);
+        if (res == 0) {
+            res = unlinkat(server_path.DirFd(), server_path.Name(), 0);
+        }
         if (res == -1) {
             printf("%s \n", __func__);
             perror(strerror(errno));
             reply->set_err(errno);
-            return Status::OK;
+            return;
         } else {
             reply->set_err(0);
+            changeLog->Append(input->str());
         }
-        return Status::OK;
     }
 
-    Status afsfuse_rename(ServerContext* context, const RenameRequest* input,
-                          OutputInfo* reply) override {
+    ServerUnaryReactor* afsfuse_unlink(CallbackServerContext* context, const String* input,
+                                       OutputInfo* reply) override {
+        return serveAfterRecall(context, {input->str()}, [=]() { doUnlink(input, reply); });
+    }
+
+    void doRename(const RenameRequest* input, OutputInfo* reply) {
         // cout<<"[DEBUG] : rename " << endl;
         // printf("%s \n", __func__);
         if (input->flag()) {
@@ -364,37 +728,44 @@ class AfsServiceImpl final : public AFS::Service {
             perror(strerror(errno));
             reply->set_err(EINVAL);
             reply->set_str("rename fail");
-            return Status::OK;
+            return;
         }
 
-        char from_path[512] = {0};
-        char to_path[512] = {0};
-        translatePath(input->fp().c_str(), from_path);
-        translatePath(input->tp().c_str(), to_path);
-
-        int res = rename(from_path, to_path);
+        ResolvedPath from_path, to_path;
+        int res = resolver->Resolve(input->fp(), from_path);
+        if (res == 0) {
+            res = resolver->Resolve(input->tp(), to_path);
+        }
+        if (res == 0) {
+            res = renameat2(from_path.DirFd(), from_path.Name(),
+                            to_path.DirFd(), to_path.Name(), 0);
+            // Either side may have been a directory, with descriptors cached below it
+            resolver->Invalidate(input->fp());
+            resolver->Invalidate(input->tp());
+        }
         if (res == -1) {
             printf("%s \n", __func__);
             perror(strerror(errno));
             reply->set_err(errno);
-            return Status::OK;
+            return;
         } else {
             reply->set_err(0);
+            changeLog->Append(input->fp());
+            changeLog->Append(input->tp());
         }
+    }
 
-        return Status::OK;
+    ServerUnaryReactor* afsfuse_rename(CallbackServerContext* context, const RenameRequest* input,
+                                       OutputInfo* reply) override {
+        return serveAfterRecall(context, {input->fp(), input->tp()},
+                                [=]() { doRename(input, reply); });
     }
 
-    Status afsfuse_utimens(ServerContext* context, const UtimensRequest* input,
-                           OutputInfo* reply) override {
+    void doUtimens(const UtimensRequest* input, OutputInfo* reply) {
         // cout<<"[DEBUG] : utimens " << endl;
         // printf("%s \n", __func__);
-        char server_path[512] = {0};
-        translatePath(input->path().c_str(), server_path);
-
+        ResolvedPath server_path;
         struct timespec ts[2];
-        long oo;
-        int ii;
 
         ts[0].tv_sec = input->sec();
         ts[0].tv_nsec = input->nsec();
@@ -402,46 +773,308 @@ class AfsServiceImpl final : public AFS::Service {
         ts[1].tv_sec = input->sec2();
         ts[1].tv_nsec = input->nsec2();
 
-        int res = utimensat(AT_FDCWD, server_path, ts, AT_SYMLINK_NOFOLLOW);
+        int res = resolver->Resolve(input->path(), server_path);
+        if (res == 0) {
+            res = utimensat(server_path.DirFd(), server_path.Name(), ts, AT_SYMLINK_NOFOLLOW);
+        }
 
         if (res == -1) {
             printf("%s \n", __func__);
             perror(strerror(errno));
             reply->set_err(errno);
-            return Status::OK;
+            return;
         }
         reply->set_err(0);
-        return Status::OK;
+        changeLog->Append(input->path());
+    }
+
+    ServerUnaryReactor* afsfuse_utimens(CallbackServerContext* context, const UtimensRequest* input,
+                                        OutputInfo* reply) override {
+        return serveAfterRecall(context, {input->path()}, [=]() { doUtimens(input, reply); });
     }
 
-    Status afsfuse_mknod(ServerContext* context, const MknodRequest* input,
-                         OutputInfo* reply) override {
+    void doMknod(const MknodRequest* input, OutputInfo* reply) {
         // cout<<"[DEBUG] : mknod " << endl;
         // printf("%s \n", __func__);
-        char server_path[512] = {0};
-        translatePath(input->path().c_str(), server_path);
-
+        ResolvedPath server_path;
         mode_t mode = input->mode();
         dev_t rdev = input->rdev();
 
-        int res;
+        int res = resolver->Resolve(input->path(), server_path);
 
-        if (S_ISFIFO(mode))
-            res = mkfifo(server_path, mode);
-        else
-            res = mknod(server_path, mode, rdev);
+        if (res == 0) {
+            if (S_ISFIFO(mode))
+                res = mkfifoat(server_path.DirFd(), server_path.Name(), mode);
+            else
+                res = mknodat(server_path.DirFd(), server_path.Name(), mode, rdev);
+        }
 
         if (res == -1) {
             reply->set_err(errno);
-            return Status::OK;
+            return;
         }
 
         reply->set_err(0);
+        changeLog->Append(input->path());
+    }
+
+    ServerUnaryReactor* afsfuse_mknod(CallbackServerContext* context, const MknodRequest* input,
+                                      OutputInfo* reply) override {
+        doMknod(input, reply);
+        return finish(context, Status::OK);
+    }
+
+    void doNverify(const NverifyRequest* input, OutputInfo* reply) {
+        ResolvedPath server_path;
+        struct stat st;
+        int res = resolver->Resolve(input->path(), server_path);
+        if (res == 0) {
+            res = fstatat(server_path.DirFd(), server_path.Name(), &st, AT_SYMLINK_NOFOLLOW);
+        }
+
+        if (res == -1) {
+            // A missing file differs from any attributes the client may have
+            reply->set_err(errno == ENOENT ? 0 : errno);
+        } else if (st.st_mtim.tv_sec == input->mtimtvsec() &&
+                   st.st_mtim.tv_nsec == input->mtimtvnsec()) {
+            reply->set_err(EEXIST);
+        } else {
+            reply->set_err(0);
+        }
+    }
+
+    void doLookup(const LookupRequest* input, LookupReply* reply) {
+        ResolvedPath server_path;
+        struct stat st;
+        int res = resolver->Resolve(input->path(), server_path);
+        if (res == 0) {
+            res = fstatat(server_path.DirFd(), server_path.Name(), &st, AT_SYMLINK_NOFOLLOW);
+        }
+        if (res == -1) {
+            reply->set_err(errno);
+            return;
+        }
+
+        if (S_ISREG(st.st_mode) && (uint64_t)st.st_size <= input->max_inline()) {
+            int fd = openat(server_path.DirFd(), server_path.Name(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            // Take the attributes from the open file, so they describe the content sent
+            if (fd != -1 && fstat(fd, &st) == 0 && (uint64_t)st.st_size <= input->max_inline()) {
+                string* content = reply->mutable_content();
+                content->resize(st.st_size);
+                if (pread(fd, &(*content)[0], st.st_size, 0) == st.st_size) {
+                    reply->set_inlined(true);
+                } else {
+                    content->clear();
+                }
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        fillStat(st, reply->mutable_stat());
+        reply->set_err(0);
+    }
+
+    ServerUnaryReactor* afsfuse_lookup(CallbackServerContext* context, const LookupRequest* input,
+                                       LookupReply* reply) override {
+        return serveAfterRecall(context, {input->path()}, [=]() { doLookup(input, reply); });
+    }
+
+    void doPutSmall(const SmallFile* input, Stat* reply) {
+        string temp_name, final_name;
+        ResolvedPath temp_path, final_path;
+        if (resolvePutFilePaths(input->path(), temp_name, final_name,
+                                temp_path, final_path) == -1) {
+            reply->set_err(errno);
+            return;
+        }
+
+        int fd = openat(temp_path.DirFd(), temp_path.Name(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            reply->set_err(errno);
+            return;
+        }
+
+        const string& content = input->content();
+        struct stat st;
+        int res = 0;
+        if (!content.empty() &&
+            write(fd, content.data(), content.size()) != (ssize_t)content.size()) {
+            res = -1;
+        }
+        if (res == 0 && input->mode() != 0) {
+            res = fchmod(fd, input->mode() & 07777);
+        }
+        if (res == 0) {
+            res = fstat(fd, &st);
+        }
+        close(fd);
+        if (res == 0) {
+            res = renameat2(temp_path.DirFd(), temp_path.Name(),
+                            final_path.DirFd(), final_path.Name(), 0);
+        }
+
+        if (res == -1) {
+            printf("%s \t : Failed to store %s\n", __func__, final_name.c_str());
+            perror(strerror(errno));
+            reply->set_err(errno);
+            unlinkat(temp_path.DirFd(), temp_path.Name(), 0);
+            return;
+        }
+        fillStat(st, reply);
+        changeLog->Append(final_name);
+    }
+
+    ServerUnaryReactor* afsfuse_putSmall(CallbackServerContext* context, const SmallFile* input,
+                                         Stat* reply) override {
+        return serveAfterRecall(context, {input->path()}, [=]() { doPutSmall(input, reply); });
+    }
+
+    ServerUnaryReactor* afsfuse_compound(CallbackServerContext* context,
+                                         const CompoundRequest* request,
+                                         CompoundReply* reply) override {
+        vector<string> paths;
+        for (const CompoundOp& op : request->ops()) {
+            pathsOf(op, paths);
+        }
+        return serveAfterRecall(context, paths, [=]() { doCompound(request, reply); });
+    }
+
+    void doCompound(const CompoundRequest* request, CompoundReply* reply) {
+        for (const CompoundOp& op : request->ops()) {
+            CompoundResult* result = reply->add_results();
+            switch (op.op_case()) {
+                case CompoundOp::kGetattr:
+                    doGetattr(&op.getattr(), result->mutable_stat());
+                    result->set_err(result->stat().err());
+                    break;
+                case CompoundOp::kCreate:
+                    doCreate(&op.create(), result->mutable_create());
+                    result->set_err(result->create().err());
+                    break;
+                case CompoundOp::kOpen:
+                    doOpen(&op.open(), result->mutable_open());
+                    result->set_err(result->open().err());
+                    break;
+                case CompoundOp::kMkdir:
+                    doMkdir(&op.mkdir(), result->mutable_output());
+                    result->set_err(result->output().err());
+                    break;
+                case CompoundOp::kUnlink:
+                    doUnlink(&op.unlink(), result->mutable_output());
+                    result->set_err(result->output().err());
+                    break;
+                case CompoundOp::kRename:
+                    doRename(&op.rename(), result->mutable_output());
+                    result->set_err(result->output().err());
+                    break;
+                case CompoundOp::kUtimens:
+                    doUtimens(&op.utimens(), result->mutable_output());
+                    result->set_err(result->output().err());
+                    break;
+                case CompoundOp::kRead:
+                    doRead(&op.read(), result->mutable_read());
+                    result->set_err(result->read().err());
+                    break;
+                case CompoundOp::kWrite:
+                    doWrite(&op.write(), result->mutable_write());
+                    result->set_err(result->write().err());
+                    break;
+                case CompoundOp::kNverify:
+                    doNverify(&op.nverify(), result->mutable_output());
+                    result->set_err(result->output().err());
+                    break;
+                case CompoundOp::kLookup:
+                    doLookup(&op.lookup(), result->mutable_lookup());
+                    result->set_err(result->lookup().err());
+                    break;
+                case CompoundOp::kPut:
+                    doPutSmall(&op.put(), result->mutable_stat());
+                    result->set_err(result->stat().err());
+                    break;
+                default:
+                    result->set_err(EINVAL);
+                    break;
+            }
+            if (result->err() != 0) {
+                break;
+            }
+        }
+    }
+
+    Status afsfuse_putBatch(ServerContext* context, ServerReader<BatchPutRequest>* reader,
+                            BatchPutReply* reply) override {
+        CallArena arena;
+        BatchPutRequest& request = *arena.Create<BatchPutRequest>();
+        OutputInfo& verified = *arena.Create<OutputInfo>();
+        while (reader->Read(&request)) {
+            for (const BatchFile& file : request.files()) {
+                recallFor(context, file.file().path());
+                Stat* stat = reply->add_stats();
+                if (file.has_nverify()) {
+                    doNverify(&file.nverify(), &verified);
+                    if (verified.err() != 0) {
+                        stat->set_err(verified.err());
+                        continue;
+                    }
+                }
+                doPutSmall(&file.file(), stat);
+            }
+        }
+        return Status::OK;
+    }
+
+    Status afsfuse_bulkFetch(ServerContext* context, const BulkFetchRequest* request,
+                             ServerWriter<BulkFetchReply>* writer) override {
+        CallArena arena;
+        BulkFetchWriter bulk(writer, arena.Create<BulkFetchReply>(), request->max_file_size());
+        bool ok = true;
+        if (!request->dir().empty()) {
+            recallFor(context, request->dir());
+        }
+        for (const string& path : request->paths()) {
+            recallFor(context, path);
+        }
+
+        if (!request->dir().empty()) {
+            // Client paths of the entries are built on the directory path without trailing '/'
+            string dir = request->dir();
+            while (!dir.empty() && dir.back() == '/') {
+                dir.pop_back();
+            }
+            ResolvedPath server_path;
+            int fd = resolver->Resolve(request->dir(), server_path);
+            if (fd == 0) {
+                fd = openat(server_path.DirFd(), server_path.Name(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            }
+            ok = fd == -1 ? bulk.addError(request->dir(), errno)
+                          : bulk.addDirectory(fd, dir, request->recursive());
+        }
+
+        for (const string& path : request->paths()) {
+            if (!ok) {
+                break;
+            }
+            ResolvedPath server_path;
+            if (resolver->Resolve(path, server_path) == -1) {
+                ok = bulk.addError(path, errno);
+            } else {
+                ok = bulk.addFile(server_path.DirFd(), server_path.Name(), path);
+            }
+        }
+
+        if (ok) {
+            bulk.flush();
+        }
         return Status::OK;
     }
 
     Status afsfuse_getFile(ServerContext* context, const File* file,
                            ServerWriter<FileContent>* writer) override {
+        recallFor(context, file->path());
         struct stat buffer;
         string filepath = rootDir.c_str() + file->path();
         //std::cout << __func__ << " : " << filepath.c_str() << endl;
@@ -449,13 +1082,17 @@ class AfsServiceImpl final : public AFS::Service {
         //    printf("%s: File exists\n", __func__);
         //}
         try {
+            ResolvedPath server_path;
+            if (resolver->Resolve(file->path(), server_path) == -1) {
+                raise_from_errno("Failed to resolve the path.");
+            }
             FileReaderIntoStream<ServerWriter<FileContent> > reader(
-                rootDir, file->path(), *writer);
+                server_path.DirFd(), server_path.Name(), file->path(), *writer);
             
             const size_t chunk_size =
                 1UL << 20;  // Hardcoded to 1MB, which seems to be recommended
                             // from experience.
-            reader.Read(chunk_size);
+            reader.Read(chunk_size, file->sparse());
             //std::cout << "Sending chunk of size 1 MB from server to client"
             //          << std::endl;
         } catch (const std::exception& ex) {
@@ -473,41 +1110,33 @@ class AfsServiceImpl final : public AFS::Service {
                            ServerReader<FileContent>* reader,
                            OutputInfo* reply) override {
         // printf("%s : Begin\n", __func__);  
-        string final_path, temp_path;
-        FileContent contentPart;
+        string final_name, temp_name;
+        ResolvedPath final_path, temp_path;
+        CallArena arena;
+        FileContent& contentPart = *arena.Create<FileContent>();
         SequentialFileWriter writer;
+        int64_t sparseSize = -1;  // Size of the file, if it arrives sparse
         struct timespec ts_start, ts_end;
         get_time(&ts_start);
         while (reader->Read(&contentPart)) {
             try {
-                if (temp_path.empty()) {
-                    string name = contentPart.name();
-                    if (name.empty() == false && name.at(0) == '/') {
-                        name = name.substr(1);
-                    }
-
-                    temp_path = (rootDir + "/" + name + ".tmp" + std::to_string(rand() % 1000));
-                    if (name.find(".temp", 0) != string::npos) {
-                        string::size_type loc = name.find(".temp", 0);
-                        name = name.substr(0, loc);                        
-                    }
-                    final_path = (rootDir + "/" + name);
-                }
-
-                if (!doesPathExist(final_path)) {
-                    bool pathCreated = createPath(final_path);
-                    if (pathCreated) {
-                        printf("%s : %s path Creation Success\n", __func__, final_path.c_str());
-                    } else {
-                        printf("%s : %s path Creation Failed\n", __func__, final_path.c_str());
+                if (temp_name.empty()) {
+                    if (resolvePutFilePaths(contentPart.name(), temp_name, final_name,
+                                            temp_path, final_path) == -1) {
                         reply->set_err(errno);
                         return Status::OK;
                     }
+                    recallFor(context, final_name);
                 }
-                writer.OpenIfNecessary(temp_path);
+                writer.OpenIfNecessary(temp_path.DirFd(), temp_path.Name());
                 auto* const data = contentPart.mutable_content();
                 // std::cout << "Received data at server " << std::endl;
-                writer.Write(*data);
+                if (contentPart.sparse()) {
+                    writer.WriteAt(*data, contentPart.offset());
+                    sparseSize = contentPart.file_size();
+                } else {
+                    writer.Write(*data);
+                }
                 reply->set_err(0);
             } catch (const std::system_error& ex) {
                 printf("%s : ERROR getting file on server!!\n", __func__);
@@ -517,17 +1146,26 @@ class AfsServiceImpl final : public AFS::Service {
                 return Status(status_code, ex.what());
             }
         }
+        if (sparseSize >= 0) {
+            try {
+                writer.SetSize(sparseSize);
+            } catch (const std::system_error& ex) {
+                return Status(StatusCode::ABORTED, ex.what());
+            }
+        }
 
-        int res = rename(temp_path.c_str(), final_path.c_str());
+        int res = renameat2(temp_path.DirFd(), temp_path.Name(),
+                            final_path.DirFd(), final_path.Name(), 0);
 
         if (res == -1) {
             printf("%s \t : Renaming failed! From = %s to %s\n", 
-                __func__, temp_path.c_str(), final_path.c_str());
+                __func__, temp_name.c_str(), final_name.c_str());
             perror(strerror(errno));
             reply->set_err(errno);
         }
         else {
             reply->set_err(0);
+            changeLog->Append(final_name);
         }
 
         get_time(&ts_end);
@@ -538,6 +1176,208 @@ class AfsServiceImpl final : public AFS::Service {
     }
 };
 
+// Zero-copy file transfer. The raw getFile/putFile methods (see messages.h) move file
+// data as plain ByteBuffers instead of FileContent messages, so the data is never
+// serialized or parsed: outgoing chunks are slices pointing straight into the mmap()ed
+// file and incoming chunks are written to disk slice by slice with writev().
+class RawGetFileReactor final : public grpc::ServerGenericBidiReactor {
+   public:
+    explicit RawGetFileReactor(const string& client) : client(client) {
+        StartRead(&request);
+    }
+
+    void OnReadDone(bool ok) override {
+        File file;
+        if (!ok || !ParseRawMessage(request, &file)) {
+            Finish(Status(StatusCode::INVALID_ARGUMENT, "Expected a file request"));
+            return;
+        }
+
+        filepath = rootDir + file.path();
+        // Sent once the delegations of the file are recalled, without waiting on this thread
+        delegations->Recall(client, {file.path()}, [this, file]() { startSending(file); });
+    }
+
+    void OnWriteDone(bool ok) override {
+        if (!ok) {
+            Finish(Status(StatusCode::ABORTED, "Client went away while sending " + filepath));
+            return;
+        }
+        sendNextChunk();
+    }
+
+    void OnDone() override { delete this; }
+
+   private:
+    void startSending(const File& file) {
+        try {
+            ResolvedPath path;
+            if (resolver->Resolve(file.path(), path) == -1) {
+                raise_from_errno("Failed to resolve file.");
+            }
+            size_t size = 0;
+            std::vector<FileExtent> extents;
+            std::shared_ptr<const std::uint8_t> mapping =
+                MapFileForReading(path.DirFd(), path.Name(), size, &extents);
+            sender.reset(new RawFileSender(mapping, size, std::move(extents), file.sparse(), rawChunkSize));
+        } catch (const std::exception& ex) {
+            std::ostringstream sts;
+            sts << "Error sending the file " << filepath << " : " << ex.what();
+            std::cerr << sts.str() << std::endl;
+            Finish(Status(StatusCode::ABORTED, sts.str()));
+            return;
+        }
+        sendNextChunk();
+    }
+
+    void sendNextChunk() {
+        if (!sender->Next(&chunk)) {
+            Finish(Status::OK);
+            return;
+        }
+        StartWrite(&chunk);
+    }
+
+    static constexpr size_t rawChunkSize = 1UL << 20;
+
+    const string client;
+    grpc::ByteBuffer request;
+    grpc::ByteBuffer chunk;
+    string filepath;
+    std::unique_ptr<RawFileSender> sender;
+};
+
+class RawPutFileReactor final : public grpc::ServerGenericBidiReactor {
+   public:
+    RawPutFileReactor(grpc::GenericCallbackServerContext* context, const string& client)
+        : context(context), client(client), fd(-1) {
+        get_time(&ts_start);
+        StartRead(&buffer);
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok && context->IsCancelled()) {
+            // The stream broke off: what has arrived may end anywhere, so it must not replace
+            // the file
+            if (fd != -1) {
+                close(fd);
+                unlinkat(temp_path.DirFd(), temp_path.Name(), 0);
+            }
+            Finish(Status(StatusCode::CANCELLED, "Transfer of " + temp_name + " cancelled"));
+            return;
+        }
+        if (!ok) {
+            // Client half-closed, the whole file has arrived
+            finishFile();
+            return;
+        }
+
+        if (fd == -1) {
+            File file;
+            if (!ParseRawMessage(buffer, &file)) {
+                Finish(Status(StatusCode::INVALID_ARGUMENT, "Expected a file header"));
+                return;
+            }
+            if (resolvePutFilePaths(file.path(), temp_name, final_name,
+                                    temp_path, final_path) == -1) {
+                reply.set_err(errno);
+                sendReply();
+                return;
+            }
+            // The data is read once the delegations of the file are recalled, without waiting on
+            // this thread
+            bool sparse = file.sparse();
+            delegations->Recall(client, {final_name}, [this, sparse]() { startReceiving(sparse); });
+            return;
+        } else if (!receiver->Receive(buffer)) {
+            printf("%s : ERROR getting file on server!!\n", __func__);
+            const auto status_code = (errno == ENOSPC || errno == EFBIG)
+                                         ? StatusCode::RESOURCE_EXHAUSTED
+                                         : StatusCode::ABORTED;
+            string message = "Error writing to the file " + temp_name + " : " + strerror(errno);
+            close(fd);
+            unlinkat(temp_path.DirFd(), temp_path.Name(), 0);
+            Finish(Status(status_code, message));
+            return;
+        }
+        StartRead(&buffer);
+    }
+
+    void OnDone() override { delete this; }
+
+   private:
+    void startReceiving(bool sparse) {
+        fd = openat(temp_path.DirFd(), temp_path.Name(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            Finish(Status(StatusCode::ABORTED, "Failed to open " + temp_name + " : " + strerror(errno)));
+            return;
+        }
+        receiver.reset(new RawFileReceiver(fd, sparse));
+        StartRead(&buffer);
+    }
+
+    void finishFile() {
+        if (fd == -1) {
+            Finish(Status(StatusCode::INVALID_ARGUMENT, "Expected a file header"));
+            return;
+        }
+        if (!receiver->Finish()) {
+            string message = "Error writing to the file " + temp_name + " : " + strerror(errno);
+            close(fd);
+            unlinkat(temp_path.DirFd(), temp_path.Name(), 0);
+            Finish(Status(StatusCode::ABORTED, message));
+            return;
+        }
+        close(fd);
+
+        int res = renameat2(temp_path.DirFd(), temp_path.Name(),
+                            final_path.DirFd(), final_path.Name(), 0);
+        if (res == -1) {
+            printf("%s \t : Renaming failed! From = %s to %s\n", 
+                __func__, temp_name.c_str(), final_name.c_str());
+            perror(strerror(errno));
+            reply.set_err(errno);
+        } else {
+            reply.set_err(0);
+            changeLog->Append(final_name);
+        }
+
+        get_time(&ts_end);
+        printf("Time to receive (ms) : %f \n",
+               get_time_diff(&ts_start, &ts_end));
+        sendReply();
+    }
+
+    void sendReply() {
+        response = MakeRawMessage(reply);
+        StartWriteAndFinish(&response, grpc::WriteOptions(), Status::OK);
+    }
+
+    grpc::GenericCallbackServerContext* context;
+    const string client;
+    grpc::ByteBuffer buffer;
+    grpc::ByteBuffer response;
+    OutputInfo reply;
+    string temp_name, final_name;
+    ResolvedPath temp_path, final_path;
+    int fd;
+    std::unique_ptr<RawFileReceiver> receiver;
+    struct timespec ts_start, ts_end;
+};
+
+class RawFileServiceImpl final : public grpc::CallbackGenericService {
+    grpc::ServerGenericBidiReactor* CreateReactor(
+        grpc::GenericCallbackServerContext* context) override {
+        if (context->method() == kRawGetFileMethod) {
+            return new RawGetFileReactor(clientId(context));
+        }
+        if (context->method() == kRawPutFileMethod) {
+            return new RawPutFileReactor(context, clientId(context));
+        }
+        return grpc::CallbackGenericService::CreateReactor(context);
+    }
+};
+
 void RunServer() {
     std::string server_address("0.0.0.0:50051");
     AfsServiceImpl service;
@@ -548,6 +1388,9 @@ void RunServer() {
 
     builder.RegisterService(&service);
 
+    RawFileServiceImpl rawService;
+    builder.RegisterCallbackGenericService(&rawService);
+
     std::unique_ptr<Server> server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
 
@@ -581,8 +1424,13 @@ int main(int argc, char** argv) {
                    serverFolderPath.c_str());
         }
     }
+    changeLog.reset(new ChangeLog(rootDir + "/.changelog"));
+    changeLog->Open();
+    delegations.reset(new DelegationTable());
+    printf("Change log %016llx\n", (unsigned long long)changeLog->Id());
     rootDir = serverFolderPath;
     printf("RootDIR = %s\n", rootDir.c_str());
+    resolver.reset(new PathResolver(rootDir));
     RunServer();
     // printf("%s \n", __func__);
     return 0;
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <grpcpp/support/message_allocator.h>
+
+// Size of the block every arena starts on. It is large enough for the request and reply of any
+// metadata RPC (paths and a Stat), so those never need a second block.
+constexpr size_t kArenaInitialBlockSize = 2048;
+
+inline google::protobuf::ArenaOptions MakeArenaOptions(char* initial_block, size_t initial_block_size)
+{
+    google::protobuf::ArenaOptions options;
+    options.initial_block = initial_block;
+    options.initial_block_size = initial_block_size;
+    return options;
+}
+
+// ArenaMessageAllocator: Places the request and response of each callback unary RPC on a per-call
+// protobuf Arena. Arenas start on an inline block and are Reset() and recycled through a free list
+// once gRPC releases them, so a steady stream of small RPCs does not touch the heap at all.
+template <typename RequestT, typename ResponseT>
+class ArenaMessageAllocator : public grpc::MessageAllocator<RequestT, ResponseT> {
+public:
+    ArenaMessageAllocator(size_t max_free = 256)
+        : m_max_free(max_free)
+    {
+    }
+
+    ~ArenaMessageAllocator()
+    {
+        for (Holder* holder : m_free) {
+            delete holder;
+        }
+    }
+
+    grpc::MessageHolder<RequestT, ResponseT>* AllocateMessages() override
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (!m_free.empty()) {
+                Holder* holder = m_free.back();
+                m_free.pop_back();
+                return holder;
+            }
+        }
+        return new Holder(this);
+    }
+
+private:
+    class Holder : public grpc::MessageHolder<RequestT, ResponseT> {
+    public:
+        explicit Holder(ArenaMessageAllocator* allocator)
+            : m_allocator(allocator)
+            , m_arena(MakeArenaOptions(m_block, sizeof(m_block)))
+        {
+            Populate();
+        }
+
+        void Release() override
+        {
+            m_allocator->Recycle(this);
+        }
+
+        // Drop the previous call's messages and create fresh ones on the same block.
+        void Reset()
+        {
+            m_arena.Reset();
+            Populate();
+        }
+
+    private:
+        void Populate()
+        {
+            this->set_request(google::protobuf::Arena::CreateMessage<RequestT>(&m_arena));
+            this->set_response(google::protobuf::Arena::CreateMessage<ResponseT>(&m_arena));
+        }
+
+        ArenaMessageAllocator* m_allocator;
+        // Must be declared before m_arena, which is constructed on top of it.
+        char m_block[kArenaInitialBlockSize];
+        google::protobuf::Arena m_arena;
+    };
+
+    void Recycle(Holder* holder)
+    {
+        holder->Reset();
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_free.size() < m_max_free) {
+            m_free.push_back(holder);
+            return;
+        }
+        delete holder;
+    }
+
+    std::mutex m_lock;
+    std::vector<Holder*> m_free;
+    const size_t m_max_free;
+};
+
+// The allocator shared by all methods with the given request and response types.
+template <typename RequestT, typename ResponseT>
+grpc::MessageAllocator<RequestT, ResponseT>* GetArenaMessageAllocator()
+{
+    static ArenaMessageAllocator<RequestT, ResponseT> allocator;
+    return &allocator;
+}
+
+// CallArena: An Arena for the messages a streaming handler builds itself, living for one call.
+// It starts on an inline block, so it can sit on the handler's stack.
+class CallArena {
+public:
+    CallArena()
+        : m_arena(MakeArenaOptions(m_block, sizeof(m_block)))
+    {
+    }
+
+    template <typename T>
+    T* Create()
+    {
+        return google::protobuf::Arena::CreateMessage<T>(&m_arena);
+    }
+
+private:
+    char m_block[kArenaInitialBlockSize];
+    google::protobuf::Arena m_arena;
+};
@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <atomic>
 #include <ctime>
 #include <cstring>
 #include <fstream>
@@ -287,6 +288,205 @@ void benchmarkApplication(string userId, vector<struct time_statistics> &ts) {
     clearDirectory(cachedFolder.c_str());
 }
 
+// All threads open the same files at once, with a cold cache. A client that fetches each file once,
+// however many opens wait on it, and otherwise lets its FUSE threads work in parallel keeps the
+// open times flat as threads are added.
+void benchmarkSharedOpens(int numThreads) {
+    struct stat buf;
+    string sharedFolder = mountDirectory + "shared/";
+    string cachedFolder = cacheDirectory + "shared/";
+
+    if (lstat(sharedFolder.c_str(), &buf) == 0) {
+        clearDirectory(sharedFolder);
+    } else if (mkdir(sharedFolder.c_str(), 0777) != 0) {
+        printf("Failed to make directory %s\n", sharedFolder.c_str());
+        return;
+    }
+    for (int i = 0; i < max_File_Size; i++) {
+        string fileName = sharedFolder + "testFile_" + to_string(getFileSize(i)) + ".txt";
+        int fd = open(fileName.c_str(), O_CREAT | O_WRONLY, 0644);
+        if (fd == -1) {
+            printf("Failed to create the file %s.\n", fileName.c_str());
+            continue;
+        }
+        int cur_offset = 0;
+        for (size_t chunk = 0; chunk < data_c_str[i].size(); chunk++) {
+            pwrite(fd, data_c_str[i][chunk], data[i][chunk].size(), cur_offset);
+            cur_offset += data[i][chunk].size();
+        }
+        close(fd);
+    }
+    msleep(1500);
+    string clearCommand = "rm " + cachedFolder + "*";
+    if (system(clearCommand.c_str()) != 0) {
+        printf("Failed to delete the cache folder %s.\n", cachedFolder.c_str());
+    }
+    msleep(500);
+
+    vector<vector<double>> openTimes(numThreads, vector<double>(max_File_Size));
+    std::atomic<int> ready(0);
+    vector<std::thread> threadPool;
+    for (int t = 0; t < numThreads; t++) {
+        threadPool.push_back(std::thread([&, t]() {
+            ready++;
+            while (ready < numThreads) {
+                std::this_thread::yield();
+            }
+            const int buf_size = 131072;
+            vector<char> readBuf(buf_size);
+            for (int i = 0; i < max_File_Size; i++) {
+                string fileName = sharedFolder + "testFile_" + to_string(getFileSize(i)) + ".txt";
+                struct timespec ts_open_start, ts_open_end;
+                get_time(&ts_open_start);
+                int fd = open(fileName.c_str(), O_RDONLY);
+                get_time(&ts_open_end);
+                openTimes[t][i] = get_time_diff(&ts_open_start, &ts_open_end);
+                if (fd == -1) {
+                    printf("Failed to open file %s\n", fileName.c_str());
+                    continue;
+                }
+                off_t cur_offset = 0;
+                ssize_t res;
+                while ((res = pread(fd, readBuf.data(), buf_size, cur_offset)) > 0) {
+                    cur_offset += res;
+                }
+                close(fd);
+            }
+        }));
+    }
+    for (std::thread &t : threadPool) {
+        t.join();
+    }
+
+    printf("*****Shared cold opens, %d threads******\n", numThreads);
+    for (int i = 0; i < max_File_Size; i++) {
+        double total = 0, slowest = 0;
+        for (int t = 0; t < numThreads; t++) {
+            total += openTimes[t][i];
+            slowest = max(slowest, openTimes[t][i]);
+        }
+        printf("Mean Open = %-8.2f \t Slowest Open = %-8.2f \t File Size = %-10d\n",
+               total / numThreads, slowest, getFileSize(i));
+    }
+}
+
+// One file of several GB written through the mount and read back cold. Only one 1 MB block in
+// every large_stride bytes is written (plus the last block), the rest are holes, so the test
+// runs in minutes even at 100 GB. Every 8-byte word of a written block holds a value derived
+// from its offset, which catches data landing at a truncated (32-bit) offset; holes must read
+// back as zeros.
+const off_t large_block = one_mb;
+const off_t large_stride = 64 * (off_t)one_mb;
+
+static uint64_t patternAt(off_t offset) {
+    return (uint64_t)offset * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+static bool isLargeDataBlock(off_t offset, off_t fileSize) {
+    return offset % large_stride == 0 || offset == fileSize - large_block;
+}
+
+void benchmarkLargeFile(long long sizeGb) {
+    const off_t fileSize = (off_t)sizeGb << 30;
+    string largeFolder = mountDirectory + "large/";
+    string cachedFolder = cacheDirectory + "large/";
+    string fileName = largeFolder + "largeFile_" + to_string(sizeGb) + "GB.bin";
+
+    struct stat buf;
+    if (lstat(largeFolder.c_str(), &buf) == 0) {
+        clearDirectory(largeFolder);
+    } else if (mkdir(largeFolder.c_str(), 0777) != 0) {
+        printf("Failed to make directory %s\n", largeFolder.c_str());
+        return;
+    }
+
+    vector<uint64_t> block(large_block / sizeof(uint64_t));
+    struct timespec ts_write_start, ts_write_end, ts_close_end;
+    get_time(&ts_write_start);
+    int fd = open(fileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Failed to create the file %s.\n", fileName.c_str());
+        return;
+    }
+    off_t written = 0;
+    for (off_t offset = 0; offset < fileSize; offset += large_block) {
+        if (!isLargeDataBlock(offset, fileSize)) {
+            continue;
+        }
+        for (size_t i = 0; i < block.size(); i++) {
+            block[i] = patternAt(offset + i * sizeof(uint64_t));
+        }
+        if (pwrite(fd, block.data(), large_block, offset) != large_block) {
+            printf("Failed to write at offset %lld.\n", (long long)offset);
+            close(fd);
+            return;
+        }
+        written += large_block;
+    }
+    get_time(&ts_write_end);
+    if (close(fd) == -1) {
+        printf("Failed to close the file %s.\n", fileName.c_str());
+        return;
+    }
+    get_time(&ts_close_end);
+
+    if (lstat(fileName.c_str(), &buf) != 0 || buf.st_size != fileSize) {
+        printf("Size mismatch: expected %lld bytes, found %lld.\n", (long long)fileSize,
+               (long long)buf.st_size);
+        return;
+    }
+
+    // Read it back from the server, not from the cache
+    string clearCommand = "rm -f " + cachedFolder + "*";
+    if (system(clearCommand.c_str()) != 0) {
+        printf("Failed to delete the cache folder %s.\n", cachedFolder.c_str());
+    }
+
+    struct timespec ts_read_start, ts_read_end;
+    get_time(&ts_read_start);
+    fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) {
+        printf("Failed to open file %s\n", fileName.c_str());
+        return;
+    }
+    vector<uint64_t> readBuf(large_block / sizeof(uint64_t));
+    off_t bad = -1;
+    off_t offset = 0;
+    while (offset < fileSize) {
+        ssize_t res = pread(fd, readBuf.data(), large_block, offset);
+        if (res != large_block) {
+            bad = offset;
+            break;
+        }
+        const bool isData = isLargeDataBlock(offset, fileSize);
+        for (size_t i = 0; i < readBuf.size() && bad == -1; i++) {
+            if (readBuf[i] != (isData ? patternAt(offset + i * sizeof(uint64_t)) : 0)) {
+                bad = offset + i * sizeof(uint64_t);
+            }
+        }
+        if (bad != -1) {
+            break;
+        }
+        offset += large_block;
+    }
+    close(fd);
+    get_time(&ts_read_end);
+
+    const double readMs = get_time_diff(&ts_read_start, &ts_read_end);
+    printf("*****Large file, %lld GB (%lld MB written, the rest holes)******\n", sizeGb,
+           (long long)(written / one_mb));
+    printf("Write = %-10.2f \t Close = %-10.2f \t Cold Read = %-10.2f \t Read MB/s = %-8.1f\n",
+           get_time_diff(&ts_write_start, &ts_write_end),
+           get_time_diff(&ts_write_end, &ts_close_end), readMs,
+           (double)offset / one_mb / (readMs / 1e3));
+    if (bad == -1) {
+        printf("Integrity OK\n");
+    } else {
+        printf("Integrity FAILED at offset %lld\n", (long long)bad);
+    }
+    unlink(fileName.c_str());
+}
+
 int main(int argc, char *argv[]) {
     ios::sync_with_stdio(false);
     cin.tie(nullptr);
@@ -304,7 +504,17 @@ int main(int argc, char *argv[]) {
             }
         }
     }
+    if (argc > 2 && strcmp(argv[2], "large") == 0) {
+        // The first argument is the file size in GB here
+        long long sizeGb = atoll(argv[1]);
+        benchmarkLargeFile(sizeGb > 0 ? sizeGb : 10);
+        return 0;
+    }
     fillData();
+    if (argc > 2 && strcmp(argv[2], "shared") == 0) {
+        benchmarkSharedOpens(numProcesses);
+        return 0;
+    }
     vector<std::thread> threadPool;
     vector<vector<struct time_statistics>> stats(numProcesses);
 
@@ -0,0 +1,152 @@
+// Allocation count benchmark for the server's message handling.
+// For each RPC it replays what a handler does with its messages, once with the messages on the
+// heap (as the handlers used to do) and once with the per-call arenas the server uses now
+// (ArenaMessageAllocator for unary calls, CallArena and a reused message for streaming calls),
+// and reports the number of heap allocations per RPC.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "afsfuse.pb.h"
+#include "arena_allocator.h"
+#include "messages.h"
+
+using namespace afsfuse;
+using namespace std;
+
+static std::atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+const int num_iterations = 10000;
+const int num_dir_entries = 32;
+const int num_chunks = 16;
+const size_t chunk_size = 64 * 1024;
+
+const string path = "/0_129/some_directory/testFile_1048576.txt";
+char out_buf[1 << 20];
+vector<char> chunk_data(chunk_size, 'a');
+
+void fillStat(Stat *reply) {
+    reply->set_ino(1234567);
+    reply->set_mode(0100644);
+    reply->set_nlink(1);
+    reply->set_size(1048576);
+    reply->set_blksize(4096);
+    reply->set_blocks(2048);
+    reply->set_mtimtvsec(1700000000);
+    reply->set_mtimtvnsec(123456789);
+    reply->set_err(0);
+}
+
+// Unary getattr: parse the request, fill and serialize the reply.
+void getattrHeap(const string &wire) {
+    String *request = new String();
+    Stat *reply = new Stat();
+    request->ParseFromString(wire);
+    fillStat(reply);
+    reply->SerializeToArray(out_buf, sizeof(out_buf));
+    delete request;
+    delete reply;
+}
+
+void getattrArena(const string &wire) {
+    auto *holder = GetArenaMessageAllocator<String, Stat>()->AllocateMessages();
+    holder->request()->ParseFromString(wire);
+    fillStat(holder->response());
+    holder->response()->SerializeToArray(out_buf, sizeof(out_buf));
+    holder->Release();
+}
+
+// Streaming readdir: one Dirent per entry.
+void readdirHeap() {
+    char name[64];
+    for (int i = 0; i < num_dir_entries; i++) {
+        snprintf(name, sizeof(name), "directory_entry_name_%d", i);
+        Dirent *directory = new Dirent();
+        directory->set_dino(i);
+        directory->set_dname(name);
+        directory->set_dtype(8);
+        directory->SerializeToArray(out_buf, sizeof(out_buf));
+        delete directory;
+    }
+}
+
+void readdirArena() {
+    CallArena arena;
+    Dirent &directory = *arena.Create<Dirent>();
+    char name[64];
+    for (int i = 0; i < num_dir_entries; i++) {
+        snprintf(name, sizeof(name), "directory_entry_name_%d", i);
+        directory.set_dino(i);
+        directory.set_dname(name);
+        directory.set_dtype(8);
+        directory.SerializeToArray(out_buf, sizeof(out_buf));
+    }
+}
+
+// Streaming getFile: one FileContent per chunk.
+void getFileHeap() {
+    for (int i = 0; i < num_chunks; i++) {
+        FileContent fc = MakeFileContent(path, chunk_data.data(), chunk_data.size());
+        fc.SerializeToArray(out_buf, sizeof(out_buf));
+    }
+}
+
+void getFileReused() {
+    FileContent fc;
+    for (int i = 0; i < num_chunks; i++) {
+        if (fc.name().empty()) {
+            fc.set_name(path);
+        }
+        fc.set_content(chunk_data.data(), chunk_data.size());
+        fc.SerializeToArray(out_buf, sizeof(out_buf));
+    }
+}
+
+template <typename F>
+double allocationsPerCall(F f) {
+    // Warm up, so allocator free lists are populated as in a running server
+    for (int i = 0; i < 100; i++) {
+        f();
+    }
+    unsigned long before = allocations;
+    for (int i = 0; i < num_iterations; i++) {
+        f();
+    }
+    return (double)(allocations - before) / num_iterations;
+}
+
+int main(int argc, char *argv[]) {
+    String request;
+    request.set_str(path);
+    string wire = request.SerializeAsString();
+
+    printf("%-10s \t %-16s \t %-16s\n", "RPC", "Heap allocs/RPC", "Arena allocs/RPC");
+    printf("%-10s \t %-16.2f \t %-16.2f\n", "getattr",
+           allocationsPerCall([&]() { getattrHeap(wire); }),
+           allocationsPerCall([&]() { getattrArena(wire); }));
+    printf("%-10s \t %-16.2f \t %-16.2f \t (%d entries)\n", "readdir",
+           allocationsPerCall(readdirHeap), allocationsPerCall(readdirArena),
+           num_dir_entries);
+    printf("%-10s \t %-16.2f \t %-16.2f \t (%d chunks)\n", "getFile",
+           allocationsPerCall(getFileHeap), allocationsPerCall(getFileReused),
+           num_chunks);
+    return 0;
+}
@@ -0,0 +1,476 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <experimental/filesystem>
+
+#include "block_cache.h"
+#include "client_common.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+
+    // The bitmap file of a file in the block cache: this header, then one bit per block
+    struct BlockMapHeader {
+        char magic[8];
+        int64_t size;
+        int64_t mtimeSec;
+        int64_t mtimeNsec;
+        uint64_t blockSize;
+    };
+
+    const char blockMapMagic[8] = {'A', 'F', 'S', 'B', 'L', 'K', 'S', '1'};
+
+    // The blocks present in the bitmap file 'mapPath', false if it is not one of 'blockSize'
+    bool countBlocks(const std::string &mapPath, uint64_t blockSize, uint64_t *blocks) {
+        int fd = open(mapPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        BlockMapHeader header;
+        bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     memcmp(header.magic, blockMapMagic, sizeof(header.magic)) == 0 &&
+                     header.blockSize == blockSize && header.size >= 0;
+        std::vector<uint8_t> present;
+        if (valid) {
+            present.resize(((header.size + blockSize - 1) / blockSize + 7) / 8);
+            valid = pread(fd, present.data(), present.size(), sizeof(header)) ==
+                    (ssize_t)present.size();
+        }
+        close(fd);
+        *blocks = 0;
+        for (uint8_t byte : present) {
+            *blocks += __builtin_popcount(byte);
+        }
+        return valid;
+    }
+
+};  // Anonymous namespace
+
+BlockFile::BlockFile(BlockCache *cache, const char *path)
+    : cache(cache), blockSize(cache->blockSize), path(path), dataFd(-1), mapFd(-1) {}
+
+BlockFile::~BlockFile() {
+    if (dataFd != -1) {
+        close(dataFd);
+    }
+    if (mapFd != -1) {
+        close(mapFd);
+    }
+}
+
+// Not shared yet while it loads, so without the lock
+bool BlockFile::load(const std::string &root, const struct stat &remote) {
+    std::string copyPath = root + "/data" + path;
+    std::string mapPath = root + "/maps" + path;
+    std::error_code ec;
+    fs::create_directories(fs::path(copyPath).parent_path(), ec);
+    fs::create_directories(fs::path(mapPath).parent_path(), ec);
+    dataFd = open(copyPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    mapFd = open(mapPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (dataFd == -1 || mapFd == -1) {
+        return false;
+    }
+
+    attributes = remote;
+    present.assign((blockCount() + 7) / 8, 0);
+    BlockMapHeader header;
+    if (pread(mapFd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, blockMapMagic, sizeof(header.magic)) == 0 &&
+        header.size == remote.st_size && header.mtimeSec == remote.st_mtim.tv_sec &&
+        header.mtimeNsec == remote.st_mtim.tv_nsec && header.blockSize == blockSize &&
+        pread(mapFd, present.data(), present.size(), sizeof(header)) == (ssize_t)present.size()) {
+        return true;
+    }
+    return start(remote);
+}
+
+bool BlockFile::reset(const struct stat &remote) {
+    std::unique_lock<std::mutex> l(lock);
+    // Blocks of the old version being fetched must not land in the new one
+    fetched.wait(l, [&]() { return fetching.empty(); });
+    // Another open may have started over with 'remote' meanwhile
+    if (matches(remote)) {
+        return true;
+    }
+    return start(remote);
+}
+
+bool BlockFile::matches(const struct stat &remote) const {
+    return attributes.st_size == remote.st_size &&
+           attributes.st_mtim.tv_sec == remote.st_mtim.tv_sec &&
+           attributes.st_mtim.tv_nsec == remote.st_mtim.tv_nsec;
+}
+
+// Called with the lock held, or before the file is shared
+bool BlockFile::start(const struct stat &remote) {
+    attributes = remote;
+    present.assign((blockCount() + 7) / 8, 0);
+    BlockMapHeader header;
+    memcpy(header.magic, blockMapMagic, sizeof(header.magic));
+    header.size = remote.st_size;
+    header.mtimeSec = remote.st_mtim.tv_sec;
+    header.mtimeNsec = remote.st_mtim.tv_nsec;
+    header.blockSize = blockSize;
+    // The copy is all holes at the new size, the bitmap all zeros
+    return ftruncate(dataFd, 0) == 0 && ftruncate(dataFd, remote.st_size) == 0 &&
+           ftruncate(mapFd, 0) == 0 && pwrite(mapFd, &header, sizeof(header), 0) == sizeof(header) &&
+           ftruncate(mapFd, sizeof(header) + present.size()) == 0;
+}
+
+void BlockFile::mark(uint64_t block, bool value) {
+    uint8_t &byte = present[block / 8];
+    if (value) {
+        byte |= 1 << block % 8;
+    } else {
+        byte &= ~(1 << block % 8);
+    }
+    // A set bit is written once the block's data is synced, so a present block is on disk even
+    // after a power loss. A cleared bit is written before the block is punched out, which orders
+    // the two only against a crash of the process.
+    pwrite(mapFd, &byte, 1, sizeof(BlockMapHeader) + block / 8);
+}
+
+int BlockFile::read(char *buf, size_t size, off_t offset) {
+    off_t fileSize;
+    {
+        // Another handle may reset the file to a new version meanwhile
+        std::lock_guard<std::mutex> guard(lock);
+        fileSize = attributes.st_size;
+    }
+    if (offset >= fileSize) {
+        return 0;
+    }
+    size = std::min(size, (size_t)(fileSize - offset));
+    if (size == 0) {
+        return 0;
+    }
+    const uint64_t first = offset / blockSize;
+    const uint64_t last = (offset + size - 1) / blockSize;
+
+    // A block may be evicted between its fetch and the copy: fetch again then
+    for (int attempt = 0; attempt < 3; attempt++) {
+        fetch(first, last);
+        std::unique_lock<std::mutex> l(lock);
+        bool complete = true;
+        for (uint64_t block = first; block <= last && complete; block++) {
+            complete = block < blockCount() && has(block);
+        }
+        if (!complete) {
+            continue;
+        }
+        ssize_t res = pread(dataFd, buf, size, offset);
+        l.unlock();
+        for (uint64_t block = first; block <= last; block++) {
+            cache->touched(this, block);
+        }
+        return res == -1 ? -errno : res;
+    }
+    return -EIO;
+}
+
+// Fetch the blocks of [first, last] missing, and the read-ahead after them, then wait for those
+// other reads are fetching. The blocks that could not be fetched are left missing.
+void BlockFile::fetch(uint64_t first, uint64_t last) {
+    struct Call {
+        uint64_t block;
+        ReadRequest request;
+        ReadResult reply;
+        ClientContext context;
+        bool ok;
+    };
+
+    std::unique_lock<std::mutex> l(lock);
+    const off_t fileSize = attributes.st_size;
+    const uint64_t end = std::min(last + 1 + cache->readahead, blockCount());
+    std::vector<std::unique_ptr<Call>> calls;
+    for (uint64_t block = first; block < end; block++) {
+        if (has(block) || fetching.count(block) != 0) {
+            continue;
+        }
+        // Read ahead only along with blocks the read misses
+        if (block > last && calls.empty()) {
+            break;
+        }
+        fetching.insert(block);
+        std::unique_ptr<Call> call(new Call());
+        call->block = block;
+        call->request.set_path(path);
+        call->request.set_offset(block * blockSize);
+        call->request.set_size(blockSize);
+        call->context.set_deadline(std::chrono::system_clock::now() +
+                                   std::chrono::milliseconds(cache->fetchTimeoutMs));
+        calls.push_back(std::move(call));
+    }
+    l.unlock();
+
+    std::mutex doneLock;
+    std::condition_variable allDone;
+    size_t pending = calls.size();
+    for (auto &call : calls) {
+        Call *c = call.get();
+        cache->client->rpc_readAsync(&c->context, &c->request, &c->reply, [&, c](Status status) {
+            c->ok = status.ok() && c->reply.err() == 0;
+            std::lock_guard<std::mutex> guard(doneLock);
+            pending--;
+            allDone.notify_all();
+        });
+    }
+    {
+        std::unique_lock<std::mutex> done(doneLock);
+        allDone.wait(done, [&]() { return pending == 0; });
+    }
+
+    std::vector<uint64_t> stored;
+    for (auto &call : calls) {
+        const off_t at = call->block * blockSize;
+        const size_t expected = std::min<off_t>(blockSize, fileSize - at);
+        const std::string &data = call->reply.buffer();
+        // A short block means the file changed on the server: it stays missing
+        if (call->ok && data.size() == expected &&
+            pwrite(dataFd, data.data(), data.size(), at) == (ssize_t)data.size()) {
+            stored.push_back(call->block);
+        }
+    }
+    if (!stored.empty() && fdatasync(dataFd) == -1) {
+        stored.clear();
+    }
+
+    l.lock();
+    for (auto &call : calls) {
+        fetching.erase(call->block);
+    }
+    for (uint64_t block : stored) {
+        mark(block, true);
+    }
+    fetched.notify_all();
+    fetched.wait(l, [&]() {
+        for (uint64_t block = first; block <= last; block++) {
+            if (fetching.count(block) != 0) {
+                return false;
+            }
+        }
+        return true;
+    });
+    l.unlock();
+    for (uint64_t block : stored) {
+        cache->touched(this, block);
+    }
+}
+
+uint64_t BlockCache::open(const char *path, const struct stat &remote) {
+    std::unique_lock<std::mutex> l(lock);
+    BlockFile *file;
+    auto it = files.find(path);
+    if (it == files.end()) {
+        file = new BlockFile(this, path);
+        if (!file->load(root, remote)) {
+            delete file;
+            return 0;
+        }
+        files[path] = file;
+        auto kept = idle.find(path);
+        if (kept != idle.end()) {
+            // Counted by its blocks from now on
+            idleBlocks -= kept->second;
+            idle.erase(kept);
+        }
+        // The blocks kept from a previous run count as the least recently read
+        for (uint64_t block = 0; block < file->blockCount(); block++) {
+            if (file->has(block)) {
+                positions[Block(file, block)] = recent.insert(recent.end(), Block(file, block));
+            }
+        }
+        file->handles++;
+    } else {
+        file = it->second;
+        // The handle keeps the file while the lock is released
+        file->handles++;
+        bool current;
+        {
+            std::lock_guard<std::mutex> guard(file->lock);
+            current = file->matches(remote);
+        }
+        if (!current) {
+            forget(file);
+            // The reset waits for the fetches of the old version, up to fetchTimeoutMs: the other
+            // files must not wait with it
+            l.unlock();
+            bool ok = file->reset(remote);
+            l.lock();
+            // Reads of the old version may have touched its blocks meanwhile
+            prune(file);
+            if (!ok) {
+                file->handles--;
+                closeIfIdle(file);
+                return 0;
+            }
+        }
+    }
+    handles[next] = file;
+    evict();
+    return next++;
+}
+
+BlockFile *BlockCache::find(uint64_t fh) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = handles.find(fh);
+    return it != handles.end() ? it->second : NULL;
+}
+
+void BlockCache::release(uint64_t fh) {
+    // The file stays, with its blocks, for the next open
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = handles.find(fh);
+    if (it == handles.end()) {
+        return;
+    }
+    BlockFile *file = it->second;
+    handles.erase(it);
+    file->handles--;
+    closeIfIdle(file);
+}
+
+void BlockCache::touched(BlockFile *file, uint64_t block) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = positions.find(Block(file, block));
+    if (it != positions.end()) {
+        recent.splice(recent.begin(), recent, it->second);
+    } else {
+        {
+            // Gone if the file was reset or the block evicted since it was read
+            std::lock_guard<std::mutex> present(file->lock);
+            if (block >= file->blockCount() || !file->has(block)) {
+                return;
+            }
+        }
+        positions[Block(file, block)] = recent.insert(recent.begin(), Block(file, block));
+        evict();
+    }
+}
+
+// Drop the blocks of 'file' from the order, before they are dropped from the file. Called with
+// the lock held.
+void BlockCache::forget(BlockFile *file) {
+    auto it = positions.lower_bound(Block(file, 0));
+    while (it != positions.end() && it->first.first == file) {
+        recent.erase(it->second);
+        it = positions.erase(it);
+    }
+}
+
+// Drop the blocks of 'file' from the order that are no longer in the file. Called with the lock
+// held.
+void BlockCache::prune(BlockFile *file) {
+    std::lock_guard<std::mutex> guard(file->lock);
+    auto it = positions.lower_bound(Block(file, 0));
+    while (it != positions.end() && it->first.first == file) {
+        uint64_t block = it->first.second;
+        if (block < file->blockCount() && file->has(block)) {
+            ++it;
+        } else {
+            recent.erase(it->second);
+            it = positions.erase(it);
+        }
+    }
+}
+
+// Punch the least recently read blocks out of their copies while the blocks take more than
+// capacity bytes, after dropping the files kept from earlier runs. Called with the lock held.
+void BlockCache::evict() {
+    while (idleBlocks > 0 && (recent.size() + idleBlocks) * blockSize > capacity) {
+        dropIdle();
+    }
+    while (!recent.empty() && recent.size() * blockSize > capacity) {
+        Block victim = recent.back();
+        recent.pop_back();
+        positions.erase(victim);
+        BlockFile *file = victim.first;
+        {
+            std::lock_guard<std::mutex> guard(file->lock);
+            if (victim.second < file->blockCount() && file->has(victim.second)) {
+                file->mark(victim.second, false);
+                fallocate(file->dataFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          victim.second * blockSize, blockSize);
+            }
+        }
+        closeIfIdle(file);
+    }
+}
+
+// A file without handles and blocks is closed, its copy and bitmap stay on disk for the next
+// open. Called with the lock held.
+void BlockCache::closeIfIdle(BlockFile *file) {
+    auto it = positions.lower_bound(Block(file, 0));
+    if (file->handles > 0 || (it != positions.end() && it->first.first == file)) {
+        return;
+    }
+    files.erase(file->path);
+    delete file;
+}
+
+// Remove the least recently fetched file kept from an earlier run. Called with the lock held.
+void BlockCache::dropIdle() {
+    while (!idleOrder.empty()) {
+        std::string path = idleOrder.front();
+        idleOrder.pop_front();
+        auto it = idle.find(path);
+        if (it == idle.end()) {
+            continue;  // opened since
+        }
+        idleBlocks -= it->second;
+        idle.erase(it);
+        unlink((root + "/data" + path).c_str());
+        unlink((root + "/maps" + path).c_str());
+        return;
+    }
+}
+
+void BlockCache::load() {
+    struct Kept {
+        struct timespec fetched;  // the last change of the bitmap
+        std::string path;
+        uint64_t blocks;
+    };
+
+    const std::string maps = root + "/maps";
+    std::vector<Kept> kept;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(maps, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!fs::is_regular_file(it->symlink_status(ec))) {
+            continue;
+        }
+        const std::string mapPath = it->path().string();
+        const std::string path = mapPath.substr(maps.size());
+        struct stat st;
+        uint64_t blocks;
+        if (lstat(mapPath.c_str(), &st) != 0 || !countBlocks(mapPath, blockSize, &blocks)) {
+            // Not a bitmap of this block size: its blocks cannot be used
+            unlink((root + "/data" + path).c_str());
+            unlink(mapPath.c_str());
+            continue;
+        }
+        if (blocks > 0) {
+            kept.push_back(Kept{st.st_mtim, path, blocks});
+        }
+    }
+    std::sort(kept.begin(), kept.end(), [](const Kept &a, const Kept &b) {
+        return a.fetched.tv_sec != b.fetched.tv_sec ? a.fetched.tv_sec < b.fetched.tv_sec
+                                                    : a.fetched.tv_nsec < b.fetched.tv_nsec;
+    });
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (const Kept &file : kept) {
+        if (files.count(file.path) != 0) {
+            continue;
+        }
+        idle[file.path] = file.blocks;
+        idleOrder.push_back(file.path);
+        idleBlocks += file.blocks;
+    }
+    evict();
+}
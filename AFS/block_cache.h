@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "AfsClient.h"
+
+struct BlockCache;
+
+// BlockFile: A file in the block cache (--block_cache_min_size), for huge files read at a few
+// places. Its copy holds only the blocks of the cache's block size that were read, and holes
+// elsewhere. A bitmap records which blocks are present; it is kept in a file next to the copy,
+// after a header with the version of the file, so the blocks survive a restart. Copies and bitmaps
+// are in the data and maps folders of the block cache, at the paths of their files. A read fetches
+// the blocks it misses, and the cache's read-ahead of blocks after them, with concurrent range
+// reads. Blocks that another read is fetching are waited for, not fetched twice.
+struct BlockFile {
+    BlockCache *cache;
+    const uint64_t blockSize;
+
+    std::string path;
+    struct stat attributes;  // of the version of the file the blocks belong to
+    int dataFd;
+    int mapFd;
+    std::mutex lock;
+    std::condition_variable fetched;
+    std::vector<uint8_t> present;  // one bit per block
+    std::unordered_set<uint64_t> fetching;
+    int handles = 0;  // open handles, under the lock of the BlockCache
+
+    BlockFile(BlockCache *cache, const char *path);
+
+    BlockFile(const BlockFile &) = delete;
+    BlockFile &operator=(const BlockFile &) = delete;
+
+    ~BlockFile();
+
+    // Open the copy and the bitmap under 'root'. Blocks of another version than 'remote' are
+    // dropped. Returns false on failure.
+    bool load(const std::string &root, const struct stat &remote);
+
+    // Drop all blocks and start over with version 'remote', once the fetches under way are done.
+    // Returns false on failure.
+    bool reset(const struct stat &remote);
+
+    // Whether the blocks are of version 'remote'. Called with the lock held.
+    bool matches(const struct stat &remote) const;
+
+    uint64_t blockCount() const { return (attributes.st_size + blockSize - 1) / blockSize; }
+
+    bool has(uint64_t block) const { return present[block / 8] & (1 << block % 8); }
+
+    // Record that 'block' is present or not, in memory and in the bitmap file. Called with the
+    // lock held, after the data of a present block is synced.
+    void mark(uint64_t block, bool value);
+
+    int read(char *buf, size_t size, off_t offset);
+
+   private:
+    bool start(const struct stat &remote);
+
+    void fetch(uint64_t first, uint64_t last);
+};
+
+// BlockCache: The handles of the files in the block cache, the files, and their blocks in the
+// order they were last read. Blocks are 'blockSize' bytes, fetched through 'client' with
+// 'readahead' blocks after those a read misses, and fail the read if not answered within
+// 'fetchTimeoutMs'. Once the blocks take more than 'capacity' bytes, the least recently read ones
+// are punched out of their copies; the files left on disk by earlier runs go first, whole. Handle
+// numbers start at blockHandleBase, which descriptors do not reach, below those of direct mode.
+const uint64_t blockHandleBase = (uint64_t)1 << 61;
+
+struct BlockCache {
+    typedef std::pair<BlockFile *, uint64_t> Block;
+
+    AfsClient *client;
+    const uint64_t blockSize;
+    const int readahead;
+    const int fetchTimeoutMs;
+    const unsigned long capacity;
+
+    std::string root;
+    std::mutex lock;
+    std::unordered_map<std::string, BlockFile *> files;
+    std::unordered_map<uint64_t, BlockFile *> handles;
+    uint64_t next = blockHandleBase;
+    std::list<Block> recent;  // most recently read first
+    std::map<Block, std::list<Block>::iterator> positions;
+    std::unordered_map<std::string, uint64_t> idle;  // blocks of the files not opened since load
+    std::deque<std::string> idleOrder;               // least recently fetched first
+    uint64_t idleBlocks = 0;
+
+    BlockCache(AfsClient *client, const std::string &root, uint64_t blockSize, int readahead,
+               int fetchTimeoutMs, unsigned long capacity)
+        : client(client), blockSize(blockSize), readahead(readahead),
+          fetchTimeoutMs(fetchTimeoutMs), capacity(capacity), root(root) {}
+
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    // Count the blocks kept under 'root' by earlier runs, and drop those beyond the capacity
+    void load();
+
+    // A handle reading 'path' at version 'remote', 0 if its copy cannot be set up
+    uint64_t open(const char *path, const struct stat &remote);
+
+    BlockFile *find(uint64_t fh);
+
+    void release(uint64_t fh);
+
+    // 'block' of 'file' was read or fetched: it is evicted last
+    void touched(BlockFile *file, uint64_t block);
+
+   private:
+    void forget(BlockFile *file);
+
+    void prune(BlockFile *file);
+
+    void evict();
+
+    void dropIdle();
+
+    void closeIfIdle(BlockFile *file);
+};
@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <random>
+#include <unordered_set>
+
+#include "change_log.h"
+#include "utils.h"
+
+namespace {
+
+    // The file starts with kMagic and the id of the log. Every entry is its sequence number and the
+    // length of its path, in host byte order, followed by the path.
+    const char kMagic[8] = {'A', 'F', 'S', 'C', 'L', 'O', 'G', '1'};
+    const size_t kHeaderSize = sizeof(kMagic) + sizeof(uint64_t);
+    const size_t kEntryHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+
+    bool write_all(int fd, const std::string& data)
+    {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t res = write(fd, data.data() + done, data.size() - done);
+            if (res == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += res;
+        }
+        return true;
+    }
+
+    std::string make_header(uint64_t id)
+    {
+        std::string header(kMagic, sizeof(kMagic));
+        header.append((const char*)&id, sizeof(id));
+        return header;
+    }
+
+    // Paths are logged the way clients send them, from the root and without a trailing '/'
+    std::string normalize(const std::string& path)
+    {
+        std::string normalized = (path.empty() || path[0] != '/') ? "/" + path : path;
+        while (normalized.size() > 1 && normalized.back() == '/') {
+            normalized.pop_back();
+        }
+        return normalized;
+    }
+
+};  // Anonymous namespace
+
+ChangeLog::ChangeLog(const std::string& file, size_t max_entries)
+    : m_file(file)
+    , m_max_entries(max_entries)
+    , m_fd(-1)
+    , m_id(0)
+    , m_last(0)
+    , m_file_entries(0)
+{
+}
+
+ChangeLog::~ChangeLog()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+void ChangeLog::Open()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (!Load()) {
+        Create();
+    }
+}
+
+void ChangeLog::Append(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    Entry entry{m_last + 1, normalize(path)};
+    if (m_fd == -1 || !WriteEntry(m_fd, entry)) {
+        // Carry on with the entries in memory only. Without its file a restarted server starts a
+        // new log, so no client can miss the change. Compact() writes the file again.
+        perror("ChangeLog::Append");
+        if (m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        unlink(m_file.c_str());
+    }
+    m_last = entry.seq;
+    m_entries.push_back(entry);
+    if (m_entries.size() > m_max_entries) {
+        m_entries.pop_front();
+    }
+    if (++m_file_entries >= 2 * m_max_entries) {
+        Compact();
+    }
+}
+
+bool ChangeLog::Since(uint64_t id, uint64_t cursor, size_t max_paths, std::vector<std::string>& paths,
+                      uint64_t& next, bool& more)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    more = false;
+    next = m_last;
+    uint64_t oldest = m_entries.empty() ? m_last + 1 : m_entries.front().seq;
+    if (id != m_id || cursor > m_last || cursor + 1 < oldest) {
+        return false;
+    }
+
+    std::unordered_set<std::string> listed;
+    for (auto it = m_entries.begin() + (cursor + 1 - oldest); it != m_entries.end(); ++it) {
+        if (listed.count(it->path) == 0) {
+            if (paths.size() == max_paths) {
+                more = true;
+                break;
+            }
+            listed.insert(it->path);
+            paths.push_back(it->path);
+        }
+        next = it->seq;
+    }
+    return true;
+}
+
+// Read the entries of an existing log file. A torn last entry (the server died while writing it)
+// is cut off. Returns false if there is no valid log file.
+bool ChangeLog::Load()
+{
+    int fd = open(m_file.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    std::string data;
+    char chunk[65536];
+    ssize_t res;
+    while ((res = read(fd, chunk, sizeof(chunk))) > 0) {
+        data.append(chunk, res);
+    }
+    if (res == -1 || data.size() < kHeaderSize || memcmp(data.data(), kMagic, sizeof(kMagic)) != 0) {
+        close(fd);
+        return false;
+    }
+    memcpy(&m_id, data.data() + sizeof(kMagic), sizeof(m_id));
+
+    size_t offset = kHeaderSize;
+    while (data.size() - offset >= kEntryHeaderSize) {
+        uint64_t seq;
+        uint32_t length;
+        memcpy(&seq, data.data() + offset, sizeof(seq));
+        memcpy(&length, data.data() + offset + sizeof(seq), sizeof(length));
+        if (data.size() - offset - kEntryHeaderSize < length) {
+            break;
+        }
+        m_entries.push_back(Entry{seq, data.substr(offset + kEntryHeaderSize, length)});
+        if (m_entries.size() > m_max_entries) {
+            m_entries.pop_front();
+        }
+        m_last = seq;
+        m_file_entries++;
+        offset += kEntryHeaderSize + length;
+    }
+    if (offset != data.size() && ftruncate(fd, offset) == -1) {
+        close(fd);
+        return false;
+    }
+    if (lseek(fd, 0, SEEK_END) == -1) {
+        close(fd);
+        return false;
+    }
+    m_fd = fd;
+    return true;
+}
+
+void ChangeLog::Create()
+{
+    std::random_device random;
+    m_id = ((uint64_t)random() << 32) | random();
+    m_last = 0;
+    m_file_entries = 0;
+    m_entries.clear();
+
+    int fd = open(m_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        raise_from_errno("Failed to create the change log " + m_file);
+    }
+    if (!write_all(fd, make_header(m_id))) {
+        close(fd);
+        raise_from_errno("Failed to write the change log " + m_file);
+    }
+    m_fd = fd;
+}
+
+bool ChangeLog::WriteEntry(int fd, const Entry& entry)
+{
+    uint32_t length = entry.path.size();
+    std::string record((const char*)&entry.seq, sizeof(entry.seq));
+    record.append((const char*)&length, sizeof(length));
+    record += entry.path;
+    return write_all(fd, record);
+}
+
+// Rewrite the file with the entries kept in memory only, atomically
+void ChangeLog::Compact()
+{
+    const std::string temp_file = m_file + ".tmp";
+    int fd = open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    bool ok = write_all(fd, make_header(m_id));
+    for (auto it = m_entries.begin(); ok && it != m_entries.end(); ++it) {
+        ok = WriteEntry(fd, *it);
+    }
+    if (!ok || rename(temp_file.c_str(), m_file.c_str()) == -1) {
+        close(fd);
+        unlink(temp_file.c_str());
+        return;
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = fd;
+    m_file_entries = m_entries.size();
+}
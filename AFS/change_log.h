@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ChangeLog: An append-only log of the client paths changed on the server, each entry numbered
+// with a sequence number one higher than the previous one. A client remembers the last number it
+// has seen (its cursor) and asks for the paths changed since, instead of revalidating every file
+// it caches after a reconnect.
+//
+// The log is kept in a file, so numbering continues across server restarts. Every log file gets
+// a random id when it is created; a cursor taken from another log (a deleted or replaced one) is
+// recognized by its id. Only the last 'max_entries' entries are kept, so a client that has been
+// away for long may find that its cursor is too old and has to revalidate everything instead.
+//
+// Entries are written with write() but not synced, so they survive a crash of the server but not
+// one of the machine, just like the files they describe.
+class ChangeLog {
+public:
+    ChangeLog(const std::string& file, size_t max_entries = 1 << 16);
+    ~ChangeLog();
+
+    ChangeLog(const ChangeLog&) = delete;
+    ChangeLog& operator=(const ChangeLog&) = delete;
+
+    // Load the log, or create it if it does not exist or is unreadable. Throws std::system_error if
+    // the file cannot be created.
+    void Open();
+
+    // Record a change of the client path 'path'.
+    void Append(const std::string& path);
+
+    uint64_t Id() const
+    {
+        return m_id;
+    }
+
+    // The paths changed after 'cursor' of the log 'id', at most 'max_paths' of them, each listed
+    // once. 'next' is set to the cursor to pass next time and 'more' tells whether there are
+    // changes left after it. Returns false if the log cannot tell what changed since 'cursor';
+    // 'next' is then set to the current end of the log.
+    bool Since(uint64_t id, uint64_t cursor, size_t max_paths, std::vector<std::string>& paths,
+               uint64_t& next, bool& more);
+
+private:
+    struct Entry {
+        uint64_t seq;
+        std::string path;
+    };
+
+    bool Load();
+    void Create();
+    bool WriteEntry(int fd, const Entry& entry);
+    void Compact();
+
+    const std::string m_file;
+    const size_t m_max_entries;
+
+    std::mutex m_lock;
+    int m_fd;
+    uint64_t m_id;
+    uint64_t m_last;             // Sequence number of the last change, 0 before the first one
+    size_t m_file_entries;       // Entries in the file, which is compacted at 2 * m_max_entries
+    std::deque<Entry> m_entries;  // The last m_max_entries entries, oldest first
+};
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <experimental/filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "change_sync.h"
+#include "client_common.h"
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+
+    const char *const kHeader = "afs-change-cursor 1";
+
+    // Stale paths are saved one per line, with '\' and newlines escaped
+    std::string escapePath(const std::string &path) {
+        std::string escaped;
+        for (char c : path) {
+            if (c == '\\') {
+                escaped += "\\\\";
+            } else if (c == '\n') {
+                escaped += "\\n";
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    std::string unescapePath(const std::string &line) {
+        std::string path;
+        for (size_t i = 0; i < line.size(); i++) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                path += line[++i] == 'n' ? '\n' : line[i];
+            } else {
+                path += line[i];
+            }
+        }
+        return path;
+    }
+
+};  // Anonymous namespace
+
+bool ChangeSync::load() {
+    std::ifstream in(file);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != kHeader || !std::getline(in, line)) {
+        return false;
+    }
+    std::istringstream position(line);
+    uint64_t savedLogId, savedCursor;
+    if (!(position >> savedLogId >> savedCursor)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    logId = savedLogId;
+    cursor = savedCursor;
+    while (std::getline(in, line)) {
+        stale[unescapePath(line)] = 0;
+    }
+    return true;
+}
+
+// Write the cursor and the stale marks to 'file', atomically. The marks of paths that are not
+// cached are kept too: a fetch of them may be on its way.
+bool ChangeSync::save() {
+    std::ostringstream out;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!dirty) {
+            return true;
+        }
+        dirty = false;
+        out << kHeader << '\n' << logId << ' ' << cursor << '\n';
+        for (const auto &entry : stale) {
+            out << escapePath(entry.first) << '\n';
+        }
+    }
+
+    const std::string tempFile = file + ".tmp";
+    std::ofstream saved(tempFile, std::ios::trunc);
+    saved << out.str();
+    saved.close();
+    if (!saved || rename(tempFile.c_str(), file.c_str()) != 0) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: Failed to save the change log cursor to %s\n", __func__, file.c_str());
+        }
+        remove(tempFile.c_str());
+        std::lock_guard<std::mutex> guard(lock);
+        dirty = true;
+        return false;
+    }
+    return true;
+}
+
+void ChangeSync::start() {
+    poller = new std::thread(&ChangeSync::run, this);
+}
+
+void ChangeSync::run() {
+    std::unique_lock<std::mutex> l(lock);
+    while (notDone) {
+        l.unlock();
+        if (!sync() && debugMode <= DebugLevel::LevelInfo) {
+            printf("%s \t: Change log not reachable, opens revalidate their files\n", __func__);
+        }
+        save();
+        l.lock();
+        wakeup.wait_for(l, std::chrono::milliseconds(pollMs), [&]() { return !notDone; });
+    }
+}
+
+// Fetch and apply the changes since 'cursor'. Returns false if the server could not be reached.
+bool ChangeSync::sync() {
+    struct timespec ts_start;
+    get_time(&ts_start);
+
+    bool more = true;
+    while (more) {
+        ChangesRequest request;
+        ChangesReply reply;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            request.set_log_id(logId);
+            request.set_cursor(cursor);
+        }
+        request.set_max_changes(batchMax);
+        if (client->rpc_changesSince(request, &reply, pollMs) != 0) {
+            return false;
+        }
+
+        if (reply.reset()) {
+            if (debugMode <= DebugLevel::LevelInfo) {
+                printf("%s \t: Change log reset, revalidating the whole cache\n", __func__);
+            }
+            {
+                // Fetches under way may have read their file before the changes lost
+                std::lock_guard<std::mutex> guard(lock);
+                floor = ++tickets;
+            }
+            markTree("");
+        }
+        for (const Change &change : reply.changes()) {
+            apply(change);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (logId != reply.log_id() || cursor != reply.cursor()) {
+            logId = reply.log_id();
+            cursor = reply.cursor();
+            dirty = true;
+        }
+        more = reply.more();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    synced = true;
+    lastSync = ts_start;
+    if (stale.size() > maxStale) {
+        floor = ++tickets;
+        for (auto it = stale.begin(); it != stale.end();) {
+            struct stat buffer;
+            if (lstat((cachedRoot + it->first).c_str(), &buffer) != 0) {
+                it = stale.erase(it);
+                dirty = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+    return true;
+}
+
+void ChangeSync::apply(const Change &change) {
+    const char *path = change.path().c_str();
+    struct stat local, remote;
+    bool cached = lstat((cachedRoot + path).c_str(), &local) == 0;
+    bool exists = change.stat().err() == 0;
+    AfsClient::toStat(change.stat(), &remote);
+
+    if (cached && S_ISDIR(local.st_mode)) {
+        // Cached directories hold no data. The files below one removed or renamed are stale.
+        if (!exists || !S_ISDIR(remote.st_mode)) {
+            markTree(change.path());
+        }
+        return;
+    }
+    if (cached && exists && local.st_mtim.tv_sec == remote.st_mtim.tv_sec &&
+        local.st_mtim.tv_nsec == remote.st_mtim.tv_nsec) {
+        return;
+    }
+    if (debugMode <= DebugLevel::LevelInfo) {
+        printf("%s \t: %s changed on the server\n", __func__, path);
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stale[change.path()] = ++tickets;
+        dirty = true;
+    }
+    invalidate(change.path());
+}
+
+// Mark the cached files below the client path 'path' as stale
+void ChangeSync::markTree(const std::string &path) {
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(cachedRoot + path, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        if (fs::is_regular_file(it->symlink_status(ec))) {
+            paths.push_back(it->path().string().substr(cachedRoot.size()));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const std::string &stalePath : paths) {
+            stale[stalePath] = ++tickets;
+        }
+        dirty = true;
+    }
+    for (const std::string &stalePath : paths) {
+        invalidate(stalePath);
+    }
+}
+
+bool ChangeSync::trusts(const char *path) {
+    struct timespec now;
+    get_time(&now);
+    std::lock_guard<std::mutex> guard(lock);
+    return synced && get_time_diff(&lastSync, &now) < maxStalenessMs &&
+           stale.find(path) == stale.end();
+}
+
+uint64_t ChangeSync::ticket() {
+    std::lock_guard<std::mutex> guard(lock);
+    return ++tickets;
+}
+
+// The cached copy of 'path' was fetched or found current by a request sent after 'ticket' was
+// taken
+void ChangeSync::validated(const char *path, uint64_t ticket) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (ticket < floor) {
+        stale[path] = ++tickets;
+        dirty = true;
+        return;
+    }
+    auto it = stale.find(path);
+    if (it != stale.end() && it->second < ticket) {
+        stale.erase(it);
+        dirty = true;
+    }
+}
+
+void ChangeSync::stop() {
+    std::thread *stopped;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        notDone = false;
+        stopped = poller;
+        poller = NULL;
+    }
+    wakeup.notify_all();
+    if (stopped != NULL) {
+        stopped->join();
+        delete stopped;
+    }
+    save();
+}
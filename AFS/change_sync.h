@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "AfsClient.h"
+
+// ChangeSync: Keeps the cache in step with the server's change log (afsfuse_changesSince), so an
+// open does not have to revalidate its cached copy with the server. A thread polls the log every
+// 'pollMs' and marks the paths changed since the last poll as stale, unless their cached
+// copy already has the server's modification time (the change was this client's own upload). The
+// cached copy of a path that is not stale is used without a round trip, as long as the last
+// successful poll started less than 'maxStalenessMs' ago; otherwise the open falls back
+// to NVERIFY, which also clears the mark.
+//
+// The cursor into the log and the stale marks of cached files are saved in 'file', so a
+// remount only revalidates the files that changed while it was away. If the log cannot tell what
+// changed (it was trimmed or replaced), every cached file is marked stale.
+//
+// A fetch or NVERIFY takes a ticket before sending its request and clears the mark of its path
+// afterwards, unless the path was marked again after the ticket was taken. Tickets taken before
+// 'floor' (the last reset or pruning of the marks) cannot vouch for their path and mark it instead.
+struct ChangeSync {
+    // Drop what the kernel caches of the client path 'path'
+    typedef void (*Invalidate)(const std::string &path);
+
+    AfsClient *client;
+    std::string cachedRoot;  // the cached copy of a path is at cachedRoot + path
+    Invalidate invalidate;
+    const int pollMs;
+    const int maxStalenessMs;
+    const unsigned int batchMax;  // changes per changesSince call
+    const size_t maxStale;  // stale marks kept before those of paths no longer cached are dropped
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::thread *poller;
+    bool notDone;
+
+    std::string file;
+    uint64_t logId;
+    uint64_t cursor;
+    bool dirty;  // the cursor or the marks changed since the last save
+
+    std::unordered_map<std::string, uint64_t> stale;  // path -> ticket it was marked at
+    uint64_t tickets;                            // last ticket handed out
+    uint64_t floor;
+    bool synced;
+    struct timespec lastSync;  // start of the last successful poll
+
+    ChangeSync(AfsClient *client, const std::string &file, const std::string &cachedRoot,
+               Invalidate invalidate, int pollMs, int maxStalenessMs, unsigned int batchMax,
+               size_t maxStale)
+        : client(client), cachedRoot(cachedRoot), invalidate(invalidate), pollMs(pollMs),
+          maxStalenessMs(maxStalenessMs), batchMax(batchMax), maxStale(maxStale), poller(NULL),
+          notDone(true), file(file), logId(0), cursor(0), dirty(false), tickets(0), floor(0),
+          synced(false) {}
+
+    ChangeSync(const ChangeSync &) = delete;
+    ChangeSync &operator=(const ChangeSync &) = delete;
+
+    bool load();
+
+    bool save();
+
+    void start();
+
+    void run();
+
+    bool sync();
+
+    void apply(const Change &change);
+
+    void markTree(const std::string &path);
+
+    bool trusts(const char *path);
+
+    uint64_t ticket();
+
+    void validated(const char *path, uint64_t ticket);
+
+    void stop();
+};
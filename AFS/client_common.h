@@ -0,0 +1,21 @@
+#pragma once
+
+#include <time.h>
+
+// Shared by afsfuse_client.cc and the client modules
+
+enum DebugLevel { LevelInfo = 0, LevelError = 1, LevelNone = 2 };
+
+const DebugLevel debugMode = LevelNone;
+
+inline void get_time(struct timespec *ts) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+// Milliseconds from 'before' to 'after'
+inline double get_time_diff(struct timespec *before, struct timespec *after) {
+    double delta_s = after->tv_sec - before->tv_sec;
+    double delta_ns = after->tv_nsec - before->tv_nsec;
+
+    return (delta_s + (delta_ns * 1e-9)) * ((double)1e3);
+}
@@ -0,0 +1,236 @@
+#include "delegation_table.h"
+
+#include <algorithm>
+
+namespace {
+
+    // Paths are kept the way clients send them, from the root and without a trailing '/'
+    std::string normalize(const std::string& path)
+    {
+        std::string normalized = (path.empty() || path[0] != '/') ? "/" + path : path;
+        while (normalized.size() > 1 && normalized.back() == '/') {
+            normalized.pop_back();
+        }
+        return normalized;
+    }
+
+    // Is 'path' equal to 'dir' or below it?
+    bool in_subtree(const std::string& path, const std::string& dir)
+    {
+        return dir == "/" ||
+               (path.compare(0, dir.size(), dir) == 0 &&
+                (path.size() == dir.size() || path[dir.size()] == '/'));
+    }
+
+};  // Anonymous namespace
+
+DelegationTable::DelegationTable(unsigned lease_ms, unsigned recall_timeout_ms)
+    : m_lease(lease_ms)
+    , m_recall_timeout(recall_timeout_ms)
+    , m_stopping(false)
+{
+    m_timer = std::thread(&DelegationTable::Expire, this);
+}
+
+DelegationTable::~DelegationTable()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_waiters_changed.notify_all();
+    m_timer.join();
+}
+
+void DelegationTable::Connect(const std::string& client)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_clients[client].streams++;
+}
+
+void DelegationTable::Disconnect(const std::string& client)
+{
+    std::vector<std::function<void()> > ready;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        auto it = m_clients.find(client);
+        if (it == m_clients.end() || --it->second.streams > 0) {
+            return;
+        }
+        m_clients.erase(it);
+        for (auto delegation = m_delegations.begin(); delegation != m_delegations.end();) {
+            if (delegation->second.holder == client) {
+                delegation = m_delegations.erase(delegation);
+            } else {
+                ++delegation;
+            }
+        }
+        m_returned.notify_all();
+        Resume(ready);
+    }
+    for (auto& done : ready) {
+        done();
+    }
+}
+
+bool DelegationTable::Grant(const std::string& client, const std::string& path, bool& renewed)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto connected = m_clients.find(client);
+    if (connected == m_clients.end() || connected->second.streams == 0) {
+        return false;
+    }
+
+    Clock::time_point now = Clock::now();
+    auto it = m_delegations.find(normalize(path));
+    renewed = false;
+    if (it != m_delegations.end() && it->second.expires > now) {
+        if (it->second.holder != client || it->second.recalled) {
+            return false;
+        }
+        renewed = true;
+    }
+    m_delegations[normalize(path)] = Delegation{client, now + m_lease, false};
+    return true;
+}
+
+void DelegationTable::Return(const std::string& client, const std::string& path)
+{
+    std::vector<std::function<void()> > ready;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        auto it = m_delegations.find(normalize(path));
+        if (it != m_delegations.end() && it->second.holder == client) {
+            m_delegations.erase(it);
+            m_returned.notify_all();
+            Resume(ready);
+        }
+    }
+    for (auto& done : ready) {
+        done();
+    }
+}
+
+bool DelegationTable::Outstanding(const std::string& client, const std::string& subtree,
+                                  Clock::time_point deadline)
+{
+    Clock::time_point now = Clock::now();
+    bool waiting = false;
+    auto it = (subtree == "/") ? m_delegations.begin() : m_delegations.lower_bound(subtree);
+    while (it != m_delegations.end() && it->first.compare(0, subtree.size(), subtree) == 0) {
+        Delegation& delegation = it->second;
+        if (!in_subtree(it->first, subtree) || delegation.holder == client) {
+            ++it;
+            continue;
+        }
+        if (delegation.expires <= now || now >= deadline) {
+            // Expired, or the holder did not answer in time
+            it = m_delegations.erase(it);
+            m_returned.notify_all();
+            continue;
+        }
+        if (!delegation.recalled) {
+            delegation.recalled = true;
+            Client& holder = m_clients[delegation.holder];
+            holder.recalls.push_back(it->first);
+            holder.recalled.notify_all();
+        }
+        waiting = true;
+        ++it;
+    }
+    return waiting;
+}
+
+void DelegationTable::Recall(const std::string& client, const std::string& path)
+{
+    std::unique_lock<std::mutex> l(m_lock);
+    if (m_delegations.empty()) {
+        return;
+    }
+
+    const std::string subtree = normalize(path);
+    const Clock::time_point deadline = Clock::now() + m_recall_timeout;
+    while (Outstanding(client, subtree, deadline)) {
+        m_returned.wait_until(l, deadline);
+    }
+}
+
+void DelegationTable::Recall(const std::string& client, const std::vector<std::string>& paths,
+                             std::function<void()> done)
+{
+    std::unique_lock<std::mutex> l(m_lock);
+    if (!m_delegations.empty()) {
+        Waiter waiter{client, {}, Clock::now() + m_recall_timeout, nullptr};
+        bool waiting = false;
+        for (const std::string& path : paths) {
+            waiter.subtrees.push_back(normalize(path));
+            // All of them, so the holders are all told at once
+            waiting = Outstanding(client, waiter.subtrees.back(), waiter.deadline) || waiting;
+        }
+        if (waiting) {
+            waiter.done = std::move(done);
+            m_waiters.push_back(std::move(waiter));
+            m_waiters_changed.notify_all();
+            return;
+        }
+    }
+    l.unlock();
+    done();
+}
+
+void DelegationTable::Resume(std::vector<std::function<void()> >& ready)
+{
+    // A delegation revoked for one waiter may be all another one waits for
+    size_t delegations;
+    do {
+        delegations = m_delegations.size();
+        for (auto it = m_waiters.begin(); it != m_waiters.end();) {
+            bool waiting = false;
+            for (const std::string& subtree : it->subtrees) {
+                waiting = Outstanding(it->client, subtree, it->deadline) || waiting;
+            }
+            if (waiting) {
+                ++it;
+            } else {
+                ready.push_back(std::move(it->done));
+                it = m_waiters.erase(it);
+            }
+        }
+    } while (m_delegations.size() != delegations && !m_waiters.empty());
+}
+
+void DelegationTable::Expire()
+{
+    std::unique_lock<std::mutex> l(m_lock);
+    while (!m_stopping) {
+        if (m_waiters.empty()) {
+            m_waiters_changed.wait(l);
+            continue;
+        }
+        Clock::time_point next = m_waiters.front().deadline;
+        for (const Waiter& waiter : m_waiters) {
+            next = std::min(next, waiter.deadline);
+        }
+        m_waiters_changed.wait_until(l, next);
+
+        std::vector<std::function<void()> > ready;
+        Resume(ready);
+        l.unlock();
+        for (auto& done : ready) {
+            done();
+        }
+        l.lock();
+    }
+}
+
+bool DelegationTable::WaitRecalls(const std::string& client, std::vector<std::string>& paths,
+                                  unsigned timeout_ms)
+{
+    std::unique_lock<std::mutex> l(m_lock);
+    Client& state = m_clients[client];
+    state.recalled.wait_for(l, std::chrono::milliseconds(timeout_ms),
+                            [&]() { return !state.recalls.empty(); });
+    paths.clear();
+    paths.swap(state.recalls);
+    return !paths.empty();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// DelegationTable: The write delegations granted to clients, keyed by the client path of the file.
+// A client holding the delegation of a file may work on its cached copy without asking the server
+// and upload it later. Before another client accesses the file, the server recalls the delegation:
+// the holder is told through its recall stream (see WaitRecalls()) and the access waits until the
+// holder has uploaded the file and returned the delegation, or until 'recall_timeout_ms' have
+// passed, after which the delegation is revoked.
+//
+// Delegations are only granted to clients with a recall stream open, and expire after 'lease_ms'
+// unless renewed. When the last recall stream of a client ends, its delegations are dropped.
+//
+// Callback handlers and reactors must not wait for a recall: the holder uploads through the same
+// threads. They use the form of Recall() that calls them back instead, the table's timer thread
+// ends the recalls that time out.
+class DelegationTable {
+public:
+    DelegationTable(unsigned lease_ms = 30000, unsigned recall_timeout_ms = 2000);
+    ~DelegationTable();
+
+    DelegationTable(const DelegationTable&) = delete;
+    DelegationTable& operator=(const DelegationTable&) = delete;
+
+    unsigned LeaseMs() const
+    {
+        return m_lease.count();
+    }
+
+    // A recall stream of 'client' opened or ended.
+    void Connect(const std::string& client);
+    void Disconnect(const std::string& client);
+
+    // Grant the delegation of 'path' to 'client', or renew it. Returns false if another client
+    // holds it or it is being recalled. 'renewed' tells whether 'client' held it already.
+    bool Grant(const std::string& client, const std::string& path, bool& renewed);
+
+    void Return(const std::string& client, const std::string& path);
+
+    // Called before 'client' accesses 'path': recall the delegations other clients hold on 'path'
+    // or anything below it, and wait until they are returned or revoked.
+    void Recall(const std::string& client, const std::string& path);
+
+    // Same for all of 'paths', without waiting: 'done' is called once the delegations are returned
+    // or revoked. That is right away from this call if there are none, otherwise from the Return()
+    // or Disconnect() of the last of them or from the timer thread.
+    void Recall(const std::string& client, const std::vector<std::string>& paths,
+                std::function<void()> done);
+
+    // Wait up to 'timeout_ms' for recalls of delegations held by 'client'. Returns false if none
+    // came, otherwise their paths are in 'paths'.
+    bool WaitRecalls(const std::string& client, std::vector<std::string>& paths, unsigned timeout_ms);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Delegation {
+        std::string holder;
+        Clock::time_point expires;
+        bool recalled;
+    };
+
+    struct Client {
+        int streams = 0;
+        std::vector<std::string> recalls;  // Not picked up by WaitRecalls() yet
+        std::condition_variable recalled;
+    };
+
+    // A call of the non-blocking Recall()
+    struct Waiter {
+        std::string client;
+        std::vector<std::string> subtrees;
+        Clock::time_point deadline;
+        std::function<void()> done;
+    };
+
+    // Recall the delegations other clients than 'client' hold in 'subtree', revoking them from
+    // 'deadline' on. Returns whether any is still to be waited for. Called with m_lock held.
+    bool Outstanding(const std::string& client, const std::string& subtree, Clock::time_point deadline);
+
+    // Move the callbacks of the waiters whose recalls are over to 'ready', to be called once
+    // m_lock is released. Called with m_lock held.
+    void Resume(std::vector<std::function<void()> >& ready);
+
+    // The timer thread
+    void Expire();
+
+    const std::chrono::milliseconds m_lease;
+    const std::chrono::milliseconds m_recall_timeout;
+
+    std::mutex m_lock;
+    std::condition_variable m_returned;
+    std::map<std::string, Delegation> m_delegations;  // Ordered, so a subtree is a range
+    std::unordered_map<std::string, Client> m_clients;
+    std::list<Waiter> m_waiters;
+    std::condition_variable m_waiters_changed;
+    bool m_stopping;
+    std::thread m_timer;
+};
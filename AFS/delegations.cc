@@ -0,0 +1,205 @@
+#include <stdio.h>
+
+#include <vector>
+
+#include "client_common.h"
+#include "delegations.h"
+
+void Delegations::start() {
+    listener = new std::thread(&Delegations::listen, this);
+    manager = new std::thread(&Delegations::manage, this);
+}
+
+void Delegations::listen() {
+    std::unique_lock<std::mutex> l(lock);
+    while (notDone) {
+        stream.reset(new ClientContext());
+        ClientContext *context = stream.get();
+        l.unlock();
+        client->rpc_recalls(context, [this](const Recall &recall) {
+            if (recall.path().empty()) {
+                std::lock_guard<std::mutex> guard(lock);
+                connected = true;
+                return;
+            }
+            if (debugMode <= DebugLevel::LevelInfo) {
+                printf("%s \t: Delegation of %s recalled\n", __func__, recall.path().c_str());
+            }
+            giveUp(recall.path(), true, true);
+        });
+        l.lock();
+        connected = false;
+        l.unlock();
+        // The server dropped the delegations of this client with the stream
+        giveUpAll();
+        l.lock();
+        wakeup.wait_for(l, std::chrono::seconds(1), [&]() { return !notDone; });
+    }
+}
+
+void Delegations::manage() {
+    std::unique_lock<std::mutex> l(lock);
+    while (notDone) {
+        wakeup.wait_for(l, std::chrono::milliseconds(checkMs),
+                        [&]() { return !notDone || !requested.empty(); });
+        if (!notDone) {
+            break;
+        }
+
+        Clock::time_point now = Clock::now();
+        std::vector<std::string> ask(requested.begin(), requested.end());
+        std::vector<std::string> writeBack, lapsed;
+        requested.clear();
+        for (auto &entry : held) {
+            Held &delegation = entry.second;
+            if (delegation.dirty &&
+                now - delegation.dirtySince >= std::chrono::milliseconds(writebackMs)) {
+                delegation.dirty = false;
+                writeBack.push_back(entry.first);
+            }
+            if (now - delegation.renewed >= (delegation.expires - delegation.renewed) / 2) {
+                (delegation.used ? ask : lapsed).push_back(entry.first);
+            }
+        }
+        asking.insert(ask.begin(), ask.end());
+        l.unlock();
+
+        for (const std::string &path : writeBack) {
+            if (!upload(path)) {
+                // Tried again after another writeback window, while the delegation is held
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = held.find(path);
+                if (it != held.end() && !it->second.dirty) {
+                    it->second.dirty = true;
+                    it->second.dirtySince = Clock::now();
+                }
+            }
+        }
+        for (const std::string &path : lapsed) {
+            giveUp(path, true);
+        }
+        for (const std::string &path : ask) {
+            Clock::time_point asked = Clock::now();
+            bool granted = false;
+            unsigned lease_ms = 0;
+            int res = client->rpc_delegate(path, &granted, &lease_ms);
+
+            std::unique_lock<std::mutex> guard(lock);
+            asking.erase(path);
+            // A recall that overtook the reply was answered with a return already
+            bool refused = res != 0 || !granted || recalled.erase(path) > 0 || !connected;
+            auto it = held.find(path);
+            if (!refused) {
+                Held &delegation = (it == held.end()) ? held[path] : it->second;
+                delegation.expires = asked + std::chrono::milliseconds(lease_ms);
+                delegation.renewed = asked;
+                delegation.used = false;
+            } else if (it != held.end()) {
+                guard.unlock();
+                giveUp(path, true);
+            }
+        }
+        l.lock();
+    }
+}
+
+// Whether this client holds the delegation of 'path', with enough of its lease left to use it
+bool Delegations::holds(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = held.find(path);
+    if (!connected || it == held.end() ||
+        Clock::now() + std::chrono::milliseconds(checkMs) >= it->second.expires) {
+        return false;
+    }
+    it->second.used = true;
+    return true;
+}
+
+void Delegations::request(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (connected && held.count(path) == 0) {
+        requested.insert(path);
+        wakeup.notify_all();
+    }
+}
+
+// Leave the upload of the dirty cached copy of 'path' to the delegation. Returns false if it is
+// not held anymore, the caller has to upload the file itself.
+bool Delegations::defer(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = held.find(path);
+    if (!connected || it == held.end()) {
+        return false;
+    }
+    Held &delegation = it->second;
+    if (!delegation.dirty) {
+        delegation.dirty = true;
+        delegation.dirtySince = Clock::now();
+    }
+    delegation.used = true;
+    return true;
+}
+
+// Returns whether the cached copy reached the server. Its recovery file stays until it does.
+bool Delegations::upload(const std::string &path) {
+    std::lock_guard<std::mutex> guard(uploads);
+    return uploadFile(path.c_str());
+}
+
+// Stop using the delegation of 'path' and return it, after uploading the deferred writes if
+// 'send'. A recall is answered even if the delegation is not held (anymore).
+void Delegations::giveUp(const std::string &path, bool send, bool recall) {
+    bool dirty = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = held.find(path);
+        if (it != held.end()) {
+            dirty = it->second.dirty;
+            held.erase(it);
+        } else if (!recall) {
+            return;
+        } else if (asking.count(path) != 0) {
+            recalled.insert(path);
+        }
+    }
+    if (dirty && send && !upload(path) && debugMode <= DebugLevel::LevelError) {
+        printf("%s \t: Returning the delegation of %s without its writes, they are sent again"
+               " at the next start\n", __func__, path.c_str());
+    }
+    client->rpc_returnDelegation(path);
+}
+
+void Delegations::giveUpAll() {
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &entry : held) {
+            paths.push_back(entry.first);
+        }
+    }
+    for (const std::string &path : paths) {
+        giveUp(path, true);
+    }
+}
+
+void Delegations::stop() {
+    std::thread *stoppedListener, *stoppedManager;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        notDone = false;
+        if (stream) {
+            stream->TryCancel();
+        }
+        stoppedListener = listener;
+        stoppedManager = manager;
+        listener = manager = NULL;
+    }
+    wakeup.notify_all();
+    for (std::thread *t : {stoppedListener, stoppedManager}) {
+        if (t != NULL) {
+            t->join();
+            delete t;
+        }
+    }
+    giveUpAll();
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "AfsClient.h"
+
+// Delegations: Write delegations (afsfuse_delegate). Once this client has uploaded a file it
+// wrote, it asks for the file's delegation. While it holds it, the server recalls it before any
+// other client gets at the file, so opens use the cached copy without asking the server and closes
+// of dirty copies upload nothing: the upload waits until the delegation is recalled or given up,
+// and at most 'writebackMs'. Giving up a delegation uploads the file before returning it.
+//
+// A manager thread, woken every 'checkMs', asks for the delegations requested by closes, renews
+// those used within half their lease and gives up the others. Recalls arrive over a stream
+// (afsfuse_recalls) kept open by a listener thread. When the stream ends the server drops the
+// delegations of this client, so they are all given up.
+struct Delegations {
+    typedef std::chrono::steady_clock Clock;
+
+    // Send the cached copy of 'path' to the server. Returns whether the upload succeeded.
+    typedef bool (*Upload)(const char *path);
+
+    struct Held {
+        Clock::time_point expires;
+        Clock::time_point renewed;  // last grant or renewal
+        bool used = false;          // opened or closed since then
+        bool dirty = false;         // closed dirty and not uploaded yet
+        Clock::time_point dirtySince;
+    };
+
+    AfsClient *client;
+    Upload uploadFile;
+    const int writebackMs;
+    const int checkMs;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::mutex uploads;  // one upload at a time, so versions of a file reach the server in order
+    std::thread *listener;
+    std::thread *manager;
+    std::unique_ptr<ClientContext> stream;  // of the recall stream, to cancel it
+    bool connected;                         // the server registered the recall stream
+    bool notDone;
+
+    std::unordered_map<std::string, Held> held;
+    std::unordered_set<std::string> requested;
+    std::unordered_set<std::string> asking;    // delegate calls on their way
+    std::unordered_set<std::string> recalled;  // recalled while being asked for
+
+    Delegations(AfsClient *client, Upload uploadFile, int writebackMs, int checkMs)
+        : client(client), uploadFile(uploadFile), writebackMs(writebackMs), checkMs(checkMs),
+          listener(NULL), manager(NULL), connected(false), notDone(true) {}
+
+    Delegations(const Delegations &) = delete;
+    Delegations &operator=(const Delegations &) = delete;
+
+    void start();
+
+    void listen();
+
+    void manage();
+
+    bool holds(const char *path);
+
+    void request(const char *path);
+
+    bool defer(const char *path);
+
+    bool upload(const std::string &path);
+
+    void giveUp(const std::string &path, bool send, bool recall = false);
+
+    void giveUpAll();
+
+    void stop();
+};
@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "direct_stream.h"
+
+DirectStream::DirectStream(AfsClient *client, const char *path, const struct stat &attributes,
+                           size_t chunkSize, int maxWindow, int chunkTimeoutMs)
+    : client(client), chunkSize(chunkSize), maxWindow(maxWindow), chunkTimeoutMs(chunkTimeoutMs),
+      path(path), attributes(attributes), nextRead(0), window(1) {}
+
+DirectStream::~DirectStream() {
+    std::unique_lock<std::mutex> l(lock);
+    while (!chunks.empty()) {
+        retireFront(l);
+    }
+    for (Chunk *chunk : spare) {
+        delete chunk;
+    }
+}
+
+// Drop the first chunk, cancelling it if it is still in flight. Called with 'l' held.
+void DirectStream::retireFront(std::unique_lock<std::mutex> &l) {
+    Chunk *chunk = chunks.front();
+    chunks.pop_front();
+    if (!chunk->done) {
+        chunk->context->TryCancel();
+        finished.wait(l, [&]() { return chunk->done; });
+    }
+    chunk->reply.Clear();
+    spare.push_back(chunk);
+}
+
+int DirectStream::read(char *buf, size_t size, off_t offset) {
+    if (offset >= attributes.st_size) {
+        return 0;
+    }
+    size = std::min(size, (size_t)(attributes.st_size - offset));
+    const off_t first = offset / chunkSize * chunkSize;
+    const off_t last = (offset + size - 1) / chunkSize * chunkSize;
+
+    std::lock_guard<std::mutex> serialized(reading);
+    std::unique_lock<std::mutex> l(lock);
+    bool sequential = offset == nextRead;
+    nextRead = offset + size;
+    if (!sequential) {
+        window = 1;
+    }
+    while (!chunks.empty() && chunks.front()->offset < first) {
+        retireFront(l);
+        if (sequential) {
+            window = std::min(2 * window, maxWindow);
+        }
+    }
+    if (!chunks.empty() && chunks.front()->offset != first) {
+        // A seek past the chunks fetched ahead
+        while (!chunks.empty()) {
+            retireFront(l);
+        }
+    }
+
+    // Request what the read needs and the window after it
+    std::vector<Chunk *> issued;
+    off_t next = chunks.empty() ? first : chunks.back()->offset + chunkSize;
+    for (; next <= last + (window - 1) * chunkSize && next < attributes.st_size; next += chunkSize) {
+        Chunk *chunk;
+        if (!spare.empty()) {
+            chunk = spare.back();
+            spare.pop_back();
+        } else {
+            chunk = new Chunk();
+        }
+        chunk->offset = next;
+        chunk->request.set_path(path);
+        chunk->request.set_offset(next);
+        chunk->request.set_size(chunkSize);
+        chunk->context.reset(new ClientContext());
+        chunk->context->set_deadline(std::chrono::system_clock::now() +
+                                     std::chrono::milliseconds(chunkTimeoutMs));
+        chunk->done = false;
+        chunks.push_back(chunk);
+        issued.push_back(chunk);
+    }
+    l.unlock();
+    for (Chunk *chunk : issued) {
+        client->rpc_readAsync(chunk->context.get(), &chunk->request, &chunk->reply,
+                              [this, chunk](Status status) {
+                                  std::lock_guard<std::mutex> guard(lock);
+                                  chunk->ok = status.ok() && chunk->reply.err() == 0;
+                                  chunk->done = true;
+                                  finished.notify_all();
+                              });
+    }
+    l.lock();
+
+    size_t copied = 0;
+    for (Chunk *chunk : chunks) {
+        if (copied == size || chunk->offset > last) {
+            break;
+        }
+        finished.wait(l, [&]() { return chunk->done; });
+        if (!chunk->ok) {
+            // The plain call retries, and reports the error of the server. The completions of
+            // the other chunks must not wait for it: the chunks stay put, as 'reading' is held.
+            l.unlock();
+            int res = client->rpc_read(path.c_str(), buf + copied, size - copied,
+                                       offset + copied, NULL);
+            l.lock();
+            return res < 0 ? res : copied + res;
+        }
+        const std::string &data = chunk->reply.buffer();
+        size_t from = offset + copied - chunk->offset;
+        if (from >= data.size()) {
+            break;  // the file is shorter than at the open
+        }
+        size_t n = std::min(data.size() - from, size - copied);
+        memcpy(buf + copied, data.data() + from, n);
+        copied += n;
+    }
+    return copied;
+}
+
+uint64_t DirectHandles::add(DirectStream *stream) {
+    std::lock_guard<std::mutex> guard(lock);
+    streams[next] = stream;
+    return next++;
+}
+
+DirectStream *DirectHandles::find(uint64_t fh) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = streams.find(fh);
+    return it != streams.end() ? it->second : NULL;
+}
+
+DirectStream *DirectHandles::take(uint64_t fh) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = streams.find(fh);
+    if (it == streams.end()) {
+        return NULL;
+    }
+    DirectStream *stream = it->second;
+    streams.erase(it);
+    return stream;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AfsClient.h"
+
+// DirectStream: A file read in direct mode: straight from the server, without the local cache, for
+// big files read once. Reads are served from chunks of 'chunkSize' bytes requested ahead of them.
+// While the reads are sequential, every chunk they finish doubles the window of chunks in flight,
+// up to 'maxWindow'; a seek takes it back to one. A chunk not read within 'chunkTimeoutMs' is read
+// again with the retrying call. The replies of chunks that were read are reused for the next ones,
+// so their buffers are allocated once per stream.
+struct DirectStream {
+    struct Chunk {
+        off_t offset;
+        ReadRequest request;
+        ReadResult reply;
+        std::unique_ptr<ClientContext> context;
+        bool done;
+        bool ok;
+    };
+
+    AfsClient *client;
+    const off_t chunkSize;
+    const int maxWindow;
+    const int chunkTimeoutMs;
+
+    std::string path;
+    struct stat attributes;  // at the open
+
+    std::mutex reading;  // one read at a time, each works through the chunks in order
+    std::mutex lock;
+    std::condition_variable finished;
+    std::deque<Chunk *> chunks;  // consecutive, in file order
+    std::vector<Chunk *> spare;
+    off_t nextRead;  // where a sequential read starts
+    int window;
+
+    DirectStream(AfsClient *client, const char *path, const struct stat &attributes,
+                 size_t chunkSize, int maxWindow, int chunkTimeoutMs);
+
+    DirectStream(const DirectStream &) = delete;
+    DirectStream &operator=(const DirectStream &) = delete;
+
+    ~DirectStream();
+
+    int read(char *buf, size_t size, off_t offset);
+
+   private:
+    void retireFront(std::unique_lock<std::mutex> &l);
+};
+
+// The streams of the handles opened in direct mode. Their fi->fh are numbers from
+// directHandleBase up, which descriptors do not reach.
+const uint64_t directHandleBase = (uint64_t)1 << 62;
+
+struct DirectHandles {
+    std::mutex lock;
+    std::unordered_map<uint64_t, DirectStream *> streams;
+    uint64_t next = directHandleBase;
+
+    uint64_t add(DirectStream *stream);
+
+    DirectStream *find(uint64_t fh);
+
+    // The stream of 'fh', which is no longer found
+    DirectStream *take(uint64_t fh);
+};
@@ -18,20 +18,36 @@ public:
     {
     }
 
+    FileReaderIntoStream(int dirfd, const std::string& name, const std::string& filename, StreamWriter& writer)
+        : SequentialFileReader(dirfd, name, filename)
+        , m_writer(writer)
+    {
+    }
+
     using SequentialFileReader::SequentialFileReader;
     using SequentialFileReader::operator=;
 
 protected:
-    virtual void OnChunkAvailable(const void* data, size_t size) override
+    virtual void OnChunkAvailable(const void* data, size_t size, std::uint64_t offset) override
     {
-        const std::string remote_filename = GetFilePath();
-        // std::cout << __func__ << " \t : Filename = " << GetFilePath() << " and remote_filename = " << remote_filename << std::endl;
-        auto fc = MakeFileContent(GetFilePath(), data, size);
-        if (! m_writer.Write(fc)) {
+        // std::cout << __func__ << " \t : Filename = " << GetFilePath() << std::endl;
+        // One message is reused for every chunk: the name is set once and the content
+        // buffer keeps its capacity, so steady-state chunks do not allocate.
+        if (m_content.name().empty()) {
+            m_content.set_name(GetFilePath());
+        }
+        if (IsSparse()) {
+            m_content.set_sparse(true);
+            m_content.set_offset(offset);
+            m_content.set_file_size(GetFileSize());
+        }
+        m_content.set_content(data, size);
+        if (! m_writer.Write(m_content)) {
             raise_from_system_error_code("The server aborted the connection.", ECONNRESET);
         }
     }
 
 private:
     StreamWriter& m_writer;
+    afsfuse::FileContent m_content;
 };
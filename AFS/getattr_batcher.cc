@@ -0,0 +1,56 @@
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "getattr_batcher.h"
+
+int GetattrBatcher::getattr(const char *path, struct stat *output) {
+    std::unique_lock<std::mutex> l(lock);
+    std::shared_ptr<Batch> batch = open;
+    bool leader = batch == NULL;
+    if (leader) {
+        batch = std::make_shared<Batch>();
+        open = batch;
+    }
+    size_t index = std::find(batch->paths.begin(), batch->paths.end(), path) - batch->paths.begin();
+    if (index == batch->paths.size()) {
+        batch->paths.push_back(path);
+    }
+    if (batch->paths.size() >= maxPaths && open == batch) {
+        open.reset();  // full, let its leader send it now
+        changed.notify_all();
+    }
+
+    if (leader) {
+        if (inFlight > 0) {
+            changed.wait_for(l, std::chrono::microseconds(windowUs),
+                             [&]() { return open != batch; });
+        }
+        if (open == batch) {
+            open.reset();
+        }
+        inFlight++;
+        l.unlock();
+        // Nobody adds to the batch once it is no longer open
+        int res = client->rpc_getattrBatch(batch->paths, &batch->results);
+        l.lock();
+        inFlight--;
+        batch->res = res;
+        batch->done = true;
+        changed.notify_all();
+    } else {
+        changed.wait(l, [&]() { return batch->done; });
+    }
+
+    memset(output, 0, sizeof(struct stat));
+    if (batch->res != 0) {
+        return batch->res;
+    }
+    const Stat &result = batch->results.stats(index);
+    if (result.err() != 0) {
+        return -result.err();
+    }
+    AfsClient::toStat(result, output);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "AfsClient.h"
+
+// GetattrBatcher: Merges the getattr calls made concurrently by FUSE threads into getattrBatch
+// calls. The first caller of a batch sends it. If no other batch is on its way it does so at once,
+// so a lone caller pays no extra latency; otherwise it waits up to 'windowUs' for the calls
+// arriving meanwhile. Calls for the same path within a batch share one entry, and a batch holds
+// at most 'maxPaths' paths.
+struct GetattrBatcher {
+    struct Batch {
+        std::vector<std::string> paths;
+        Stats results;
+        int res = 0;
+        bool done = false;
+    };
+
+    AfsClient *client;
+    const int windowUs;
+    const size_t maxPaths;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::shared_ptr<Batch> open;  // the batch new calls join, if any
+    int inFlight;                 // batches sent and not answered yet
+
+    GetattrBatcher(AfsClient *client, int windowUs, size_t maxPaths)
+        : client(client), windowUs(windowUs), maxPaths(maxPaths), inFlight(0) {}
+
+    GetattrBatcher(const GetattrBatcher &) = delete;
+    GetattrBatcher &operator=(const GetattrBatcher &) = delete;
+
+    int getattr(const char *path, struct stat *output);
+};
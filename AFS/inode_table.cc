@@ -0,0 +1,95 @@
+#include <vector>
+
+#include "inode_table.h"
+
+InodeTable::InodeTable() : next(FUSE_ROOT_ID + 1) {
+    nodes[FUSE_ROOT_ID] = Node{"/", 1};
+    inodes["/"] = FUSE_ROOT_ID;
+}
+
+bool InodeTable::path(fuse_ino_t ino, std::string *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = nodes.find(ino);
+    if (it == nodes.end()) {
+        return false;
+    }
+    *path = it->second.path;
+    return true;
+}
+
+bool InodeTable::child(fuse_ino_t parent, const char *name, std::string *path) {
+    if (!this->path(parent, path)) {
+        return false;
+    }
+    if (path->back() != '/') {
+        *path += '/';
+    }
+    *path += name;
+    return true;
+}
+
+bool InodeTable::find(const std::string &path, fuse_ino_t *ino) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = inodes.find(path);
+    if (it == inodes.end()) {
+        return false;
+    }
+    *ino = it->second;
+    return true;
+}
+
+fuse_ino_t InodeTable::remember(const std::string &path) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = inodes.find(path);
+    fuse_ino_t ino;
+    if (it != inodes.end()) {
+        ino = it->second;
+    } else {
+        ino = next++;
+        inodes[path] = ino;
+        nodes[ino] = Node{path, 0};
+    }
+    nodes[ino].nlookup++;
+    return ino;
+}
+
+void InodeTable::forget(fuse_ino_t ino, uint64_t nlookup) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = nodes.find(ino);
+    if (it == nodes.end() || ino == FUSE_ROOT_ID) {
+        return;
+    }
+    if (it->second.nlookup > nlookup) {
+        it->second.nlookup -= nlookup;
+        return;
+    }
+    auto named = inodes.find(it->second.path);
+    if (named != inodes.end() && named->second == ino) {
+        inodes.erase(named);
+    }
+    nodes.erase(it);
+}
+
+void InodeTable::removed(const std::string &path) {
+    std::lock_guard<std::mutex> guard(lock);
+    inodes.erase(path);
+}
+
+void InodeTable::renamed(const std::string &from, const std::string &to) {
+    std::lock_guard<std::mutex> guard(lock);
+    inodes.erase(to);
+    const std::string prefix = from + "/";
+    std::vector<std::pair<std::string, fuse_ino_t>> moved;
+    for (auto it = inodes.begin(); it != inodes.end();) {
+        if (it->first == from || it->first.compare(0, prefix.size(), prefix) == 0) {
+            moved.emplace_back(to + it->first.substr(from.size()), it->second);
+            it = inodes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto &node : moved) {
+        inodes[node.first] = node.second;
+        nodes[node.second].path = node.first;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+
+#include <fuse_lowlevel.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// InodeTable: The inodes handed to the kernel in the low-level mode (--lowlevel). The server knows
+// files by their path only, so a node stands for the path it was looked up at. It lives until the
+// kernel has forgotten every lookup that returned it: a removed node keeps its last path until
+// then, and a rename moves the nodes at and below the old path.
+class InodeTable {
+    struct Node {
+        std::string path;
+        uint64_t nlookup;
+    };
+
+    std::mutex lock;
+    std::unordered_map<fuse_ino_t, Node> nodes;
+    std::unordered_map<std::string, fuse_ino_t> inodes;  // of the paths that still exist
+    fuse_ino_t next;
+
+   public:
+    InodeTable();
+
+    InodeTable(const InodeTable &) = delete;
+    InodeTable &operator=(const InodeTable &) = delete;
+
+    // The path of 'ino', false if the kernel forgot it
+    bool path(fuse_ino_t ino, std::string *path);
+
+    bool child(fuse_ino_t parent, const char *name, std::string *path);
+
+    // The inode the kernel knows 'path' by, false if it has none
+    bool find(const std::string &path, fuse_ino_t *ino);
+
+    // The inode of 'path' for a lookup that returns it, counted until forgotten
+    fuse_ino_t remember(const std::string &path);
+
+    void forget(fuse_ino_t ino, uint64_t nlookup);
+
+    // A file created at 'path' afterwards gets a new inode
+    void removed(const std::string &path);
+
+    void renamed(const std::string &from, const std::string &to);
+};
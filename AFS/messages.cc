@@ -1,9 +1,22 @@
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
 #include "messages.h"
 
-afsfuse::File MakeFile(std::string path)
+const char* const kRawGetFileMethod = "/afsfuse.AFSRaw/afsfuse_getFile";
+const char* const kRawPutFileMethod = "/afsfuse.AFSRaw/afsfuse_putFile";
+const char* const kClientIdKey = "afs-client-id";
+
+afsfuse::File MakeFile(std::string path, bool sparse)
 {
     afsfuse::File file;
     file.set_path(path);
+    file.set_sparse(sparse);
     return file;
 }
 
@@ -14,3 +27,190 @@ afsfuse::FileContent MakeFileContent(std::string name, const void* data, size_t
     fc.set_content(data, data_len);
     return fc;
 }
+
+grpc::ByteBuffer MakeRawMessage(const google::protobuf::Message& message)
+{
+    std::string serialized = message.SerializeAsString();
+    grpc::Slice slice(serialized);
+    return grpc::ByteBuffer(&slice, 1);
+}
+
+bool ParseRawMessage(grpc::ByteBuffer& buffer, google::protobuf::Message* message)
+{
+    std::vector<grpc::Slice> slices;
+    if (!buffer.Dump(&slices).ok()) {
+        return false;
+    }
+    std::string serialized;
+    for (const auto& slice : slices) {
+        serialized.append(reinterpret_cast<const char*>(slice.begin()), slice.size());
+    }
+    return message->ParseFromString(serialized);
+}
+
+namespace {
+
+    void release_mapping(void* user_data)
+    {
+        delete static_cast<std::shared_ptr<const std::uint8_t>*>(user_data);
+    }
+
+};  // Anonymous namespace
+
+grpc::ByteBuffer MakeRawChunk(const std::shared_ptr<const std::uint8_t>& mapping, size_t offset, size_t len)
+{
+    if (len == 0) {
+        return grpc::ByteBuffer();
+    }
+    auto* const reference = new std::shared_ptr<const std::uint8_t>(mapping);
+    grpc::Slice slice(const_cast<std::uint8_t*>(mapping.get() + offset), len, release_mapping, reference);
+    return grpc::ByteBuffer(&slice, 1);
+}
+
+ssize_t WriteRawChunk(int fd, const grpc::ByteBuffer& buffer)
+{
+    // Dump() only takes references on the received slices, the data itself is not copied.
+    std::vector<grpc::Slice> slices;
+    if (!buffer.Dump(&slices).ok()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::vector<struct iovec> iov;
+    iov.reserve(slices.size());
+    for (const auto& slice : slices) {
+        if (slice.size() > 0) {
+            iov.push_back({const_cast<std::uint8_t*>(slice.begin()), slice.size()});
+        }
+    }
+
+    ssize_t total = 0;
+    size_t first = 0;
+    while (first < iov.size()) {
+        const int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t written = writev(fd, &iov[first], count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += written;
+        // Skip fully written vectors and trim a partially written one
+        while (first < iov.size() && static_cast<size_t>(written) >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            ++first;
+        }
+        if (written > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    return total;
+}
+
+RawFileSender::RawFileSender(std::shared_ptr<const std::uint8_t> mapping, std::uint64_t size,
+                             std::vector<FileExtent> extents, bool sparse, size_t chunk_size)
+    : m_mapping(std::move(mapping))
+    , m_size(size)
+    , m_extents(std::move(extents))
+    , m_sparse(sparse)
+    , m_chunk_size(chunk_size)
+    , m_extent(0)
+    , m_position(0)
+    , m_headed(false)
+{
+    if (!m_sparse) {
+        m_extents.clear();
+        if (m_size > 0) {
+            m_extents.push_back(FileExtent{0, m_size});
+        }
+    } else if (m_extents.empty()) {
+        m_extents.push_back(FileExtent{0, 0});
+    }
+    if (!m_extents.empty()) {
+        m_position = m_extents.front().offset;
+    }
+}
+
+bool RawFileSender::Next(grpc::ByteBuffer* message)
+{
+    while (m_extent < m_extents.size()) {
+        const FileExtent& extent = m_extents[m_extent];
+        if (m_sparse && !m_headed) {
+            afsfuse::FileContent header;
+            header.set_sparse(true);
+            header.set_offset(extent.offset);
+            header.set_length(extent.length);
+            header.set_file_size(m_size);
+            *message = MakeRawMessage(header);
+            m_headed = true;
+            return true;
+        }
+        const std::uint64_t end = extent.offset + extent.length;
+        if (m_position < end) {
+            const size_t len = std::min<std::uint64_t>(m_chunk_size, end - m_position);
+            *message = MakeRawChunk(m_mapping, m_position, len);
+            m_position += len;
+            return true;
+        }
+        if (++m_extent < m_extents.size()) {
+            m_position = m_extents[m_extent].offset;
+        }
+        m_headed = false;
+    }
+    return false;
+}
+
+RawFileReceiver::RawFileReceiver(int fd, bool sparse)
+    : m_fd(fd)
+    , m_sparse(sparse)
+    , m_sized(false)
+    , m_remaining(0)
+    , m_file_size(0)
+{
+}
+
+bool RawFileReceiver::Receive(grpc::ByteBuffer& message)
+{
+    if (m_sparse && m_remaining == 0) {
+        afsfuse::FileContent header;
+        if (!ParseRawMessage(message, &header) || !header.sparse() || header.offset() < 0 ||
+            header.length() < 0 || header.offset() + header.length() > header.file_size()) {
+            errno = EPROTO;
+            return false;
+        }
+        if (lseek(m_fd, header.offset(), SEEK_SET) == -1) {
+            return false;
+        }
+        m_remaining = header.length();
+        m_file_size = header.file_size();
+        m_sized = true;
+        return true;
+    }
+
+    const ssize_t written = WriteRawChunk(m_fd, message);
+    if (written == -1) {
+        return false;
+    }
+    if (m_sparse) {
+        if (static_cast<std::uint64_t>(written) > m_remaining) {
+            errno = EPROTO;
+            return false;
+        }
+        m_remaining -= written;
+    }
+    return true;
+}
+
+bool RawFileReceiver::Finish()
+{
+    if (!m_sparse) {
+        return true;
+    }
+    if (!m_sized || m_remaining != 0) {
+        errno = EPROTO;
+        return false;
+    }
+    return ftruncate(m_fd, m_file_size) == 0;
+}
@@ -1,9 +1,80 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <string>
 
+#include <grpc++/support/byte_buffer.h>
+
 #include "afsfuse.grpc.pb.h"
+#include "sequential_file_reader.h"
+
+// Fully qualified names of the raw (ByteBuffer) file transfer methods. These are not part of the AFS service in
+// afsfuse.proto; the server answers them through its generic service. Both methods start with the client sending
+// a serialized afsfuse::File naming the file. After that getFile streams back raw chunks of file data, while
+// putFile streams raw chunks to the server and receives a serialized afsfuse::OutputInfo once it half-closes.
+// If the File has sparse set, the chunks come as extents, each headed by a serialized afsfuse::FileContent (see
+// RawFileSender).
+extern const char* const kRawGetFileMethod;
+extern const char* const kRawPutFileMethod;
 
-afsfuse::File MakeFile(std::string path);
+// Metadata key under which clients send their id with every call, so the server can tell them apart (to recall
+// write delegations).
+extern const char* const kClientIdKey;
+
+afsfuse::File MakeFile(std::string path, bool sparse = false);
 afsfuse::FileContent MakeFileContent(std::string name, const void* data, size_t data_len);
+
+// Serialize a (small) control message into a ByteBuffer for the raw methods, and parse one back.
+grpc::ByteBuffer MakeRawMessage(const google::protobuf::Message& message);
+bool ParseRawMessage(grpc::ByteBuffer& buffer, google::protobuf::Message* message);
+
+// Wrap [offset, offset + len) of an mmap()ed file into a ByteBuffer without copying it. The slice keeps a
+// reference to 'mapping', so the region stays mapped until gRPC is done sending it.
+grpc::ByteBuffer MakeRawChunk(const std::shared_ptr<const std::uint8_t>& mapping, size_t offset, size_t len);
+
+// Write all slices of a raw chunk to 'fd' with writev(). Returns the number of bytes written, or -1 with errno set.
+ssize_t WriteRawChunk(int fd, const grpc::ByteBuffer& buffer);
+
+// RawFileSender: The messages of a raw transfer of the mmap()ed file 'mapping' of 'size' bytes, in order. Dense, the
+// whole file goes as raw chunks of at most 'chunk_size' bytes. Sparse, only the data 'extents' go, each headed by a
+// FileContent with its offset and length; a file without data goes as one empty extent, so its size still arrives.
+class RawFileSender {
+public:
+    RawFileSender(std::shared_ptr<const std::uint8_t> mapping, std::uint64_t size, std::vector<FileExtent> extents,
+                  bool sparse, size_t chunk_size);
+
+    // Put the next message into 'message'. Returns false once the whole file has been sent.
+    bool Next(grpc::ByteBuffer* message);
+
+private:
+    std::shared_ptr<const std::uint8_t> m_mapping;
+    std::uint64_t m_size;
+    std::vector<FileExtent> m_extents;
+    bool m_sparse;
+    size_t m_chunk_size;
+    size_t m_extent;            // Index of the extent being sent
+    std::uint64_t m_position;   // Next byte to send
+    bool m_headed;              // Whether the header of the extent was sent
+};
+
+// RawFileReceiver: Write the messages of a raw transfer (see RawFileSender) into the new, empty file open at 'fd'.
+// Sparse, each chunk goes where its extent header says, so the gaps stay holes.
+class RawFileReceiver {
+public:
+    RawFileReceiver(int fd, bool sparse);
+
+    // Take the next message. Returns false with errno set on failure.
+    bool Receive(grpc::ByteBuffer& message);
+
+    // Called after the last message, to give the file its size. Returns false with errno set on failure, or if the
+    // transfer was cut short.
+    bool Finish();
+
+private:
+    int m_fd;
+    bool m_sparse;
+    bool m_sized;               // Whether an extent header arrived
+    std::uint64_t m_remaining;  // Bytes of the current extent still to come
+    std::uint64_t m_file_size;
+};
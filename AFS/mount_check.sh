@@ -0,0 +1,39 @@
+# Mounts the client in the default (high-level) mode with options of its own, which libfuse does
+# not know, and checks that the mount comes up and a file written through it reaches the server.
+# Run from this folder after make, as root, with no server running.
+
+options="--inline_size=4096"
+echo mount_check > check_manifest
+options="$options --warmup=check_manifest"
+options="$options --swr_max_staleness=1000 --swr_dirs=/swr"
+options="$options --entry_timeout=1 --attr_timeout=1 --negative_timeout=0 --keep_cache=1"
+options="$options --writeback_cache --durability=close"
+options="$options --direct_min_size=1073741824 --direct_dirs=/direct"
+options="$options --write_through_dirs=/write_through"
+options="$options --block_cache_min_size=1073741824 --block_cache_size=1048576"
+
+mkdir -p server check_mnt
+./afsfuse_server > /dev/null 2>&1 &
+server=$!
+sleep 1
+
+./afsfuse_client -f check_mnt $options > check_mnt.log 2>&1 &
+sleep 2
+
+status=1
+if ! mountpoint -q check_mnt; then
+    echo "FAIL: not mounted with $options"
+    cat check_mnt.log
+elif ! echo checked > check_mnt/mount_check || ! sleep 1 ||
+    [ "$(cat server/mount_check)" != "checked" ]; then
+    echo "FAIL: write through the mount did not reach the server"
+else
+    echo "OK: mounted with $options"
+    status=0
+fi
+
+rm -f check_mnt/mount_check
+fusermount -u check_mnt
+kill $server
+rm -f check_mnt.log check_manifest
+exit $status
@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "path_resolver.h"
+#include "utils.h"
+
+namespace {
+
+    const int kDirOpenFlags = O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+    // Split 'path' into its components, skipping empty ones and ".". Fails on "..".
+    bool split_path(const std::string& path, std::vector<std::string>& components)
+    {
+        size_t begin = 0;
+        while (begin <= path.size()) {
+            size_t end = path.find('/', begin);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            std::string component = path.substr(begin, end - begin);
+            if (component == "..") {
+                return false;
+            }
+            if (!component.empty() && component != ".") {
+                components.push_back(component);
+            }
+            begin = end + 1;
+        }
+        return true;
+    }
+
+    // The cache key of the directory made of the first 'count' components
+    std::string make_key(const std::vector<std::string>& components, size_t count)
+    {
+        std::string key;
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0) {
+                key += '/';
+            }
+            key += components[i];
+        }
+        return key;
+    }
+
+};  // Anonymous namespace
+
+DirectoryFd::~DirectoryFd()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+PathResolver::PathResolver(const std::string& root_path, size_t max_cached_dirs)
+    : m_max_cached_dirs(max_cached_dirs)
+    , m_generation(0)
+{
+    int fd = open(root_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (-1 == fd) {
+        raise_from_errno("Failed to open the root directory " + root_path);
+    }
+    m_root = std::make_shared<DirectoryFd>(fd);
+}
+
+int PathResolver::Resolve(const std::string& path, ResolvedPath& resolved, bool create_parents)
+{
+    std::vector<std::string> components;
+    if (!split_path(path, components)) {
+        errno = EACCES;
+        return -1;
+    }
+
+    if (components.empty()) {
+        resolved.m_dir = m_root;
+        resolved.m_name = ".";
+        return 0;
+    }
+    resolved.m_name = components.back();
+    components.pop_back();
+
+    unsigned long generation;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        generation = m_generation;
+    }
+
+    // Start from the deepest ancestor of the parent that is already open
+    size_t depth = components.size();
+    std::shared_ptr<DirectoryFd> dir;
+    for (; depth > 0; depth--) {
+        dir = Lookup(make_key(components, depth));
+        if (dir) {
+            break;
+        }
+    }
+    if (!dir) {
+        dir = m_root;
+    }
+
+    for (; depth < components.size(); depth++) {
+        const char* name = components[depth].c_str();
+        int fd = openat(dir->Get(), name, kDirOpenFlags);
+        if (-1 == fd && ENOENT == errno && create_parents) {
+            if (-1 == mkdirat(dir->Get(), name, 0777) && EEXIST != errno) {
+                return -1;
+            }
+            fd = openat(dir->Get(), name, kDirOpenFlags);
+        }
+        if (-1 == fd) {
+            return -1;
+        }
+        dir = std::make_shared<DirectoryFd>(fd);
+        Insert(make_key(components, depth + 1), dir, generation);
+    }
+
+    resolved.m_dir = dir;
+    return 0;
+}
+
+void PathResolver::Invalidate(const std::string& path)
+{
+    std::vector<std::string> components;
+    if (!split_path(path, components) || components.empty()) {
+        return;
+    }
+    const std::string key = make_key(components, components.size());
+    const std::string prefix = key + '/';
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_generation++;
+    for (auto it = m_cache.begin(); it != m_cache.end();) {
+        if (it->first == key || it->first.compare(0, prefix.size(), prefix) == 0) {
+            m_lru.erase(it->second.second);
+            it = m_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::shared_ptr<DirectoryFd> PathResolver::Lookup(const std::string& key)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto it = m_cache.find(key);
+    if (it == m_cache.end()) {
+        return nullptr;
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+    return it->second.first;
+}
+
+void PathResolver::Insert(const std::string& key, const std::shared_ptr<DirectoryFd>& dir,
+                          unsigned long generation)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (generation != m_generation) {
+        // The tree changed while 'dir' was being opened, it may no longer be at 'key'
+        return;
+    }
+    auto it = m_cache.find(key);
+    if (it != m_cache.end()) {
+        // Another thread opened it concurrently, keep the newer descriptor
+        it->second.first = dir;
+        m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+        return;
+    }
+
+    m_lru.push_front(key);
+    m_cache.emplace(key, CacheEntry(dir, m_lru.begin()));
+    if (m_cache.size() > m_max_cached_dirs) {
+        // Evicted descriptors are closed once no in-flight request uses them any more
+        m_cache.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// DirectoryFd: An O_PATH descriptor of a directory, closed when the last reference goes away.
+class DirectoryFd {
+public:
+    explicit DirectoryFd(int fd)
+        : m_fd(fd)
+    {
+    }
+    ~DirectoryFd();
+
+    DirectoryFd(const DirectoryFd&) = delete;
+    DirectoryFd& operator=(const DirectoryFd&) = delete;
+
+    int Get() const
+    {
+        return m_fd;
+    }
+
+private:
+    int m_fd;
+};
+
+// ResolvedPath: A client path split into a descriptor of its parent directory and the name of the
+// last component, ready to be passed to the *at() family of syscalls. It keeps the directory open
+// even if the resolver evicts it meanwhile.
+class ResolvedPath {
+public:
+    int DirFd() const
+    {
+        return m_dir->Get();
+    }
+
+    const char* Name() const
+    {
+        return m_name.c_str();
+    }
+
+private:
+    friend class PathResolver;
+
+    std::shared_ptr<DirectoryFd> m_dir;
+    std::string m_name;
+};
+
+// PathResolver: Resolves client paths below the server root relative to directory descriptors
+// instead of building absolute paths, so a syscall only walks the last component. Descriptors of
+// recently used directories are kept in an LRU cache keyed by their path below the root.
+//
+// Components are opened with O_NOFOLLOW and ".." is rejected, so resolution never leaves the root.
+// The last component is left to the caller, which must not follow it either (O_NOFOLLOW,
+// AT_SYMLINK_NOFOLLOW, or a syscall that does not follow links such as unlinkat()).
+// Cached directories are only invalidated by changes made through the resolver's user
+// (Invalidate()); directories removed or renamed behind the server's back stay cached until evicted.
+class PathResolver {
+public:
+    // Opens 'root_path' and throws std::system_error if that fails.
+    explicit PathResolver(const std::string& root_path, size_t max_cached_dirs = 256);
+
+    PathResolver(const PathResolver&) = delete;
+    PathResolver& operator=(const PathResolver&) = delete;
+
+    // Resolve the parent directory of the client path 'path'. The root itself resolves to the name
+    // ".". If 'create_parents' is set, missing directories are created on the way (as mkdir -p
+    // does). Returns 0 on success, and -1 with errno set on failure.
+    int Resolve(const std::string& path, ResolvedPath& resolved, bool create_parents = false);
+
+    // Drop the cached descriptors of the directory at 'path' and of everything below it. Must be
+    // called after a directory has been removed or renamed.
+    void Invalidate(const std::string& path);
+
+private:
+    typedef std::list<std::string> LruList;
+    typedef std::pair<std::shared_ptr<DirectoryFd>, LruList::iterator> CacheEntry;
+
+    std::shared_ptr<DirectoryFd> Lookup(const std::string& key);
+    void Insert(const std::string& key, const std::shared_ptr<DirectoryFd>& dir, unsigned long generation);
+
+    std::shared_ptr<DirectoryFd> m_root;
+    const size_t m_max_cached_dirs;
+
+    std::mutex m_lock;
+    unsigned long m_generation;  // Bumped by Invalidate(), so lookups racing with it are not cached
+    LruList m_lru;  // Most recently used first
+    std::unordered_map<std::string, CacheEntry> m_cache;
+};
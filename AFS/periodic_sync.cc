@@ -0,0 +1,32 @@
+#include <chrono>
+
+#include "periodic_sync.h"
+
+void PeriodicSync::start() {
+    worker = new std::thread(&PeriodicSync::run, this);
+}
+
+void PeriodicSync::run() {
+    std::unique_lock<std::mutex> l(lock);
+    while (notDone) {
+        wakeup.wait_for(l, std::chrono::milliseconds(intervalMs), [&]() { return !notDone; });
+        l.unlock();
+        sync();
+        l.lock();
+    }
+}
+
+void PeriodicSync::stop() {
+    std::thread *stopped;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        notDone = false;
+        stopped = worker;
+        worker = NULL;
+    }
+    wakeup.notify_all();
+    if (stopped != NULL) {
+        stopped->join();
+        delete stopped;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// PeriodicSync: Calls 'sync' every 'intervalMs' from a thread of its own, for
+// --durability=periodic, where it syncs the files written through open handles
+struct PeriodicSync {
+    typedef void (*Sync)();
+
+    Sync sync;
+    const int intervalMs;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::thread *worker;
+    bool notDone;
+
+    PeriodicSync(Sync sync, int intervalMs)
+        : sync(sync), intervalMs(intervalMs), worker(NULL), notDone(true) {}
+
+    PeriodicSync(const PeriodicSync &) = delete;
+    PeriodicSync &operator=(const PeriodicSync &) = delete;
+
+    void start();
+
+    void run();
+
+    void stop();
+};
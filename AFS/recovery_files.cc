@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "client_common.h"
+#include "recovery_files.h"
+#include "utils.h"
+
+void RecoveryFiles::install(const char *path, const std::string &cachedPath,
+                            const std::string &recoveryFile) {
+    // Named like a temp file, which the start-up scan discards if the client dies before the rename
+    std::string linkPath = cachedPath + ".temp." + unique_suffix() + ".link";
+    if (link(recoveryFile.c_str(), linkPath.c_str()) == -1 ||
+        rename(linkPath.c_str(), cachedPath.c_str()) == -1) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: Failed to link %s to %s, it is not kept until uploaded.\n", __func__,
+                   recoveryFile.c_str(), cachedPath.c_str());
+            perror(strerror(errno));
+        }
+        unlink(linkPath.c_str());
+        if (rename(recoveryFile.c_str(), cachedPath.c_str()) == -1 &&
+            debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: Failed to rename from %s to %s.\n", __func__, recoveryFile.c_str(),
+                   cachedPath.c_str());
+            perror(strerror(errno));
+        }
+        return;
+    }
+    keep(path, recoveryFile);
+}
+
+void RecoveryFiles::keep(const char *path, const std::string &recoveryFile) {
+    std::string superseded;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::string &file = files[path];
+        superseded.swap(file);
+        file = recoveryFile;
+    }
+    if (!superseded.empty() && superseded != recoveryFile) {
+        unlink(superseded.c_str());
+    }
+}
+
+std::string RecoveryFiles::current(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = files.find(path);
+    return it != files.end() ? it->second : std::string();
+}
+
+// 'recoveryFile' is the one current() returned before the upload. A newer one installed
+// meanwhile is kept for its own upload.
+void RecoveryFiles::uploaded(const char *path, const std::string &recoveryFile) {
+    if (recoveryFile.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = files.find(path);
+        if (it == files.end() || it->second != recoveryFile) {
+            return;
+        }
+        files.erase(it);
+    }
+    unlink(recoveryFile.c_str());
+}
+
+// The file was removed, or renamed after its upload: a next start must not upload it again
+void RecoveryFiles::forget(const char *path) {
+    uploaded(path, current(path));
+}
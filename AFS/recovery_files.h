@@ -0,0 +1,27 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// RecoveryFiles: A dirty copy written through a temp file becomes the cached copy on close by a
+// hard link to its recovery file. The recovery file stays until an upload of that copy succeeds,
+// so a client that dies first still finds it on the next start and uploads it. Only the latest
+// one of a path is kept, an older one is superseded by the next close.
+struct RecoveryFiles {
+    std::mutex lock;
+    std::unordered_map<std::string, std::string> files;  // path -> its latest recovery file
+
+    // Make 'recoveryFile' the cached copy of 'path' at 'cachedPath' too, and keep it. If it
+    // cannot be linked there, it is renamed there instead and not kept.
+    void install(const char *path, const std::string &cachedPath, const std::string &recoveryFile);
+
+    // Keep 'recoveryFile', which is the cached copy of 'path' already
+    void keep(const char *path, const std::string &recoveryFile);
+
+    std::string current(const char *path);
+
+    void uploaded(const char *path, const std::string &recoveryFile);
+
+    void forget(const char *path);
+};
@@ -0,0 +1,54 @@
+#include "client_common.h"
+#include "revalidator.h"
+#include "utils.h"
+
+Revalidator::Revalidator(const char *dirList, unsigned long maxStalenessMs, Queue queue)
+    : maxStalenessMs(maxStalenessMs), queue(queue), dirs(parse_dir_list(dirList)) {}
+
+bool Revalidator::applies(const char *path) {
+    if (maxStalenessMs == 0) {
+        return false;
+    }
+    return dirs.empty() || is_in_dirs(dirs, path);
+}
+
+// Can the open of 'path' use its cached copy, described by 'cached', right away? If so, a
+// revalidation of it is queued unless one is already.
+bool Revalidator::serveStale(const char *path, const struct stat *cached) {
+    if (!applies(path)) {
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        struct timespec at = cached->st_ctim;
+        auto it = validatedAt.find(path);
+        if (it != validatedAt.end() && get_time_diff(&at, &it->second) > 0) {
+            at = it->second;
+        }
+        if (get_time_diff(&at, &now) >= maxStalenessMs) {
+            return false;
+        }
+        if (!pending.insert(path).second) {
+            return true;
+        }
+    }
+    if (!queue(path)) {
+        // Queue full, the next open tries again
+        std::lock_guard<std::mutex> guard(lock);
+        pending.erase(path);
+    }
+    return true;
+}
+
+void Revalidator::validated(const char *path, const struct timespec *at) {
+    std::lock_guard<std::mutex> guard(lock);
+    validatedAt[path] = *at;
+}
+
+// The revalidation queued for 'path' is over, whatever its outcome
+void Revalidator::revalidated(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    pending.erase(path);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Revalidator: Stale-while-revalidate opens, for read-mostly data. An open below one of 'dirs' (or
+// anywhere, if none are given) whose cached copy was validated less than 'maxStalenessMs' ago
+// uses it at once and has it revalidated in the background, so it costs no more than a local
+// open however slow the server is. Older copies are revalidated before the open returns, as
+// usual. A copy counts as validated when it was stored (its ctime) or last found current.
+struct Revalidator {
+    // Queue the revalidation of 'path', which ends with revalidated(). Returns false if it
+    // cannot be queued now.
+    typedef bool (*Queue)(const char *path);
+
+    const unsigned long maxStalenessMs;  // 0 disables the mode
+    Queue queue;
+
+    std::mutex lock;
+    std::vector<std::string> dirs;                                 // empty: the whole mount
+    std::unordered_map<std::string, struct timespec> validatedAt;  // CLOCK_REALTIME
+    std::unordered_set<std::string> pending;                       // queued for revalidation
+
+    Revalidator(const char *dirList, unsigned long maxStalenessMs, Queue queue);
+
+    Revalidator(const Revalidator &) = delete;
+    Revalidator &operator=(const Revalidator &) = delete;
+
+    bool applies(const char *path);
+
+    bool serveStale(const char *path, const struct stat *cached);
+
+    void validated(const char *path, const struct timespec *at);
+
+    void revalidated(const char *path);
+};
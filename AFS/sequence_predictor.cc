@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "sequence_predictor.h"
+
+namespace {
+
+    // A file name split around its last run of digits: "part-0042.bin" is "part-", 42, ".bin".
+    struct NumberedName {
+        std::string prefix;
+        long long number;
+        size_t digits;
+        bool padded;  // Has leading zeros, so the sequence is fixed width
+        std::string suffix;
+    };
+
+    bool split_number(const std::string& name, NumberedName& parsed)
+    {
+        size_t end = name.find_last_of("0123456789");
+        if (end == std::string::npos) {
+            return false;
+        }
+        size_t begin = name.find_last_not_of("0123456789", end);
+        begin = (begin == std::string::npos) ? 0 : begin + 1;
+        size_t digits = end + 1 - begin;
+        if (digits > 18) {
+            return false;
+        }
+        parsed.prefix = name.substr(0, begin);
+        parsed.number = strtoll(name.c_str() + begin, NULL, 10);
+        parsed.digits = digits;
+        parsed.padded = name[begin] == '0' && digits > 1;
+        parsed.suffix = name.substr(end + 1);
+        return true;
+    }
+
+    std::string format_number(const NumberedName& parsed, long long number)
+    {
+        char digits[32];
+        // Padding to the current width is a no-op for unpadded numbers, which have no more digits
+        snprintf(digits, sizeof(digits), "%0*lld", (int)parsed.digits, number);
+        return parsed.prefix + digits + parsed.suffix;
+    }
+
+    bool same_sequence(const NumberedName& a, const NumberedName& b)
+    {
+        return a.prefix == b.prefix && a.suffix == b.suffix &&
+               (a.digits == b.digits || (!a.padded && !b.padded));
+    }
+
+};  // Anonymous namespace
+
+SequencePredictor::SequencePredictor(ListDirectory list_directory, size_t depth, size_t max_dirs)
+    : m_list_directory(list_directory)
+    , m_depth(depth)
+    , m_max_dirs(max_dirs)
+    , m_clock(0)
+{
+}
+
+std::vector<std::string> SequencePredictor::Record(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ? "" : path.substr(0, slash);
+    std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    DirectoryState& state = GetState(dir);
+
+    NumberedName previous, current;
+    if (state.last_name.empty() || name == state.last_name) {
+        state.run = 0;
+    } else if (split_number(state.last_name, previous) && split_number(name, current) &&
+               same_sequence(previous, current)) {
+        long long stride = current.number - previous.number;
+        state.run = (stride == state.stride) ? state.run + 1 : 1;
+        state.stride = stride;
+    } else if (name > state.last_name) {
+        state.run = (state.stride == 0) ? state.run + 1 : 1;
+        state.stride = 0;
+    } else {
+        state.run = 0;
+    }
+    state.last_name = name;
+
+    if (state.run < 2) {
+        return std::vector<std::string>();
+    }
+    return Predict(dir, state);
+}
+
+SequencePredictor::DirectoryState& SequencePredictor::GetState(const std::string& dir)
+{
+    auto it = m_dirs.find(dir);
+    if (it == m_dirs.end()) {
+        if (m_dirs.size() >= m_max_dirs) {
+            auto oldest = std::min_element(m_dirs.begin(), m_dirs.end(),
+                                           [](const std::pair<const std::string, DirectoryState>& a,
+                                              const std::pair<const std::string, DirectoryState>& b) {
+                                               return a.second.last_use < b.second.last_use;
+                                           });
+            m_dirs.erase(oldest);
+        }
+        it = m_dirs.emplace(dir, DirectoryState()).first;
+    }
+    it->second.last_use = ++m_clock;
+    return it->second;
+}
+
+std::vector<std::string> SequencePredictor::Predict(const std::string& dir, DirectoryState& state)
+{
+    std::vector<std::string> names;
+    if (state.stride != 0) {
+        NumberedName current;
+        split_number(state.last_name, current);
+        for (size_t i = 1; i <= m_depth; i++) {
+            long long number = current.number + state.stride * (long long)i;
+            if (number < 0) {
+                break;
+            }
+            names.push_back(format_number(current, number));
+        }
+    } else {
+        if (!state.listed) {
+            // Called with the lock held, this only happens once per directory
+            state.listing = m_list_directory(dir);
+            std::sort(state.listing.begin(), state.listing.end());
+            state.listed = true;
+        }
+        auto next = std::upper_bound(state.listing.begin(), state.listing.end(), state.last_name);
+        for (size_t i = 0; i < m_depth && next != state.listing.end(); i++, ++next) {
+            names.push_back(*next);
+        }
+    }
+
+    std::vector<std::string> paths;
+    for (const std::string& name : names) {
+        if (std::find(state.issued.begin(), state.issued.end(), name) != state.issued.end()) {
+            continue;
+        }
+        state.issued.push_back(name);
+        if (state.issued.size() > 2 * m_depth) {
+            state.issued.pop_front();
+        }
+        paths.push_back(dir + "/" + name);
+    }
+    return paths;
+}
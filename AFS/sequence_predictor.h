@@ -0,0 +1,56 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// SequencePredictor: Watches the order in which files are opened, per directory, and predicts the
+// next files of a scan. Two kinds of scans are recognized:
+//  - numeric sequences, where the last run of digits in the name moves by a constant stride
+//    (part-0000, part-0001, ... or img_10.png, img_20.png, ...), continued arithmetically;
+//  - lexical directory scans, where every name sorts after the previous one, continued from
+//    the directory listing.
+// A scan is only reported after two consistent steps, so the first files of a scan and random
+// access patterns never trigger predictions.
+class SequencePredictor {
+public:
+    // Returns the names of the regular files in a directory, given by its path.
+    typedef std::function<std::vector<std::string>(const std::string& dir)> ListDirectory;
+
+    // 'depth' is the number of files predicted ahead of the last open. At most 'max_dirs'
+    // directories are tracked, the least recently used one is forgotten first.
+    SequencePredictor(ListDirectory list_directory, size_t depth = 4, size_t max_dirs = 64);
+
+    SequencePredictor(const SequencePredictor&) = delete;
+    SequencePredictor& operator=(const SequencePredictor&) = delete;
+
+    // Record an open of the client path 'path'. Returns the paths expected to be opened next that
+    // were not returned before, in the order they are expected. The listing of a directory is
+    // requested once, the first time a lexical scan of it is seen.
+    std::vector<std::string> Record(const std::string& path);
+
+private:
+    struct DirectoryState {
+        std::string last_name;
+        long long stride = 0;  // Step of a numeric sequence, 0 for a lexical scan
+        int run = 0;           // Consecutive opens consistent with the current scan
+        bool listed = false;
+        std::vector<std::string> listing;  // Sorted, once 'listed'
+        std::deque<std::string> issued;    // Recently predicted names, not to predict again
+        unsigned long last_use = 0;
+    };
+
+    DirectoryState& GetState(const std::string& dir);
+    std::vector<std::string> Predict(const std::string& dir, DirectoryState& state);
+
+    ListDirectory m_list_directory;
+    const size_t m_depth;
+    const size_t m_max_dirs;
+
+    std::mutex m_lock;
+    unsigned long m_clock;
+    std::unordered_map<std::string, DirectoryState> m_dirs;
+};
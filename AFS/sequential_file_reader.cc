@@ -1,6 +1,7 @@
 #include <stdexcept>
 #include <algorithm>
 
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -41,78 +42,192 @@ namespace {
         }
 
     };
-};  // Anonymous namespace
 
-SequentialFileReader::SequentialFileReader(const std::string& root_path, const std::string& file_name)
-    : m_root_path(root_path)
-    , m_file_path(file_name)
-    , m_data(nullptr)
-    , m_size(0)
-{
-    std::string s_path = m_root_path + m_file_path;
-    int fd = open(s_path.c_str(), O_RDONLY);
-    if (-1 == fd) {
-        raise_from_errno("Failed to open file.");
-    }
+    // Map the file 'fd', which the mapping takes over. A failed open (fd == -1) is reported here.
+    std::shared_ptr<const std::uint8_t> MapOpenFile(int fd, size_t& size, std::vector<FileExtent>* extents)
+    {
+        if (-1 == fd) {
+            raise_from_errno("Failed to open file.");
+        }
 
-    // Ensure that fd will be closed if this method aborts at any point
-    MMapPtr<const std::uint8_t> mmap_p(nullptr, 0, fd);
+        // Ensure that fd will be closed if this method aborts at any point
+        MMapPtr<const std::uint8_t> mmap_p(nullptr, 0, fd);
 
-    struct stat st {};
-    int rc = fstat(fd, &st);
-    if (-1 == rc) {
-        raise_from_errno("Failed to read file size.");
-    }
-    m_size = st.st_size;
-    if (m_size > 0) {
-        //std::cout << m_size << ' ' << PROT_READ << ' ' << MAP_FILE << ' ' << fd << std::endl;
-        void* const mapping = mmap(0, m_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+        struct stat st {};
+        int rc = fstat(fd, &st);
+        if (-1 == rc) {
+            raise_from_errno("Failed to read file size.");
+        }
+        size = st.st_size;
+        if (extents != nullptr) {
+            *extents = ListDataExtents(fd, size);
+        }
+        if (size == 0) {
+            return nullptr;
+        }
+
+        //std::cout << size << ' ' << PROT_READ << ' ' << MAP_FILE << ' ' << fd << std::endl;
+        void* const mapping = mmap(0, size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
         if (MAP_FAILED == mapping) {
             raise_from_errno("Failed to map the file into memory.");
         }
 
         // Close the file descriptor, and protect the newly acquired memory mapping inside an object
-        mmap_p = MMapPtr<const std::uint8_t>(static_cast<std::uint8_t*>(mapping), m_size, -1);
+        mmap_p = MMapPtr<const std::uint8_t>(static_cast<std::uint8_t*>(mapping), size, -1);
         // Inform the kernel we plan sequential access
-        rc = posix_madvise(mapping, m_size, POSIX_MADV_SEQUENTIAL);
+        rc = posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
         if (-1 == rc) {
             raise_from_errno("Failed to set intended access pattern useing posix_madvise().");
         }
 
-        m_data.swap(mmap_p);
+        // The deleter travels with the shared pointer, so the region stays mapped for as long as anyone
+        // (e.g. a gRPC slice pointing into it) holds a reference.
+        return std::shared_ptr<const std::uint8_t>(std::move(mmap_p));
+    }
+
+};  // Anonymous namespace
+
+std::vector<FileExtent> ListDataExtents(int fd, std::uint64_t size)
+{
+    std::vector<FileExtent> extents;
+    off_t hole = 0;
+    while ((std::uint64_t)hole < size) {
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        if (-1 == data) {
+            if (ENXIO == errno) {
+                break;  // Only a hole is left
+            }
+            // Not supported here: treat the file as dense
+            extents.assign(1, FileExtent{0, size});
+            break;
+        }
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (-1 == hole || (std::uint64_t)hole > size) {
+            hole = size;
+        }
+        if (hole > data) {
+            extents.push_back(FileExtent{(std::uint64_t)data, (std::uint64_t)(hole - data)});
+        }
     }
+    return extents;
 }
 
-void SequentialFileReader::Read(size_t max_chunk_size)
+std::shared_ptr<const std::uint8_t> MapFileForReading(const std::string& path, size_t& size,
+                                                      std::vector<FileExtent>* extents)
 {
-    size_t bytes_read = 0;
+    return MapOpenFile(open(path.c_str(), O_RDONLY | O_CLOEXEC), size, extents);
+}
 
-    // Handle empty files. Note that m_data will likely be null, so we take care not to access it.
-    if (0 == m_size) {
-        OnChunkAvailable("", 0);
-        return;
+std::shared_ptr<const std::uint8_t> MapFileForReading(int dirfd, const std::string& name, size_t& size,
+                                                      std::vector<FileExtent>* extents)
+{
+    return MapOpenFile(openat(dirfd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC), size, extents);
+}
+
+SequentialFileReader::SequentialFileReader(const std::string& root_path, const std::string& file_name)
+    : m_root_path(root_path)
+    , m_file_path(file_name)
+    , m_fd(-1)
+    , m_size(0)
+    , m_sparse(false)
+{
+    Open(open((m_root_path + m_file_path).c_str(), O_RDONLY | O_CLOEXEC));
+}
+
+SequentialFileReader::SequentialFileReader(int dirfd, const std::string& name, const std::string& file_name)
+    : m_file_path(file_name)
+    , m_fd(-1)
+    , m_size(0)
+    , m_sparse(false)
+{
+    Open(openat(dirfd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+}
+
+// Take over the newly opened 'fd'. A failed open (fd == -1) is reported here.
+void SequentialFileReader::Open(int fd)
+{
+    if (-1 == fd) {
+        raise_from_errno("Failed to open file.");
     }
+    m_fd = fd;
 
-    while (bytes_read < m_size) {
-        size_t bytes_to_read = std::min(max_chunk_size, m_size - bytes_read);
+    struct stat st {};
+    if (-1 == fstat(m_fd, &st)) {
+        const int err = errno;
+        close(m_fd);
+        m_fd = -1;
+        raise_from_system_error_code("Failed to read file size.", err);
+    }
+    m_size = st.st_size;
+}
 
-        // TODO: Here would be a good point to hint the kernel about the size of out subsequent
-        // read, by using posix_madvise() to give the advice POSIX_MADV_WILLNEED for the following
-        // max_chunk_size bytes after the ones we are about to read now. Hopefully by the time
-        // we need them, they'll be in the cache.
+void SequentialFileReader::Read(size_t max_chunk_size, bool sparse)
+{
+    m_sparse = sparse;
+    const std::vector<FileExtent> extents =
+        sparse ? ListDataExtents(m_fd, m_size) : std::vector<FileExtent>{FileExtent{0, m_size}};
 
-        OnChunkAvailable(m_data.get() + bytes_read, bytes_to_read);
-        // std::cout << __func__ << " \t : Sending chunk.. " << m_data.get() << std::endl;
-        // If we implemented the optimisation suggested above, now would be the time to set the
-        // advice POSIX_MADV_SEQUENTIAL for the data we have just finished reading. Note we should
-        // not use POSIX_MADV_DONTNEED because Linux ignores it (see the posix_madvise man page),
-        // and because multiple concurrent reads could suffer from it.
+    // Handle empty files, which cannot be mapped, and files that are all holes
+    if (0 == m_size || extents.empty()) {
+        OnChunkAvailable("", 0, 0);
+        return;
+    }
 
-        bytes_read += bytes_to_read;
+    // Map the file one window at a time: however large the file, only kMapWindowSize bytes of
+    // address space are in use, and each window is unmapped as soon as its chunks are sent.
+    for (const FileExtent& extent : extents) {
+        std::uint64_t position = extent.offset;
+        const std::uint64_t end = extent.offset + extent.length;
+        while (position < end) {
+            const std::uint64_t window = position - position % kMapWindowSize;
+            const size_t window_size = std::min<std::uint64_t>(kMapWindowSize, m_size - window);
+            void* const mapping = mmap(0, window_size, PROT_READ, MAP_FILE | MAP_SHARED, m_fd, window);
+            if (MAP_FAILED == mapping) {
+                raise_from_errno("Failed to map the file into memory.");
+            }
+            MMapPtr<const std::uint8_t> data(static_cast<std::uint8_t*>(mapping), window_size, -1);
+            // Inform the kernel we plan sequential access
+            posix_madvise(mapping, window_size, POSIX_MADV_SEQUENTIAL);
+
+            const std::uint64_t window_end = std::min<std::uint64_t>(end, window + window_size);
+            while (position < window_end) {
+                size_t bytes_to_read = std::min<std::uint64_t>(max_chunk_size, window_end - position);
+                OnChunkAvailable(data.get() + (position - window), bytes_to_read, position);
+                position += bytes_to_read;
+            }
+        }
     }
 }
 
+SequentialFileReader::SequentialFileReader(SequentialFileReader&& other)
+    : m_root_path(std::move(other.m_root_path))
+    , m_file_path(std::move(other.m_file_path))
+    , m_fd(other.m_fd)
+    , m_size(other.m_size)
+    , m_sparse(other.m_sparse)
+{
+    other.m_fd = -1;
+}
+
+SequentialFileReader& SequentialFileReader::operator=(SequentialFileReader&& other)
+{
+    if (this != &other) {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+        m_root_path = std::move(other.m_root_path);
+        m_file_path = std::move(other.m_file_path);
+        m_fd = other.m_fd;
+        m_size = other.m_size;
+        m_sparse = other.m_sparse;
+        other.m_fd = -1;
+    }
+    return *this;
+}
 
-SequentialFileReader::SequentialFileReader(SequentialFileReader&&) = default;
-SequentialFileReader& SequentialFileReader::operator=(SequentialFileReader&&) = default;
-SequentialFileReader::~SequentialFileReader() = default;
\ No newline at end of file
+SequentialFileReader::~SequentialFileReader()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
@@ -4,9 +4,33 @@
 #include <cstdint>
 #include <memory>
 #include <functional>
+#include <vector>
 
-// SequentialFileReader: Read a file using using mmap(). Attempt to overlap reads of the file and writes by the user's code
-// by reading the next segment 
+// A run of data in a file: the bytes between extents are holes, which read as zeros.
+struct FileExtent {
+    std::uint64_t offset;
+    std::uint64_t length;
+};
+
+// ListDataExtents: The data extents of the open file 'fd' of 'size' bytes, in order, found with
+// lseek(SEEK_DATA/SEEK_HOLE). Where the file system cannot tell, the whole file is one extent.
+std::vector<FileExtent> ListDataExtents(int fd, std::uint64_t size);
+
+// MapFileForReading: Open the file at 'path' and mmap() it read-only for sequential access. 'size' receives the
+// file size. The returned pointer owns the mapping, which is only unmapped once the last reference is dropped, so
+// it can be handed to code that outlives the caller (e.g. gRPC slices still queued for sending). For empty files
+// the pointer is null. If 'extents' is given, it receives the data extents of the file (see ListDataExtents()).
+// Throws std::system_error on failure.
+std::shared_ptr<const std::uint8_t> MapFileForReading(const std::string& path, size_t& size,
+                                                      std::vector<FileExtent>* extents = nullptr);
+
+// Same as above, with 'name' resolved relative to the directory descriptor 'dirfd' as openat() does. If 'name' is a
+// symbolic link, it is not followed and the call fails with ELOOP.
+std::shared_ptr<const std::uint8_t> MapFileForReading(int dirfd, const std::string& name, size_t& size,
+                                                      std::vector<FileExtent>* extents = nullptr);
+
+// SequentialFileReader: Read a file using mmap(), one window of kMapWindowSize bytes at a time, so files of any
+// size can be streamed without mapping them whole. A sparse read skips the holes of the file.
 
 class SequentialFileReader {
 public:
@@ -18,8 +42,8 @@ public:
     // of data, but could hurt performance
 
     // Read the file, calling OnChunkAvailable() whenever data are available. It blocks until the reading
-    // is complete.
-    void Read(size_t max_chunk_size);
+    // is complete. If 'sparse', only the data extents are read; a file without any gets one empty chunk.
+    void Read(size_t max_chunk_size, bool sparse = false);
 
     std::string GetFilePath() const
     {
@@ -31,17 +55,38 @@ public:
         return m_root_path;
     }
 
+    std::uint64_t GetFileSize() const
+    {
+        return m_size;
+    }
+
 protected:
     // Constructor. Attempts to open the file, and throws std::system_error if it fails to do so.
     SequentialFileReader(const std::string& root_path, const std::string& file_name);
 
+    // Same, for the file 'name' in the directory 'dirfd', known as 'file_name'. A symbolic link as 'name' is not
+    // followed.
+    SequentialFileReader(int dirfd, const std::string& name, const std::string& file_name);
+
     // TODO: Also provide a constructor that doesn't open the file, and a separate Open method.
 
     // OnChunkAvailable: The user needs to override this function to get called when data become available.
-    virtual void OnChunkAvailable(const void* data, size_t size) = 0;
+    // 'offset' is where the data are in the file.
+    virtual void OnChunkAvailable(const void* data, size_t size, std::uint64_t offset) = 0;
+
+    // Whether the read in progress skips holes
+    bool IsSparse() const
+    {
+        return m_sparse;
+    }
 
 private:
+    void Open(int fd);
+
+    static constexpr std::uint64_t kMapWindowSize = 64UL << 20;  // A multiple of the page size
+
     std::string m_root_path, m_file_path;
-    std::unique_ptr< const std::uint8_t, std::function<void(const std::uint8_t*)> > m_data;
-    size_t m_size;
-};
\ No newline at end of file
+    int m_fd;
+    std::uint64_t m_size;
+    bool m_sparse;
+};
@@ -3,66 +3,125 @@
 #include <stdexcept>
 #include <cstdio>
 #include <sstream>
+#include <fcntl.h>
 #include <sys/errno.h>
+#include <unistd.h>
 
 #include "utils.h"
 #include "sequential_file_writer.h"
 
 SequentialFileWriter::SequentialFileWriter()
-    : m_no_space(false)
+    : m_dir_fd(AT_FDCWD), m_fd(-1), m_no_space(false)
 {
 }
 
-SequentialFileWriter::SequentialFileWriter(SequentialFileWriter&&) = default;
-SequentialFileWriter& SequentialFileWriter::operator=(SequentialFileWriter&&) = default;
+SequentialFileWriter::SequentialFileWriter(SequentialFileWriter&& other)
+    : m_name(std::move(other.m_name)), m_dir_fd(other.m_dir_fd), m_fd(other.m_fd),
+      m_no_space(other.m_no_space)
+{
+    other.m_fd = -1;
+}
 
-// Currently the implementation is very simple using standard library facilities. More advanced implementations
-// allowing for better parallelism are possible, e.g. using aio_write().
+SequentialFileWriter& SequentialFileWriter::operator=(SequentialFileWriter&& other)
+{
+    if (this != &other) {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+        m_name = std::move(other.m_name);
+        m_dir_fd = other.m_dir_fd;
+        m_fd = other.m_fd;
+        m_no_space = other.m_no_space;
+        other.m_fd = -1;
+    }
+    return *this;
+}
+
+SequentialFileWriter::~SequentialFileWriter()
+{
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+// Currently the implementation is very simple, writing each chunk as it arrives. More advanced
+// implementations allowing for better parallelism are possible, e.g. using aio_write().
 
 void SequentialFileWriter::OpenIfNecessary(const std::string& name)
 {
     // FIXME: Sanitise file names. Currently there's nothing preventing the user from giving absolute paths,
     // Paths with .. etc. We should accept simple relative paths only.
+    OpenIfNecessary(AT_FDCWD, name);
+}
 
-    if (m_ofs.is_open()) {
+void SequentialFileWriter::OpenIfNecessary(int dir_fd, const std::string& name)
+{
+    if (m_fd != -1) {
         return;
     }
 
-    using std::ios_base;
-    std::ofstream ofs;
-    ofs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-
-    try {
-        // TODO: If the given relative path has a directory component, create it.
-        ofs.open(name, ios_base::out | ios_base::trunc | ios_base::binary);
+    // TODO: If the given relative path has a directory component, create it.
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (dir_fd != AT_FDCWD) {
+        flags |= O_NOFOLLOW;
     }
-    catch (const std::system_error& ex) {
-        RaiseError("opening", ex);
+    const int fd = openat(dir_fd, name.c_str(), flags, 0666);
+    m_name = name;
+    if (fd == -1) {
+        RaiseError("opening", std::system_error(errno, std::generic_category()));
     }
 
-    m_ofs = std::move(ofs);
-    m_name = name;
+    m_dir_fd = dir_fd;
+    m_fd = fd;
     m_no_space = false;
     return;
 }
 
 void SequentialFileWriter::Write(std::string& data)
 {
-    try {
-        m_ofs << data;
-    }
-    catch (const std::system_error& ex) {
-        if (m_ofs.is_open()) {
-            m_ofs.close();
+    const char* next = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        const ssize_t written = write(m_fd, next, left);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DiscardAndRaise("writing to", std::system_error(errno, std::generic_category()));
         }
-        std::remove(m_name.c_str());    // Best effort. We expect it to succeed, but we don't check whether it did
-        RaiseError("writing to", ex);
+        next += written;
+        left -= written;
     }
 
     data.clear();
     return;
 }
 
+void SequentialFileWriter::WriteAt(std::string& data, std::uint64_t offset)
+{
+    if (-1 == lseek(m_fd, offset, SEEK_SET)) {
+        DiscardAndRaise("seeking in", std::system_error(errno, std::generic_category()));
+    }
+    Write(data);
+}
+
+void SequentialFileWriter::SetSize(std::uint64_t size)
+{
+    if (-1 == ftruncate(m_fd, size)) {
+        DiscardAndRaise("resizing", std::system_error(errno, std::generic_category()));
+    }
+}
+
+void SequentialFileWriter::DiscardAndRaise(const std::string action_attempted, const std::system_error& ex)
+{
+    if (m_fd != -1) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    unlinkat(m_dir_fd, m_name.c_str(), 0);    // Best effort. We expect it to succeed, but we don't check whether it did
+    RaiseError(action_attempted, ex);
+}
+
 void SequentialFileWriter::RaiseError(const std::string action_attempted, const std::system_error& ex)
 {
     const int ec = ex.code().value();
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <fstream>
+#include <cstdint>
 #include <string>
 
 #include "utils.h"
@@ -11,15 +11,26 @@ public:
     SequentialFileWriter();
     SequentialFileWriter(SequentialFileWriter&&);
     SequentialFileWriter& operator=(SequentialFileWriter&&);
+    ~SequentialFileWriter();
 
     // Open the file at the relative path 'name' for writing. On errors throw std::system_error
     void OpenIfNecessary(const std::string& name);
 
+    // Same as OpenIfNecessary(name), for 'name' in the directory 'dir_fd'. A symlink at 'name'
+    // is not followed.
+    void OpenIfNecessary(int dir_fd, const std::string& name);
+
     // Write data from a string. On errors throws an exception drived from std::system_error
     // This method may take ownership of the string. Hence no assumption may be made about
     // the data it contains after it returns.
     void Write(std::string& data);
 
+    // Same as Write(), at 'offset' in the file. Skipping past the end leaves a hole.
+    void WriteAt(std::string& data, std::uint64_t offset);
+
+    // Cut or extend the file to 'size' bytes. The extension is a hole.
+    void SetSize(std::uint64_t size);
+
     bool NoSpaceLeft() const
     {
         return m_no_space;
@@ -27,8 +38,10 @@ public:
 
 private:
     std::string m_name;
-    std::ofstream m_ofs;
+    int m_dir_fd;
+    int m_fd;
     bool m_no_space;
 
     void RaiseError [[noreturn]] (const std::string action_attempted, const std::system_error& ex);
+    void DiscardAndRaise [[noreturn]] (const std::string action_attempted, const std::system_error& ex);
 };
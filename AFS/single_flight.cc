@@ -0,0 +1,23 @@
+#include "single_flight.h"
+
+int SingleFlight::run(const std::string &key, const std::function<int()> &call) {
+    std::unique_lock<std::mutex> l(lock);
+    auto it = calls.find(key);
+    if (it != calls.end()) {
+        std::shared_ptr<Call> running = it->second;
+        finished.wait(l, [&]() { return running->finished; });
+        return running->result;
+    }
+    std::shared_ptr<Call> own = std::make_shared<Call>();
+    calls[key] = own;
+    l.unlock();
+
+    int result = call();
+
+    l.lock();
+    own->result = result;
+    own->finished = true;
+    calls.erase(key);
+    finished.notify_all();
+    return result;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// SingleFlight: Runs one call per key at a time. Callers arriving while the call for their key is
+// running wait for it and share its result instead of making their own.
+class SingleFlight {
+    struct Call {
+        bool finished = false;
+        int result = 0;
+    };
+
+    std::mutex lock;
+    std::condition_variable finished;
+    std::unordered_map<std::string, std::shared_ptr<Call>> calls;
+
+   public:
+    int run(const std::string &key, const std::function<int()> &call);
+};
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <iterator>
+
+#include "client_common.h"
+#include "upload_batcher.h"
+
+void UploadBatcher::submit(PendingUpload upload) {
+    std::unique_lock<std::mutex> l(lock);
+
+    not_full.wait(l, [this]() { return pendingBytes < maxBytes; });
+
+    pendingBytes += upload.data.size();
+    pending.push_back(std::move(upload));
+
+    l.unlock();
+    wakeup.notify_one();
+}
+
+// Wait until every file submitted so far is on the server. Called before operations that the
+// server must see after those uploads, such as unlink and rename.
+void UploadBatcher::drain() {
+    std::unique_lock<std::mutex> l(lock);
+    if (pending.empty() && !sending) {
+        return;
+    }
+    flushRequested = true;
+    wakeup.notify_one();
+    drained.wait(l, [this]() { return pending.empty() && !sending; });
+}
+
+void UploadBatcher::consumer() {
+    std::vector<PendingUpload> failed;
+    while (true) {
+        std::vector<PendingUpload> batch;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            // Requeued ahead of the files closed meanwhile, so a path keeps the order of its closes
+            for (PendingUpload &upload : failed) {
+                pendingBytes += upload.data.size();
+            }
+            pending.insert(pending.begin(), std::make_move_iterator(failed.begin()),
+                           std::make_move_iterator(failed.end()));
+            if (!failed.empty() && notDone) {
+                // Give the server some time to come back
+                unsigned attempts = failed.front().attempts;
+                wakeup.wait_for(l, std::chrono::milliseconds(retryMs * attempts),
+                                [this]() { return !notDone; });
+            }
+            failed.clear();
+            wakeup.wait(l, [this]() { return !pending.empty() || !notDone; });
+            if (pending.empty()) {
+                return;
+            }
+            // Give the files closed right after this one a chance to join the batch
+            wakeup.wait_for(l, std::chrono::milliseconds(windowMs), [this]() {
+                return pendingBytes >= maxBytes || flushRequested || !notDone;
+            });
+            batch.swap(pending);
+            pendingBytes = 0;
+            flushRequested = false;
+            sending = true;
+        }
+        not_full.notify_all();
+
+        for (PendingUpload &upload : send(batch)) {
+            // A newer close of the path has its own upload
+            if (!upload.recoveryFile.empty() &&
+                recoveryFiles->current(upload.path.c_str()) != upload.recoveryFile) {
+                continue;
+            }
+            if (++upload.attempts < maxAttempts) {
+                failed.push_back(std::move(upload));
+            } else if (debugMode <= DebugLevel::LevelError) {
+                printf("%s \t: Giving up on %s, it is sent again at the next start.\n",
+                       __func__, upload.path.c_str());
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            // drain() waits for the retries too
+            sending = !failed.empty();
+        }
+        drained.notify_all();
+    }
+}
+
+// Upload 'batch' in one stream. Every file carries an NVERIFY of the time it was closed with,
+// so a file the server already has is skipped. The stored files are handed to 'stored' with
+// the attributes the server gave them.
+std::vector<PendingUpload> UploadBatcher::send(std::vector<PendingUpload> &batch) {
+    const unsigned long message_size = 1UL << 20;
+    std::vector<BatchPutRequest> messages(1);
+    unsigned long bytes = 0;
+    for (PendingUpload &upload : batch) {
+        if (bytes >= message_size) {
+            messages.emplace_back();
+            bytes = 0;
+        }
+        bytes += upload.data.size();
+
+        BatchFile *file = messages.back().add_files();
+        NverifyRequest *nverify = file->mutable_nverify();
+        nverify->set_path(upload.path);
+        nverify->set_mtimtvsec(upload.local.st_mtim.tv_sec);
+        nverify->set_mtimtvnsec(upload.local.st_mtim.tv_nsec);
+        SmallFile *put = file->mutable_file();
+        put->set_path(upload.path);
+        put->set_mode(upload.local.st_mode & 07777);
+        put->set_content(upload.data);  // kept in case the file has to be sent again
+    }
+
+    BatchPutReply reply;
+    int res = client->rpc_putBatch(messages, &reply);
+    if (res != 0) {
+        if (debugMode <= DebugLevel::LevelError) {
+            printf("%s \t: Batch of %zu files failed to send to server.\n", __func__,
+                   batch.size());
+        }
+        return std::move(batch);
+    }
+
+    std::vector<PendingUpload> failed;
+    for (int i = 0; i < (int)batch.size(); i++) {
+        PendingUpload &upload = batch[i];
+        const char *path = upload.path.c_str();
+        if (i >= reply.stats_size()) {
+            failed.push_back(std::move(upload));
+            continue;
+        }
+        const Stat &result = reply.stats(i);
+        if (result.err() == EEXIST) {
+            recoveryFiles->uploaded(path, upload.recoveryFile);
+            continue;  // Unchanged
+        }
+        if (result.err() != 0) {
+            if (debugMode <= DebugLevel::LevelError) {
+                printf("%s \t: File %s failed to send to server: %s\n", __func__,
+                       path, strerror(result.err()));
+            }
+            failed.push_back(std::move(upload));
+            continue;
+        }
+        recoveryFiles->uploaded(path, upload.recoveryFile);
+        struct stat remote;
+        AfsClient::toStat(result, &remote);
+        stored(upload, &remote);
+    }
+    return failed;
+}
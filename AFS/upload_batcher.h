@@ -0,0 +1,75 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "AfsClient.h"
+#include "recovery_files.h"
+
+// A small dirty file waiting in the UploadBatcher
+struct PendingUpload {
+    std::string path;
+    struct stat local;  // attributes of the cached copy when it was closed
+    std::string data;
+    std::string recoveryFile;  // removed once the server has the data, empty without temp files
+    unsigned attempts = 0;
+};
+
+// UploadBatcher: Groups the small dirty files closed within 'windowMs' of each other and sends
+// them in one putBatch stream, so closing many small files in a row (untar, code generators)
+// is limited by bandwidth instead of by a round trip per file. A file that fails is sent again
+// with the next batch, up to 'maxAttempts' times; after that its recovery file is left for the
+// next start.
+struct UploadBatcher {
+    // Called for each file the server stored, with the attributes the server gave it
+    typedef void (*Stored)(const PendingUpload &upload, struct stat *remote);
+
+    AfsClient *client;
+    RecoveryFiles *recoveryFiles;
+    Stored stored;
+    const int windowMs;
+    const unsigned long maxBytes;  // a batch is sent as soon as it holds this many bytes
+    const unsigned maxAttempts;
+    const int retryMs;  // wait after a failed batch, multiplied by the number of attempts
+
+    std::mutex lock;
+
+    std::condition_variable wakeup;   // the consumer has work, or should stop waiting
+    std::condition_variable not_full;
+    std::condition_variable drained;
+
+    std::vector<PendingUpload> pending;
+    unsigned long pendingBytes;
+    bool sending;         // a batch taken from 'pending' is on its way to the server
+    bool flushRequested;  // someone in drain() is waiting, do not wait for the window
+    bool notDone;
+
+    UploadBatcher(AfsClient *client, RecoveryFiles *recoveryFiles, Stored stored, int windowMs,
+                  unsigned long maxBytes, unsigned maxAttempts, int retryMs)
+        : client(client), recoveryFiles(recoveryFiles), stored(stored), windowMs(windowMs),
+          maxBytes(maxBytes), maxAttempts(maxAttempts), retryMs(retryMs), pendingBytes(0),
+          sending(false), flushRequested(false), notDone(true) {}
+
+    UploadBatcher(const UploadBatcher &) = delete;
+    UploadBatcher &operator=(const UploadBatcher &) = delete;
+
+    void submit(PendingUpload upload);
+
+    void drain();
+
+    void consumer();
+
+    // Returns the uploads that failed
+    std::vector<PendingUpload> send(std::vector<PendingUpload> &batch);
+
+    // Pending uploads are still sent before the consumer returns
+    void cleanupBuffer() {
+        std::lock_guard<std::mutex> guard(lock);
+        notDone = false;
+        wakeup.notify_one();
+    }
+};
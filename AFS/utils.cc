@@ -1,3 +1,4 @@
+#include <atomic>
 #include <sstream>
 #include <stdexcept>
 #include <cassert>
@@ -11,6 +12,7 @@
 #include <libgen.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "utils.h"
 
@@ -22,6 +24,39 @@ std::string extract_basename(const std::string& path)
     return result;
 }
 
+std::string unique_suffix()
+{
+    static std::atomic<unsigned long> next(0);
+    return std::to_string(getpid()) + "." + std::to_string(next++);
+}
+
+std::vector<std::string> parse_dir_list(const char* dir_list)
+{
+    std::vector<std::string> dirs;
+    std::stringstream list(dir_list != NULL ? dir_list : "");
+    std::string dir;
+    while (std::getline(list, dir, ':')) {
+        while (dir.size() > 1 && dir.back() == '/') {
+            dir.pop_back();
+        }
+        if (!dir.empty()) {
+            dirs.push_back(dir[0] == '/' ? dir : "/" + dir);
+        }
+    }
+    return dirs;
+}
+
+bool is_in_dirs(const std::vector<std::string>& dirs, const char* path)
+{
+    std::string p(path);
+    for (const std::string& dir : dirs) {
+        if (dir == "/" || p == dir || p.compare(0, dir.size() + 1, dir + "/") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void raise_from_system_error_code(const std::string& user_message, int err)
 {
     std::ostringstream sts;
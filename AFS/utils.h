@@ -1,10 +1,21 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 // Get the basename of the given path
 std::string extract_basename(const std::string& path);
 
+// A suffix for the names of temporary files, unique among the files made by any thread of any
+// running process
+std::string unique_suffix();
+
+// The directories of a ':' separated list, as client paths without a trailing '/'
+std::vector<std::string> parse_dir_list(const char* dir_list);
+
+// Is the client path 'path' one of 'dirs' or below one of them?
+bool is_in_dirs(const std::vector<std::string>& dirs, const char* path);
+
 // Raise a C++ system_error exception from the user-supplied error-code 'err', which
 // should be a valid errno value
 void raise_from_system_error_code [[noreturn]] (const std::string& user_message, int err);
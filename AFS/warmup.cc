@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "client_common.h"
+#include "warmup.h"
+
+// Warm the cache with 'manifest' in the background, after the warmups already queued
+void Warmup::start(const std::string &manifest) {
+    std::lock_guard<std::mutex> guard(lock);
+    queued.push_back(manifest);
+    finished = false;
+    if (running) {
+        return;
+    }
+    if (worker != NULL) {
+        worker->join();  // it has finished already
+        delete worker;
+    }
+    running = true;
+    worker = new std::thread(&Warmup::run, this);
+}
+
+void Warmup::run() {
+    while (!cancelled) {
+        std::string manifest;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (queued.empty()) {
+                running = false;
+                return;
+            }
+            manifest.swap(queued.front());
+            queued.pop_front();
+        }
+        warm(manifest);
+    }
+    running = false;
+}
+
+void Warmup::warm(const std::string &manifest) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        total = fetched = fresh = failed = bytes = 0;
+        finished = false;
+        get_time(&ts_start);
+    }
+    std::vector<std::string> paths = expand(manifest);
+    total = paths.size();
+
+    std::atomic<size_t> next(0);
+    auto fetchFiles = [&]() {
+        for (size_t i = next++; i < paths.size() && !cancelled; i = next++) {
+            const char *path = paths[i].c_str();
+            unsigned long size = 0;
+            int res = fetch(path, &size);
+            if (res == 0) {
+                fresh++;
+            } else if (res == 1) {
+                fetched++;
+                bytes += size;
+            } else {
+                failed++;
+                if (debugMode <= DebugLevel::LevelError) {
+                    printf("%s \t: Failed to warm %s: %s\n", __func__, path, strerror(-res));
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(fetchFiles);
+    }
+    for (std::thread &t : workers) {
+        t.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        get_time(&ts_end);
+        finished = true;
+    }
+    printf("%s", report().c_str());
+}
+
+std::string Warmup::report() {
+    std::lock_guard<std::mutex> guard(lock);
+    struct timespec now;
+    if (!running && !finished) {
+        return "warmup: idle\n";
+    }
+    if (finished) {
+        now = ts_end;
+    } else {
+        get_time(&now);
+    }
+    double seconds = get_time_diff(&ts_start, &now) / 1e3;
+    double megabytes = bytes / 1048576.0;
+    char line[256];
+    snprintf(line, sizeof(line),
+             "warmup: %s, %lu/%lu files, %lu fetched, %lu fresh, %lu failed, %.1f MB in %.2f s, "
+             "%.1f MB/s\n",
+             finished ? "done" : "running", (unsigned long)(fetched + fresh + failed),
+             (unsigned long)total, (unsigned long)fetched, (unsigned long)fresh,
+             (unsigned long)failed, megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+    return line;
+}
+
+// Abandon the files not fetched yet, at unmount
+void Warmup::stop() {
+    cancelled = true;
+    std::thread *stopped;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopped = worker;
+        worker = NULL;
+    }
+    if (stopped != NULL) {
+        stopped->join();
+        delete stopped;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <time.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Warmup: Warms the cache from a manifest: one path or glob per line, from the root of the mount.
+// A line ending in '/' names a directory whose files are all warmed, recursively. Blank lines
+// and lines starting with '#' are ignored. Matching files are fetched by 'threads' workers,
+// which skip those whose cached copy is current.
+struct Warmup {
+    // The files named by the lines of a manifest
+    typedef std::vector<std::string> (*Expand)(const std::string &manifest);
+
+    // Bring the cached copy of 'path' up to date. Returns 1 if it was fetched, with its size in
+    // 'bytes', 0 if the cached copy was current, or a negated errno.
+    typedef int (*Fetch)(const char *path, unsigned long *bytes);
+
+    Expand expand;
+    Fetch fetch;
+    const int threads;
+
+    std::mutex lock;
+    std::thread *worker;
+    std::deque<std::string> queued;  // manifests waiting for the current warmup to finish
+    std::string written;             // manifest written to the control file, started on release
+
+    std::atomic<bool> running;
+    std::atomic<bool> cancelled;
+    bool finished;  // the last warmup is complete, under 'lock' as are the times
+    std::atomic<unsigned long> total;
+    std::atomic<unsigned long> fetched;
+    std::atomic<unsigned long> fresh;
+    std::atomic<unsigned long> failed;
+    std::atomic<unsigned long> bytes;
+    struct timespec ts_start;
+    struct timespec ts_end;
+
+    Warmup(Expand expand, Fetch fetch, int threads)
+        : expand(expand), fetch(fetch), threads(threads), worker(NULL), running(false),
+          cancelled(false), finished(false), total(0), fetched(0), fresh(0), failed(0), bytes(0) {}
+
+    Warmup(const Warmup &) = delete;
+    Warmup &operator=(const Warmup &) = delete;
+
+    void start(const std::string &manifest);
+
+    void run();
+
+    void warm(const std::string &manifest);
+
+    std::string report();
+
+    void stop();
+};
@@ -0,0 +1,149 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "client_common.h"
+#include "write_through.h"
+
+void WriteThrough::write(const char *buf, size_t size, off_t offset) {
+    std::unique_lock<std::mutex> l(lock);
+    while (!failed && !pending.empty() &&
+           (offset != pendingOffset + (off_t)pending.size() ||
+            pending.size() + size > maxRange)) {
+        sendPending(l);
+    }
+    if (failed) {
+        return;
+    }
+    if (pending.empty()) {
+        pendingOffset = offset;
+        get_time(&pendingSince);
+    }
+    pending.append(buf, size);
+    if (pending.size() >= maxRange) {
+        sendPending(l);
+    }
+}
+
+void WriteThrough::sendAged() {
+    std::unique_lock<std::mutex> l(lock);
+    struct timespec now;
+    get_time(&now);
+    if (!failed && !pending.empty() &&
+        get_time_diff(&pendingSince, &now) >= delayMs &&
+        inflight.size() < (size_t)maxInflight &&
+        !overlapsInflight(pendingOffset, pendingOffset + pending.size())) {
+        sendPending(l);
+    }
+}
+
+bool WriteThrough::sync(bool durable) {
+    std::unique_lock<std::mutex> l(lock);
+    while (!failed && !pending.empty()) {
+        sendPending(l);
+    }
+    changed.wait(l, [&]() { return inflight.empty(); });
+    if (!failed && durable) {
+        // Once the ranges are written, an empty write has the server sync the file
+        send(l, std::string(), 0, true);
+        changed.wait(l, [&]() { return inflight.empty(); });
+    }
+    return !failed;
+}
+
+void WriteThrough::fail() {
+    std::lock_guard<std::mutex> guard(lock);
+    failed = true;
+    pending.clear();
+}
+
+bool WriteThrough::overlapsInflight(off_t start, off_t end) {
+    for (const auto &range : inflight) {
+        if (start < range.second && range.first < end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void WriteThrough::sendPending(std::unique_lock<std::mutex> &l) {
+    std::string data;
+    data.swap(pending);
+    send(l, std::move(data), pendingOffset, false);
+}
+
+// Send 'data' as the range at 'offset'. Waits, with 'l' released, until it may go.
+void WriteThrough::send(std::unique_lock<std::mutex> &l, std::string data, off_t offset,
+                        bool durable) {
+    const off_t end = offset + data.size();
+    changed.wait(l, [&]() {
+        return inflight.size() < (size_t)maxInflight &&
+               !overlapsInflight(offset, end);
+    });
+    Call *call = new Call();
+    call->request.set_path(path);
+    call->request.set_offset(offset);
+    call->request.set_size(data.size());
+    call->request.set_sync(durable);
+    call->request.set_buffer(std::move(data));
+    auto range = std::make_pair(offset, end);
+    inflight.push_back(range);
+    l.unlock();
+    client->rpc_writeAsync(
+        &call->context, &call->request, &call->reply, [this, call, range](Status status) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!status.ok() || call->reply.err() != 0) {
+                if (debugMode <= DebugLevel::LevelError) {
+                    printf("WriteThrough \t: Failed to write %s at %ld, uploading it at close\n",
+                           path.c_str(), range.first);
+                }
+                failed = true;
+                pending.clear();
+            }
+            inflight.erase(std::find(inflight.begin(), inflight.end(), range));
+            changed.notify_all();
+            delete call;
+        });
+    l.lock();
+}
+
+void WriteThroughs::add(WriteThrough *handle) {
+    std::lock_guard<std::mutex> guard(lock);
+    live.insert(handle);
+}
+
+void WriteThroughs::remove(WriteThrough *handle) {
+    std::lock_guard<std::mutex> guard(lock);
+    live.erase(handle);
+}
+
+void WriteThroughs::start() {
+    ticker = new std::thread(&WriteThroughs::run, this);
+}
+
+void WriteThroughs::run() {
+    std::unique_lock<std::mutex> l(lock);
+    while (notDone) {
+        wakeup.wait_for(l, std::chrono::milliseconds(delayMs / 2),
+                        [&]() { return !notDone; });
+        for (WriteThrough *handle : live) {
+            handle->sendAged();
+        }
+    }
+}
+
+void WriteThroughs::stop() {
+    std::thread *stopped;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        notDone = false;
+        stopped = ticker;
+        ticker = NULL;
+    }
+    wakeup.notify_all();
+    if (stopped != NULL) {
+        stopped->join();
+        delete stopped;
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "AfsClient.h"
+
+// WriteThrough: The writes through a handle in write-through mode (--write_through_dirs), for
+// shared logs and other files read while they are written. Besides going to the handle's file,
+// writes are sent to the server as they come instead of with the whole file at close. Adjacent
+// writes are merged into ranges of up to 'maxRange' bytes. A range is sent once full, when a write
+// does not extend it, or 'delayMs' after its first write, with up to 'maxInflight' ranges in
+// flight. Overlapping ranges are not in flight together,
+// so they land in order. If a range cannot be written, the close uploads the whole file instead.
+struct WriteThrough {
+    struct Call {
+        WriteRequest request;
+        WriteResult reply;
+        ClientContext context;
+    };
+
+    AfsClient *client;
+    const size_t maxRange;
+    const int maxInflight;
+    const int delayMs;
+
+    std::string path;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::string pending;  // the range being merged
+    off_t pendingOffset;
+    struct timespec pendingSince;
+    std::vector<std::pair<off_t, off_t>> inflight;  // [start, end) of the ranges sent, not answered
+    bool failed;
+
+    WriteThrough(AfsClient *client, const char *path, size_t maxRange, int maxInflight, int delayMs)
+        : client(client), maxRange(maxRange), maxInflight(maxInflight), delayMs(delayMs),
+          path(path), pendingOffset(0), failed(false) {}
+
+    WriteThrough(const WriteThrough &) = delete;
+    WriteThrough &operator=(const WriteThrough &) = delete;
+
+    void write(const char *buf, size_t size, off_t offset);
+
+    // Send the range being merged if it is older than 'delayMs' and can go at once
+    void sendAged();
+
+    // Send everything and wait for it, then have the server sync the file if 'durable'. Returns
+    // false if some range could not be written.
+    bool sync(bool durable);
+
+    // The file changed in a way not written through (a truncation)
+    void fail();
+
+   private:
+    bool overlapsInflight(off_t start, off_t end);
+
+    void sendPending(std::unique_lock<std::mutex> &l);
+
+    void send(std::unique_lock<std::mutex> &l, std::string data, off_t offset, bool durable);
+};
+
+// The handles in write-through mode, and the thread that sends their aged ranges, woken every
+// 'delayMs' / 2
+struct WriteThroughs {
+    const int delayMs;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::unordered_set<WriteThrough *> live;
+    std::thread *ticker;
+    bool notDone;
+
+    WriteThroughs(int delayMs) : delayMs(delayMs), ticker(NULL), notDone(true) {}
+
+    WriteThroughs(const WriteThroughs &) = delete;
+    WriteThroughs &operator=(const WriteThroughs &) = delete;
+
+    void add(WriteThrough *handle);
+
+    // After this the ticker no longer uses 'handle'
+    void remove(WriteThrough *handle);
+
+    void start();
+
+    void run();
+
+    void stop();
+};